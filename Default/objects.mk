@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lfuse -ltorrentc -ltorrent-rasterbar
+LIBS := -lfuse -ltorrentc -ltorrent-rasterbar -lpthread
 
@@ -5,18 +5,61 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../bdecode.c \
+../bdstream.c \
+../bdtape.c \
 ../bentypes.c \
-../corsair.c 
+../corbits.c \
+../corcache.c \
+../corimport.c \
+../corlog.c \
+../cormeta.c \
+../cornode.c \
+../corprogress.c \
+../corsair.c \
+../corstat.c \
+../corstatus.c \
+../sha1.c 
 
 OBJS += \
 ./bdecode.o \
+./bdstream.o \
+./bdtape.o \
 ./bentypes.o \
-./corsair.o 
+./corbits.o \
+./corcache.o \
+./corimport.o \
+./corlog.o \
+./cormeta.o \
+./cornode.o \
+./corprogress.o \
+./corsair.o \
+./corstat.o \
+./corstatus.o \
+./sha1.o \
+./torext.o 
+
+CPP_SRCS += \
+../torext.cpp 
 
 C_DEPS += \
 ./bdecode.d \
+./bdstream.d \
+./bdtape.d \
 ./bentypes.d \
-./corsair.d 
+./corbits.d \
+./corcache.d \
+./corimport.d \
+./corlog.d \
+./cormeta.d \
+./cornode.d \
+./corprogress.d \
+./corsair.d \
+./corstat.d \
+./corstatus.d \
+./sha1.d 
+
+CPP_DEPS += \
+./torext.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
@@ -27,4 +70,11 @@ C_DEPS += \
 	@echo 'Finished building: $<'
 	@echo ' '
 
+%.o: ../%.cpp
+	@echo 'Building file: $<'
+	@echo 'Invoking: GCC C++ Compiler'
+	g++ -I../include -O0 -g -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
 
@@ -1,81 +1,302 @@
 #include <ctype.h>
-#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bdecode.h"
+#include "sha1.h"
+
+// Maps the file at |path| read-only into memory so that it can be
+// decoded with BD_ZEROCOPY. The mapping must be kept alive for as long
+// as any tree decoded from it is in use.
+//
+// RETURNS
+// A bd_source describing the mapping, or NULL if the file could not
+// be opened or mapped.
+bd_source* bd_source_map(const char* path)
+{
+	int fd;
+	struct stat st;
+	bd_source* src;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	src = malloc(sizeof(bd_source));
+	if(src == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	src->size = st.st_size;
+	src->buf = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(src->buf == MAP_FAILED)
+	{
+		free(src);
+		return NULL;
+	}
+	return src;
+}
+void bd_source_unmap(bd_source* src)
+{
+	if(src == NULL)
+		return;
+
+	munmap(src->buf, src->size);
+	free(src);
+}
 
 // Main entry point for decoding bencoded .torrent files. 
 void* decode(unsigned char* buf, size_t size)
+{
+  return decode_flags(buf, size, 0);
+}
+
+// Decodes into plain heap memory. The result is released with
+// bd_dict_destroy().
+void* decode_flags(unsigned char* buf, size_t size, int flags)
+{
+  bd_ctx ctx;
+  void* root;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.flags = flags;
+  root = decode_ctx(&ctx, buf, size);
+  free(ctx.stack);
+  bd_tape_free(&ctx.tape);
+  return root;
+}
+
+// Decodes using |ctx| for allocation. With an arena-backed context (see
+// bd_ctx_create()) the result lives until bd_ctx_destroy()/bd_ctx_reset().
+//
+// Eager decodes go through the recursive decoder below, which measures
+// faster than building a tape first (see tools/bdbench.c). BD_LAZY
+// decodes need the tape to skip deferred values, so they go through
+// bdtape.c. Both accept and reject the same inputs.
+void* decode_ctx(bd_ctx* ctx, unsigned char* buf, size_t size)
 {
   int index = 0;
 
-  if(buf[0] != 'd')
+  if(size == 0 || buf[0] != 'd')
+  {
+	  printf("Invalid character at start of bencoded section.");
+	  return NULL;
+  }
+  if(ctx->flags & BD_LAZY)
+    return decode_tape(ctx, buf, size);
+  return decode_dictionary(ctx, buf, &index, size);
+}
+
+// Frees a value a failed decode had already produced. Arena memory and
+// borrowed strings are left alone; they go with the context or source.
+static void decode_drop(bd_ctx* ctx, enum bd_type type, void* data, int flags)
+{
+  if(ctx->arena || data == NULL)
+    return;
+
+  switch(type)
   {
-	  printf("Invalid character :%s: at start of bencoded section.", (char)buf[0]);
-	  return 1;
+    case DICTIONARY:
+      bd_dict_destroy(data);
+      break;
+    case LIST:
+      bd_list_destroy(data);
+      break;
+    case STRING:
+      if(!(flags & BD_BORROWED))
+        free(data);
+      break;
+    default:
+      break;
   }
-  return decode_dictionary(buf, &index, size);
+}
+// Drops everything a failed decode pushed onto the scratch stack since
+// |base|.
+static void decode_unwind(bd_ctx* ctx, int base)
+{
+  int i;
+
+  for(i = base; i < ctx->stack_used; i++)
+    decode_drop(ctx, ctx->stack[i].type, ctx->stack[i].data, ctx->stack[i].flags);
+  ctx->stack_used = base;
 }
 
-bd_dict* decode_dictionary(unsigned char* buf, int* index, size_t size)
+// RETURNS
+// Nonzero if the number decode_number() read from |start| up to |end| is
+// well formed: an optional '-', one to 19 digits that fit in 64 bits
+// and a closing 'e', as the indexed decoder requires.
+static int decode_number_ok(unsigned char* buf, int start, int end, size_t size)
+{
+  uint64_t n = 0;
+  int from;
+  int i;
+
+  if(end >= size || buf[end] != 'e')
+    return 0;
+  from = start + 1 + (buf[start + 1] == '-');
+  if(end == from || end - from > 19)
+    return 0;
+  for(i = from; i < end; i++)
+    n = (n * 10) + (buf[i] - '0');
+  return n <= INT64_MAX;
+}
+
+// Decodes a bencoded dictionary.
+//
+// PRECONDITION
+// Given a char buffer of size |size| with index set to the offset
+// where the type identifier 'd' appears.
+//
+// RETURNS
+// Reference to a sealed bd_dict holding the pairs in on-wire order, or
+// NULL if the input is malformed, nests deeper than BD_STREAM_DEPTH or
+// memory ran out.
+//
+// POSTCONDITION
+// Index will be set to the offset where the terminating character
+// 'e' was found.
+//
+// Keys and values are collected pairwise on the context scratch stack
+// and copied into an exactly sized entry array once the 'e' is seen.
+bd_dict* decode_dictionary(bd_ctx* ctx, unsigned char* buf, int* index, size_t size)
 {
   char c;
   bd_dict* retdict;
   int parse_key;
   char* cur_key;
+  size_t cur_keylen;
   void* cur_val;
-  
+  enum bd_type cur_type;
+  size_t len;
+  int i;
+  int base = ctx->stack_used;
+  size_t start = *index;
+  int ent_flags = (ctx->flags & BD_ZEROCOPY) ? BD_BORROWED : 0;
+
+  if(ctx->depth == BD_STREAM_DEPTH)
+    return NULL;
+  ctx->depth++;
+
   (*index)++;
   parse_key = 1;
-  retdict = (bd_dict*)malloc(sizeof(bd_dict));
-  while(buf[*index] != 'e')
+  while(*index < size && buf[*index] != 'e')
   {
     c = buf[*index];
     if(parse_key)
     {
-      if(isdigit(c))
-      {
-        cur_key = decode_string(buf, index, size);
-        parse_key = 0;
-      }
-      else
+      if(!isdigit(c))
       {
         printf("Invalid key format for dictionary.");
+        goto fail;
       }
+      cur_key = decode_string(ctx, buf, index, size, &cur_keylen);
+      if(cur_key == NULL)
+        goto fail;
+      parse_key = 0;
     }
     else
     {
-      if(isdigit(c))
+      len = 0;
+      switch(c)
       {
-        char* str;
-        str = decode_string(buf, index, size);
-        bd_dict_add(&retdict, cur_key, STRING, str);
+        case 'i':
+          cur_type = NUMBER;
+          i = *index;
+          cur_val = (void*)decode_number(buf, index, size);
+          if(!decode_number_ok(buf, i, *index, size))
+            goto fail;
+          break;
+        case 'l':
+          cur_type = LIST;
+          cur_val = decode_list(ctx, buf, index, size);
+          if(cur_val == NULL)
+            goto fail;
+          break;
+        case 'd':
+          cur_type = DICTIONARY;
+          cur_val = decode_dictionary(ctx, buf, index, size);
+          if(cur_val == NULL)
+            goto fail;
+          break;
+        default:
+          if(!isdigit(c))
+          {
+            printf("Invalid data type specifier.");
+            goto fail;
+          }
+          cur_type = STRING;
+          cur_val = decode_string(ctx, buf, index, size, &len);
+          if(cur_val == NULL)
+            goto fail;
+          break;
       }
-      else
+
+      // Key and value go on the stack as a pair or not at all, so that
+      // every key stays next to its own value.
+      if(bd_ctx_push(ctx, STRING, cur_key, cur_keylen, ent_flags) < 0)
       {
-        switch(c)
-        {
-          case 'i':
-            cur_val = decode_number(buf, index, size);
-            bd_dict_add(&retdict, cur_key, NUMBER, cur_val);
-            break;
-          case 'l':
-            cur_val = decode_list(buf, index, size);
-            bd_dict_add(&retdict, cur_key, LIST, cur_val);
-            break;
-          case 'd':
-            cur_val = decode_dictionary(buf,index, size);
-            bd_dict_add(&retdict, cur_key, DICTIONARY, cur_val);
-            break;
-          default:
-            printf("Invalid data type specifier.");
-            return 1;
-        }
+        decode_drop(ctx, cur_type, cur_val, ent_flags);
+        goto fail;
       }
       parse_key = 1;
+      if(bd_ctx_push(ctx, cur_type, cur_val, len, ent_flags) < 0)
+      {
+        decode_drop(ctx, cur_type, cur_val, ent_flags);
+        goto fail;
+      }
     }
     (*index)++;
   }
+
+  // Unterminated, or a key is left without a value.
+  if(*index >= size || !parse_key)
+    goto fail;
+
+  retdict = bd_dict_create(ctx, (ctx->stack_used - base) / 2);
+  if(retdict == NULL)
+    goto fail;
+  for(i = base; i + 1 < ctx->stack_used; i += 2)
+  {
+    if(bd_dict_add(ctx, retdict, ctx->stack[i].str, ctx->stack[i].len,
+                   ctx->stack[i + 1].type, ctx->stack[i + 1].data,
+                   ctx->stack[i + 1].len, ctx->stack[i + 1].flags) < 0)
+    {
+      // The entries are still owned by the stack; only the container
+      // goes.
+      if(!ctx->arena)
+      {
+        free(retdict->entries);
+        free(retdict);
+      }
+      goto fail;
+    }
+  }
+  ctx->stack_used = base;
+  bd_dict_seal(ctx, retdict);
+  retdict->start = start;
+  retdict->end = *index + 1;
+  ctx->depth--;
   return retdict;
+
+fail:
+  // A key not yet on the stack is only referenced from here.
+  if(!parse_key)
+    decode_drop(ctx, STRING, cur_key, ent_flags);
+  decode_unwind(ctx, base);
+  ctx->depth--;
+  return NULL;
 }
 
 // Decodes a bencoded number.
@@ -91,18 +312,26 @@ bd_dict* decode_dictionary(unsigned char* buf, int* index, size_t size)
 // POSTCONDITION
 // Index will be set to the terminating character of this range, in
 // this case the first occurrence of 'e' in the bencoded block.
+//
+// The digits are parsed by hand rather than with strtoll(), which
+// would run past the end of a buffer that isn't null-terminated, such
+// as a mapped file.
 long long decode_number(unsigned char* buf, int* index, size_t size)
 {
-	long long retnum;
-	char* nstart;
-	char* nend;
+	unsigned long long n = 0;
+	int negative;
 
 	(*index)++;
-	nstart = &buf[(*index)];
-	nend = &buf[(*index) + 1];
-	retnum = strtoll(nstart, &nend, 10);
-	(*index) += (nend - nstart);
-	return retnum;
+	negative = (*index < size && buf[*index] == '-');
+	if(negative)
+		(*index)++;
+
+	while(*index < size && isdigit(buf[*index]))
+	{
+		n = (n * 10) + (buf[*index] - '0');
+		(*index)++;
+	}
+	return (long long)(negative ? 0 - n : n);
 }
 
 // Decodes a bencoded byte string.
@@ -112,27 +341,53 @@ long long decode_number(unsigned char* buf, int* index, size_t size)
 // where the type identifier appears.
 //
 // RETURNS
-// Reference to a null-terminated string. Note that this string is
-// guaranteed to be null-terminated but is not guaranteed to be valid
-// ASCII or UTF-8 encoded. It's just bytes, bro.
+// Reference to the string bytes, with its length stored in |len|, or
+// NULL if the length prefix is malformed or runs past the end of the
+// buffer. Without
+// BD_ZEROCOPY this is a copy (from the context arena, if any) that is guaranteed to be
+// null-terminated but is not guaranteed to be valid ASCII or UTF-8
+// encoded. It's just bytes, bro. With BD_ZEROCOPY it points straight
+// into |buf| and is NOT null-terminated.
 //
 // POSTCONDITION
 // Index will be set to the offset where the terminating character
 // for this parsed block occurred. In this case, it will be set to the
 // index of the last byte in the string as it appears in the buffer.
-char* decode_string(unsigned char* buf, int* index, size_t size)
+char* decode_string(bd_ctx* ctx, unsigned char* buf, int* index, size_t size, size_t* len)
 {
-	int len;
+	size_t n = 0;
+	int start = *index;
 	char* retstr;
 
-	len = atoi(&buf[*index]);
-	(*index) += log10(len) + 2;
-	retstr = malloc((sizeof(char) * len) + 1);
+	while(*index < size && isdigit(buf[*index]))
+	{
+		n = (n * 10) + (buf[*index] - '0');
+		(*index)++;
+	}
+
+	// Skip the ':' separator and make sure the payload is in range.
+	if(*index == start || *index - start > 19 || *index >= size || buf[*index] != ':')
+		return NULL;
+	(*index)++;
+	if(n > size - *index)
+		return NULL;
 
-	memcpy(retstr, (const void*)&buf[*index], sizeof(char) * len);
-	retstr[len] = '\0';
+	if(ctx->flags & BD_ZEROCOPY)
+	{
+		retstr = (char*)&buf[*index];
+	}
+	else
+	{
+		retstr = bd_alloc(ctx, (sizeof(char) * n) + 1);
+		if(retstr == NULL)
+			return NULL;
+		memcpy(retstr, (const void*)&buf[*index], sizeof(char) * n);
+		retstr[n] = '\0';
+	}
 
-	(*index) += (len - 1);
+	*len = n;
+	(*index) += n;
+	(*index)--;
 	return retstr;
 }
 
@@ -144,45 +399,109 @@ char* decode_string(unsigned char* buf, int* index, size_t size)
 //
 // RETURNS
 // Reference to a bd_list object containing the data described in
-// the bencoded block. Note that it is possible to nest these
-// container types.
+// the bencoded block, or NULL as for decode_dictionary(). Note that it
+// is possible to nest these container types.
 //
 // POSTCONDITION
 // Index will be set to the offset where the terminating character
 // 'e' was found.
-bd_list* decode_list(unsigned char* buf, int* index, size_t size)
+//
+// Elements are collected on the context scratch stack first, so the
+// entry array is allocated once at its final size.
+bd_list* decode_list(bd_ctx* ctx, unsigned char* buf, int* index, size_t size)
 {
 	char c;
 	void* cur_ent;
-	bd_list* list = bd_list_create();
+	enum bd_type type;
+	size_t len;
+	bd_list* list;
+	int from;
+	int base = ctx->stack_used;
+	size_t start = *index;
+	int ent_flags = (ctx->flags & BD_ZEROCOPY) ? BD_BORROWED : 0;
+
+	if(ctx->depth == BD_STREAM_DEPTH)
+		return NULL;
+	ctx->depth++;
 
 	(*index)++;
-	while(buf[*index] != 'e')
+	while(*index < size && buf[*index] != 'e')
 	{
 		c = buf[*index];
+		len = 0;
 		switch(c)
 		{
 			case 'i':
-				cur_ent = decode_number(buf, index, size);
-				bd_list_add(list, NUMBER, cur_ent);
+				type = NUMBER;
+				from = *index;
+				cur_ent = (void*)decode_number(buf, index, size);
+				if(!decode_number_ok(buf, from, *index, size))
+					goto fail;
 				break;
 			case 'l':
-				cur_ent = decode_list(buf, index, size);
-				bd_list_add(list, LIST, cur_ent);
+				type = LIST;
+				cur_ent = decode_list(ctx, buf, index, size);
+				if(cur_ent == NULL)
+					goto fail;
 				break;
 			case 'd':
-				cur_ent = decode_dictionary(buf, index, size);
-				bd_list_add(list, DICTIONARY, cur_ent);
+				type = DICTIONARY;
+				cur_ent = decode_dictionary(ctx, buf, index, size);
+				if(cur_ent == NULL)
+					goto fail;
 				break;
 			default:
-				if(isdigit(c))
-				{
-					cur_ent = decode_string(buf, index, size);
-					bd_list_add(list, STRING, cur_ent);
-				}
+				if(!isdigit(c))
+					goto fail;
+				type = STRING;
+				cur_ent = decode_string(ctx, buf, index, size, &len);
+				if(cur_ent == NULL)
+					goto fail;
 				break;
 		}
+		if(bd_ctx_push(ctx, type, cur_ent, len, ent_flags) < 0)
+		{
+			decode_drop(ctx, type, cur_ent, ent_flags);
+			goto fail;
+		}
 		(*index)++;
 	}
+	if(*index >= size)
+		goto fail;
+
+	list = bd_list_create(ctx, ctx->stack_used - base);
+	if(list == NULL)
+		goto fail;
+	list->used = ctx->stack_used - base;
+	// The stack is not allocated until something is pushed.
+	if(list->used > 0)
+		memcpy(list->entries, &ctx->stack[base], sizeof(bd_entry) * list->used);
+	ctx->stack_used = base;
+	list->start = start;
+	list->end = *index + 1;
+	ctx->depth--;
 	return list;
+
+fail:
+	decode_unwind(ctx, base);
+	ctx->depth--;
+	return NULL;
+}
+
+// Computes the infohash of the torrent decoded into |root| from |buf|.
+//
+// RETURNS
+// Zero on success, -1 if there is no 'info' dictionary or its recorded
+// byte range does not lie within |buf|.
+int bd_infohash(bd_dict* root, const unsigned char* buf, size_t size, unsigned char hash[20])
+{
+	bd_entry* info = bd_dict_find(root, "info");
+
+	if(info == NULL || info->type != DICTIONARY)
+		return -1;
+	if(info->dict->end <= info->dict->start || info->dict->end > size)
+		return -1;
+
+	sha1(&buf[info->dict->start], info->dict->end - info->dict->start, hash);
+	return 0;
 }
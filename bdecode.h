@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 
 /* * * * * * * * * * * * *
@@ -20,9 +21,23 @@ enum bd_type
 struct bd_dict;
 struct bd_list;
 
+// Set on an entry whose key and string value point into the source
+// buffer rather than owned heap memory. Such strings are NOT
+// null-terminated; always honour |keylen| and |len|.
+#define BD_BORROWED 0x1
+
+// Set on a dictionary value left undecoded by a BD_LAZY decode. |type|
+// is already the type it decodes to, but |data| and |len| describe the
+// raw bytes in the source buffer: a string's payload, or a container's
+// whole bencoding. bd_dict_find() materializes such values on first
+// access, so never read them straight out of |entries|.
+#define BD_DEFERRED 0x2
+
 typedef struct
 {
   enum bd_type type;
+  int flags;
+  size_t len;
   union
   {
     void* data;
@@ -32,41 +47,256 @@ typedef struct
   };
 } bd_entry;
 
-typedef struct bd_dict
+// A dictionary key/value pair. The value's BD_BORROWED flag also
+// applies to |key|.
+typedef struct
 {
   char* key;
-  enum bd_type type;
-  union
-  {
-    void* data;
-    char* str;
-    struct bd_dict* dict;
-    struct bd_list* list;
-  };
-  struct bd_dict* next;
+  size_t keylen;
+  bd_entry value;
+} bd_kvp;
+
+// Dictionaries keep their entries in on-wire order. When that order is
+// the canonical (sorted) one, |sorted| is set and lookups binary search
+// |entries| directly; otherwise bd_dict_seal() builds |index|, a sorted
+// permutation of |entries|, to search instead.
+//
+// |start| and |end| delimit the bytes the dictionary was decoded from,
+// from the 'd' up to and including the 'e', when it came from a buffer.
+//
+// |ctx| is the context of a BD_LAZY decode, kept to materialize deferred
+// values; it is NULL otherwise.
+typedef struct bd_dict
+{
+  int used;
+  int allocated;
+  int sorted;
+  bd_kvp* entries;
+  int* index;
+  size_t start;
+  size_t end;
+  struct bd_ctx* ctx;
 } bd_dict;
 
+// |start| and |end| are the source byte range, as for bd_dict.
 typedef struct bd_list
 {
   int used;
   int allocated;
   bd_entry* entries;
+  size_t start;
+  size_t end;
 } bd_list;
 
-bd_list* bd_list_create();
-bd_dict* bd_dict_create();
-void bd_dict_add(bd_dict** dict, char* key, enum bd_type type, void* data);
-void bd_list_add(bd_list* list, enum bd_type type, void* data);
+/* * * * * * * * * * * * *
+ * DECODE CONTEXT        *
+ * * * * * * * * * * * * */
+
+// One block of arena memory. Blocks are chained and released together.
+typedef struct bd_block
+{
+  struct bd_block* next;
+  size_t size;
+  size_t used;
+  unsigned char data[];
+} bd_block;
+
+// Structural tape produced by the indexed decoder (see bdtape.c). Every
+// token takes two words: the first holds the token type in its top byte
+// and the token's byte offset in the input below it; the second depends
+// on the type (see BD_TAPE_*).
+typedef struct bd_tape
+{
+  uint64_t* words;
+  size_t used;
+  size_t allocated;
+
+  // Stage one bitmaps, one bit per input byte.
+  uint64_t* structural;
+  uint64_t* digits;
+  size_t masks_allocated;
+} bd_tape;
+
+// Decode context. When |arena| is set, every node, entry array and
+// copied string of a decoded tree is carved out of |blocks| and the
+// whole tree is released with a single bd_ctx_destroy() (or recycled
+// with bd_ctx_reset()). Such trees must NOT be passed to
+// bd_dict_destroy()/bd_list_destroy().
+//
+// |stack| and |tape| are scratch space used while decoding so that
+// containers can be allocated at their exact final size. Both are kept
+// across bd_ctx_reset().
+//
+// |source| is the buffer of the last BD_LAZY decode, which deferred
+// values point into. |depth| is how deeply the recursive decoder is
+// nested, limited to BD_STREAM_DEPTH as the other decoders are.
+typedef struct bd_ctx
+{
+  int flags;
+  int arena;
+  bd_block* blocks;
+  size_t block_size;
+
+  bd_entry* stack;
+  int stack_used;
+  int stack_allocated;
+
+  bd_tape tape;
+  unsigned char* source;
+  int depth;
+} bd_ctx;
+
+bd_ctx* bd_ctx_create(int flags);
+void bd_ctx_reset(bd_ctx* ctx);
+void bd_ctx_destroy(bd_ctx* ctx);
+void* bd_alloc(bd_ctx* ctx, size_t size);
+int bd_ctx_push(bd_ctx* ctx, enum bd_type type, void* data, size_t len, int flags);
+
+bd_list* bd_list_create(bd_ctx* ctx, int allocated);
+bd_dict* bd_dict_create(bd_ctx* ctx, int allocated);
+int bd_dict_add(bd_ctx* ctx, bd_dict* dict, char* key, size_t keylen, enum bd_type type, void* data, size_t len, int flags);
+void bd_dict_seal(bd_ctx* ctx, bd_dict* dict);
+int bd_list_add(bd_ctx* ctx, bd_list* list, enum bd_type type, void* data, size_t len, int flags);
+bd_entry* bd_dict_find(bd_dict* dict, char* key);
 void bd_list_destroy(bd_list* list);
 void bd_dict_destroy(bd_dict* dict);
+void bd_dict_print(bd_dict* dict, int indent);
+void bd_list_print(bd_list* list, int indent);
 
 /* * * * * * * * * * * * * * * *
  * BENCODE DECODING FUNCT *
  * * * * * * * * * * * * * * * */
+
+// Decoding flags.
+//
+// BD_ZEROCOPY: keys and string values are (pointer, length) views into
+// the input buffer instead of heap copies. The buffer must outlive the
+// decoded tree.
+#define BD_ZEROCOPY 0x1
+
+// BD_LAZY: values only needed for verification ('pieces', 'piece
+// layers', 'md5sum', 'sha1', 'attr') and strings of BD_LAZY_MIN bytes or
+// more are left as raw byte ranges (see BD_DEFERRED) and only decoded
+// when first looked up. Needs an arena context from bd_ctx_create() and,
+// as with BD_ZEROCOPY, a buffer that outlives the tree. Since lookups
+// then write to the tree, a lazily decoded tree must not be searched
+// from several threads at once. Lazy decodes go through the slower
+// indexed decoder, so this only pays off when it spares large string
+// copies; with BD_ZEROCOPY an eager decode is faster (see bdtape.c).
+#define BD_LAZY 0x2
+#define BD_LAZY_MIN 4096
+
+// A read-only memory mapping of a bencoded file on disk.
+typedef struct bd_source
+{
+  unsigned char* buf;
+  size_t size;
+} bd_source;
+
+bd_source* bd_source_map(const char* path);
+void bd_source_unmap(bd_source* src);
+
 void* decode(unsigned char* buf, size_t size);
-bd_dict* decode_dictionary(unsigned char* buf, int* index, size_t size);
-bd_list* decode_list(unsigned char* buf, int* index, size_t size);
+void* decode_flags(unsigned char* buf, size_t size, int flags);
+void* decode_ctx(bd_ctx* ctx, unsigned char* buf, size_t size);
+bd_dict* decode_dictionary(bd_ctx* ctx, unsigned char* buf, int* index, size_t size);
+bd_list* decode_list(bd_ctx* ctx, unsigned char* buf, int* index, size_t size);
 long long decode_number(unsigned char* buf, int* index, size_t size);
-char* decode_string(unsigned char* buf, int* index, size_t size);
+char* decode_string(bd_ctx* ctx, unsigned char* buf, int* index, size_t size, size_t* len);
+
+// Infohash of a torrent: the SHA-1 of the exact bytes of its 'info'
+// dictionary, hashed in place from the decode buffer.
+int bd_infohash(bd_dict* root, const unsigned char* buf, size_t size, unsigned char hash[20]);
+
+/* * * * * * * * * * * * * * * *
+ * INDEXED DECODER            *
+ * * * * * * * * * * * * * * * */
+
+// Tape token types, stored in the top byte of the first word. The
+// second word holds:
+//   BD_TAPE_DICT, BD_TAPE_LIST: tape index of the matching BD_TAPE_END
+//   BD_TAPE_END: number of elements in the container (keys included)
+//   BD_TAPE_NUMBER: the value
+//   BD_TAPE_STRING: the length; the offset points at the first byte
+#define BD_TAPE_DICT 'd'
+#define BD_TAPE_LIST 'l'
+#define BD_TAPE_END 'e'
+#define BD_TAPE_NUMBER 'i'
+#define BD_TAPE_STRING 's'
+
+#define BD_TAPE_TYPE(w) ((int)((w) >> 56))
+#define BD_TAPE_OFFSET(w) ((size_t)((w) & 0x00ffffffffffffffULL))
+
+void bd_index_structural(const unsigned char* buf, size_t size, uint64_t* structural, uint64_t* digits);
+int bd_tape_build(bd_tape* tape, const unsigned char* buf, size_t size);
+void bd_tape_free(bd_tape* tape);
+long bd_tape_find(bd_tape* tape, const unsigned char* buf, size_t t, const char* key);
+void* decode_tape(bd_ctx* ctx, unsigned char* buf, size_t size);
+int bd_tape_materialize(bd_ctx* ctx, bd_entry* e);
+int bd_infohash_scan(bd_ctx* ctx, const unsigned char* buf, size_t size, unsigned char hash[20]);
+
+/* * * * * * * * * * * * * * * *
+ * STREAMING DECODER          *
+ * * * * * * * * * * * * * * * */
+
+// Maximum container nesting accepted by the streaming decoder.
+#define BD_STREAM_DEPTH 256
+
+// Return codes of bd_stream_feed().
+#define BD_STREAM_MORE 0
+#define BD_STREAM_DONE 1
+#define BD_STREAM_ERROR -1
+#define BD_STREAM_ABORT -2
+
+// Event callbacks. Any of them may be NULL. A nonzero return aborts the
+// parse with BD_STREAM_ABORT.
+//
+// Keys are always delivered whole. String values are delivered as they
+// arrive, possibly in several fragments; |remaining| is the number of
+// bytes of the string still to come after this fragment, so the value is
+// complete once it reaches zero.
+typedef struct bd_stream_ops
+{
+  int (*begin_dict)(void* user);
+  int (*begin_list)(void* user);
+  int (*key)(void* user, const char* key, size_t len);
+  int (*number)(void* user, long long num);
+  int (*string)(void* user, const char* str, size_t len, size_t remaining);
+  int (*end)(void* user);
+} bd_stream_ops;
+
+// Event-driven, non-recursive decoder. Input may be fed in arbitrarily
+// sized chunks; the parser keeps its own container stack and resumes
+// mid-token where the previous chunk stopped.
+typedef struct bd_stream
+{
+  const bd_stream_ops* ops;
+  void* user;
+
+  int state;
+  int depth;
+  int skip;
+  int skip_end;
+  int iskey;
+  unsigned char stack[BD_STREAM_DEPTH];
+
+  int negative;
+  int digits;
+  long long num;
+  size_t remaining;
+
+  char* key;
+  size_t keylen;
+  size_t keyalloc;
+
+  // Number of input bytes consumed so far. Inside a callback this is
+  // the offset of the byte that completed the event.
+  size_t offset;
+} bd_stream;
+
+void bd_stream_init(bd_stream* s, const bd_stream_ops* ops, void* user);
+int bd_stream_feed(bd_stream* s, const unsigned char* buf, size_t len);
+void bd_stream_skip(bd_stream* s);
+void bd_stream_free(bd_stream* s);
 
 #endif
@@ -0,0 +1,312 @@
+#include <ctype.h>
+
+#include "bdecode.h"
+
+// Parser states.
+enum
+{
+	BDS_VALUE,
+	BDS_INT_START,
+	BDS_INT,
+	BDS_STRLEN,
+	BDS_STRING,
+	BDS_DONE,
+	BDS_ERROR,
+};
+
+// Container stack markers. A dictionary flips between awaiting a key
+// and awaiting the value for that key.
+#define BDS_DICT_KEY 'd'
+#define BDS_DICT_VALUE 'v'
+#define BDS_LIST 'l'
+
+void bd_stream_init(bd_stream* s, const bd_stream_ops* ops, void* user)
+{
+	memset(s, 0, sizeof(bd_stream));
+	s->ops = ops;
+	s->user = user;
+	s->state = BDS_VALUE;
+}
+void bd_stream_free(bd_stream* s)
+{
+	free(s->key);
+	s->key = NULL;
+	s->keyalloc = 0;
+}
+
+// Suppresses events for part of the document.
+//
+// Called from a begin_dict/begin_list callback, nothing is reported
+// until the matching end, which is still delivered. Called from a key
+// callback, the whole value that follows is skipped silently. Skipped
+// strings are stepped over without being buffered.
+void bd_stream_skip(bd_stream* s)
+{
+	if(s->skip != 0)
+		return;
+
+	if(s->depth > 0 && s->stack[s->depth - 1] == BDS_DICT_VALUE)
+	{
+		s->skip = s->depth + 1;
+		s->skip_end = 0;
+	}
+	else
+	{
+		s->skip = s->depth;
+		s->skip_end = 1;
+	}
+}
+
+static int bds_push(bd_stream* s, unsigned char type)
+{
+	if(s->depth == BD_STREAM_DEPTH)
+		return -1;
+	s->stack[s->depth++] = type;
+	return 0;
+}
+
+// Called whenever a complete value has been consumed.
+static int bds_value_done(bd_stream* s)
+{
+	// A skipped scalar ends here.
+	if(s->skip == s->depth + 1)
+		s->skip = 0;
+
+	if(s->depth == 0)
+	{
+		s->state = BDS_DONE;
+		return BD_STREAM_DONE;
+	}
+
+	if(s->stack[s->depth - 1] == BDS_DICT_VALUE)
+		s->stack[s->depth - 1] = BDS_DICT_KEY;
+	s->state = BDS_VALUE;
+	return BD_STREAM_MORE;
+}
+
+// Handles the first byte of a value (or of a key, or a container 'e').
+//
+// RETURNS
+// Zero to continue, BD_STREAM_ERROR or BD_STREAM_ABORT to stop.
+static int bds_begin(bd_stream* s, unsigned char c)
+{
+	int top = (s->depth > 0) ? s->stack[s->depth - 1] : 0;
+	int emit;
+
+	if(c == 'e')
+	{
+		if(s->depth == 0 || top == BDS_DICT_VALUE)
+			return BD_STREAM_ERROR;
+
+		s->depth--;
+		if(s->skip == s->depth + 1)
+		{
+			emit = s->skip_end;
+			s->skip = 0;
+		}
+		else
+			emit = (s->skip == 0);
+
+		if(emit && s->ops->end && s->ops->end(s->user))
+			return BD_STREAM_ABORT;
+		bds_value_done(s);
+		return 0;
+	}
+
+	if(top == BDS_DICT_KEY && !isdigit(c))
+		return BD_STREAM_ERROR;
+
+	switch(c)
+	{
+		case 'd':
+			if(bds_push(s, BDS_DICT_KEY) < 0)
+				return BD_STREAM_ERROR;
+			if(s->skip == s->depth)
+				s->skip_end = 0;
+			if(s->skip == 0 && s->ops->begin_dict && s->ops->begin_dict(s->user))
+				return BD_STREAM_ABORT;
+			break;
+		case 'l':
+			if(bds_push(s, BDS_LIST) < 0)
+				return BD_STREAM_ERROR;
+			if(s->skip == s->depth)
+				s->skip_end = 0;
+			if(s->skip == 0 && s->ops->begin_list && s->ops->begin_list(s->user))
+				return BD_STREAM_ABORT;
+			break;
+		case 'i':
+			s->negative = 0;
+			s->digits = 0;
+			s->num = 0;
+			s->state = BDS_INT_START;
+			break;
+		default:
+			if(!isdigit(c))
+				return BD_STREAM_ERROR;
+			s->iskey = (top == BDS_DICT_KEY);
+			s->remaining = c - '0';
+			s->state = BDS_STRLEN;
+			break;
+	}
+	return 0;
+}
+
+// Called once the ':' of a string has been seen.
+static int bds_string_start(bd_stream* s)
+{
+	char* k;
+
+	if(s->iskey && s->skip == 0)
+	{
+		if(s->keyalloc < s->remaining + 1)
+		{
+			k = realloc(s->key, s->remaining + 1);
+			if(k == NULL)
+				return BD_STREAM_ERROR;
+			s->key = k;
+			s->keyalloc = s->remaining + 1;
+		}
+		s->keylen = 0;
+	}
+	s->state = BDS_STRING;
+	return 0;
+}
+
+// Consumes up to |len| bytes of string payload.
+//
+// RETURNS
+// Number of bytes consumed, or a negative status to stop.
+static long bds_string_data(bd_stream* s, const unsigned char* buf, size_t len)
+{
+	size_t n = (len < s->remaining) ? len : s->remaining;
+
+	s->remaining -= n;
+	s->offset += n;
+	if(s->iskey)
+	{
+		if(s->skip == 0)
+		{
+			memcpy(&s->key[s->keylen], buf, n);
+			s->keylen += n;
+			s->key[s->keylen] = '\0';
+		}
+		if(s->remaining == 0)
+		{
+			s->stack[s->depth - 1] = BDS_DICT_VALUE;
+			s->state = BDS_VALUE;
+			if(s->skip == 0 && s->ops->key && s->ops->key(s->user, s->key, s->keylen))
+				return BD_STREAM_ABORT;
+		}
+	}
+	else
+	{
+		if(s->skip == 0 && s->ops->string && s->ops->string(s->user, (const char*)buf, n, s->remaining))
+			return BD_STREAM_ABORT;
+		if(s->remaining == 0)
+			bds_value_done(s);
+	}
+	return n;
+}
+
+// Feeds the next chunk of input to the parser. The chunk may end
+// anywhere, including in the middle of a number, a length prefix or a
+// string; the next call picks up from there.
+//
+// RETURNS
+// BD_STREAM_MORE if the top-level value is not complete yet,
+// BD_STREAM_DONE once it is (trailing input is ignored),
+// BD_STREAM_ERROR on malformed input and BD_STREAM_ABORT if a callback
+// asked to stop. After an error or abort the stream must be discarded.
+int bd_stream_feed(bd_stream* s, const unsigned char* buf, size_t len)
+{
+	size_t i = 0;
+	long n;
+	int stat = 0;
+	unsigned char c;
+
+	while(i < len && stat == 0)
+	{
+		c = buf[i];
+		switch(s->state)
+		{
+			case BDS_DONE:
+				return BD_STREAM_DONE;
+			case BDS_ERROR:
+				return BD_STREAM_ERROR;
+			case BDS_VALUE:
+				i++;
+				s->offset++;
+				stat = bds_begin(s, c);
+				break;
+			case BDS_INT_START:
+				if(c == '-' && !s->negative)
+				{
+					s->negative = 1;
+					i++;
+					s->offset++;
+					break;
+				}
+				s->state = BDS_INT;
+				// Fall through to parse the first digit.
+			case BDS_INT:
+				i++;
+				s->offset++;
+				if(isdigit(c))
+				{
+					if(s->num > (0x7fffffffffffffffLL - (c - '0')) / 10)
+						stat = BD_STREAM_ERROR;
+					s->num = (s->num * 10) + (c - '0');
+					s->digits++;
+				}
+				else if(c == 'e' && s->digits > 0)
+				{
+					if(s->negative)
+						s->num = -s->num;
+					if(s->skip == 0 && s->ops->number && s->ops->number(s->user, s->num))
+						stat = BD_STREAM_ABORT;
+					else
+						bds_value_done(s);
+				}
+				else
+					stat = BD_STREAM_ERROR;
+				break;
+			case BDS_STRLEN:
+				i++;
+				s->offset++;
+				if(isdigit(c))
+				{
+					if(s->remaining > ((size_t)-1 - (c - '0')) / 10)
+						stat = BD_STREAM_ERROR;
+					s->remaining = (s->remaining * 10) + (c - '0');
+				}
+				else if(c == ':')
+				{
+					stat = bds_string_start(s);
+					// Empty strings complete without any payload.
+					if(stat == 0 && s->remaining == 0)
+					{
+						n = bds_string_data(s, buf + i, 0);
+						if(n < 0)
+							stat = n;
+					}
+				}
+				else
+					stat = BD_STREAM_ERROR;
+				break;
+			case BDS_STRING:
+				n = bds_string_data(s, buf + i, len - i);
+				if(n < 0)
+					stat = n;
+				else
+					i += n;
+				break;
+		}
+	}
+
+	if(stat != 0)
+	{
+		s->state = BDS_ERROR;
+		return stat;
+	}
+	return (s->state == BDS_DONE) ? BD_STREAM_DONE : BD_STREAM_MORE;
+}
@@ -0,0 +1,707 @@
+#include "bdecode.h"
+#include "sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BD_HAVE_X86 1
+#endif
+
+// Indexed decoding happens in two passes over the input.
+//
+// Stage one classifies every byte in 64 byte blocks, producing one bit
+// per byte in two bitmaps: |structural| for the bencode type characters
+// 'd', 'l', 'i', 'e' and ':' and |digits| for '0'-'9'. This pass is
+// vectorized with AVX2 or SSE2 when available.
+//
+// Stage two walks the tokens and writes the tape. Since string payloads
+// may contain any byte, it never trusts a structural bit blindly: it
+// dispatches on the byte at the current token, finds the end of a digit
+// run or the 'e' of a number with a single bit scan, and jumps straight
+// over string payloads without looking at them.
+//
+// This is not a faster eager decoder. Building the tape costs about as
+// much as a whole recursive decode, and the tree is then built from the
+// tape in a second walk. Bencode strings carry their length, so the
+// bitmaps only save the scan to the end of a digit run. With an arena
+// and BD_ZEROCOPY, a torrent of 100k files decodes at about 230 MB/s
+// recursively and 150 MB/s through the tape, and the sample torrent
+// takes 1.2 us against 1.7 us. Eager decodes therefore stay on
+// decode_dictionary().
+//
+// The tape is kept for what the recursive decoder can't do cheaply. It
+// steps over a container in one move, using the index of the matching
+// end, which BD_LAZY needs to defer values without building them. That
+// pays off when strings are copied: 1000 files and 20 MB of 'pieces'
+// decode in 0.3 ms lazily against 4.0 ms eagerly. The tape is also what
+// bd_infohash_scan() uses to find the 'info' span without building a
+// tree.
+
+// Scalar fallback for a single, possibly partial, block.
+static void bd_index_block_scalar(const unsigned char* p, size_t n, uint64_t* s, uint64_t* d)
+{
+	size_t i;
+	unsigned char c;
+	uint64_t sm = 0;
+	uint64_t dm = 0;
+
+	for(i = 0; i < n; i++)
+	{
+		c = p[i];
+		if(c == 'd' || c == 'l' || c == 'i' || c == 'e' || c == ':')
+			sm |= (1ULL << i);
+		if((unsigned char)(c - '0') < 10)
+			dm |= (1ULL << i);
+	}
+	*s = sm;
+	*d = dm;
+}
+
+#ifdef BD_HAVE_X86
+static void bd_index_block_sse2(const unsigned char* p, uint64_t* s, uint64_t* d)
+{
+	int i;
+	__m128i x;
+	__m128i st;
+	__m128i t;
+	uint64_t sm = 0;
+	uint64_t dm = 0;
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+
+	for(i = 0; i < 4; i++)
+	{
+		x = _mm_loadu_si128((const __m128i*)(p + (i * 16)));
+		st = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('d')), _mm_cmpeq_epi8(x, _mm_set1_epi8('l')));
+		st = _mm_or_si128(st, _mm_cmpeq_epi8(x, _mm_set1_epi8('i')));
+		st = _mm_or_si128(st, _mm_cmpeq_epi8(x, _mm_set1_epi8('e')));
+		st = _mm_or_si128(st, _mm_cmpeq_epi8(x, _mm_set1_epi8(':')));
+
+		// A byte is a digit when (c - '0') <= 9 as an unsigned value.
+		t = _mm_sub_epi8(x, zero);
+		t = _mm_cmpeq_epi8(_mm_max_epu8(t, nine), nine);
+
+		sm |= (uint64_t)(unsigned)_mm_movemask_epi8(st) << (i * 16);
+		dm |= (uint64_t)(unsigned)_mm_movemask_epi8(t) << (i * 16);
+	}
+	*s = sm;
+	*d = dm;
+}
+
+__attribute__((target("avx2")))
+static void bd_index_block_avx2(const unsigned char* p, uint64_t* s, uint64_t* d)
+{
+	int i;
+	__m256i x;
+	__m256i st;
+	__m256i t;
+	uint64_t sm = 0;
+	uint64_t dm = 0;
+	const __m256i zero = _mm256_set1_epi8('0');
+	const __m256i nine = _mm256_set1_epi8(9);
+
+	for(i = 0; i < 2; i++)
+	{
+		x = _mm256_loadu_si256((const __m256i*)(p + (i * 32)));
+		st = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('d')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('l')));
+		st = _mm256_or_si256(st, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('i')));
+		st = _mm256_or_si256(st, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('e')));
+		st = _mm256_or_si256(st, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(':')));
+
+		t = _mm256_sub_epi8(x, zero);
+		t = _mm256_cmpeq_epi8(_mm256_max_epu8(t, nine), nine);
+
+		sm |= (uint64_t)(unsigned)_mm256_movemask_epi8(st) << (i * 32);
+		dm |= (uint64_t)(unsigned)_mm256_movemask_epi8(t) << (i * 32);
+	}
+	*s = sm;
+	*d = dm;
+}
+#endif
+
+// Stage one: fills |structural| and |digits| with one bit per byte of
+// |buf|. Both arrays must hold (size + 63) / 64 words; bits past |size|
+// are cleared.
+void bd_index_structural(const unsigned char* buf, size_t size, uint64_t* structural, uint64_t* digits)
+{
+	size_t i;
+	size_t full = size / 64;
+
+#ifdef BD_HAVE_X86
+	static int avx2_probe = -1;
+	int use_avx2;
+
+	// Decoders may run on several threads at once; they all probe the
+	// same answer, so a relaxed store is enough.
+	use_avx2 = __atomic_load_n(&avx2_probe, __ATOMIC_RELAXED);
+	if(use_avx2 < 0)
+	{
+		use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+		__atomic_store_n(&avx2_probe, use_avx2, __ATOMIC_RELAXED);
+	}
+
+	if(use_avx2)
+	{
+		for(i = 0; i < full; i++)
+			bd_index_block_avx2(buf + (i * 64), &structural[i], &digits[i]);
+	}
+	else
+	{
+		for(i = 0; i < full; i++)
+			bd_index_block_sse2(buf + (i * 64), &structural[i], &digits[i]);
+	}
+#else
+	for(i = 0; i < full; i++)
+		bd_index_block_scalar(buf + (i * 64), 64, &structural[i], &digits[i]);
+#endif
+
+	if(size % 64)
+		bd_index_block_scalar(buf + (full * 64), size % 64, &structural[full], &digits[full]);
+}
+
+// Number of 64 byte blocks indexed at a time. Stage one runs lazily a
+// batch ahead of stage two, so blocks that lie entirely inside a string
+// payload (the 'pieces' blob, mostly) are never classified at all.
+#define BD_SCAN_BATCH 16
+
+typedef struct bd_scan
+{
+	const unsigned char* buf;
+	size_t size;
+	size_t words;
+	size_t hi;
+	uint64_t* structural;
+	uint64_t* digits;
+} bd_scan;
+
+// Makes mask word |w| valid. Stage two only ever moves forward, so words
+// skipped over by a jump never need to be filled in.
+static inline void bd_scan_ensure(bd_scan* sc, size_t w)
+{
+	size_t n;
+	size_t len;
+
+	if(w < sc->hi)
+		return;
+
+	n = sc->words - w;
+	n = (n < BD_SCAN_BATCH) ? n : BD_SCAN_BATCH;
+	len = sc->size - (w * 64);
+	len = (len < n * 64) ? len : n * 64;
+	bd_index_structural(sc->buf + (w * 64), len, &sc->structural[w], &sc->digits[w]);
+	sc->hi = w + n;
+}
+// Returns the position of the first set (or, with |invert|, clear) bit
+// of |mask| at or after |pos|, or the input size if there is none.
+static size_t bd_scan_next(bd_scan* sc, uint64_t* mask, uint64_t invert, size_t pos)
+{
+	size_t w;
+	uint64_t bits;
+
+	if(pos >= sc->size)
+		return sc->size;
+
+	w = pos / 64;
+	bd_scan_ensure(sc, w);
+	bits = (mask[w] ^ invert) & (~0ULL << (pos % 64));
+	while(bits == 0)
+	{
+		if(++w == sc->words)
+			return sc->size;
+		bd_scan_ensure(sc, w);
+		bits = mask[w] ^ invert;
+	}
+	pos = (w * 64) + __builtin_ctzll(bits);
+	return (pos < sc->size) ? pos : sc->size;
+}
+
+// Parses the digit run [start, end). The caller has already checked
+// that every byte in it is a digit.
+static int bd_parse_digits(const unsigned char* buf, size_t start, size_t end, uint64_t* out)
+{
+	uint64_t n = 0;
+
+	if(end == start || end - start > 19)
+		return -1;
+
+	while(start < end)
+		n = (n * 10) + (buf[start++] - '0');
+	*out = n;
+	return 0;
+}
+
+static int bd_tape_emit(bd_tape* tape, int type, size_t offset, uint64_t value)
+{
+	uint64_t* w;
+	if(tape->used + 2 > tape->allocated)
+	{
+		tape->allocated = tape->allocated ? tape->allocated * 2 : 1024;
+		w = realloc(tape->words, sizeof(uint64_t) * tape->allocated);
+		if(w == NULL)
+			return -1;
+		tape->words = w;
+	}
+
+	tape->words[tape->used++] = ((uint64_t)type << 56) | offset;
+	tape->words[tape->used++] = value;
+	return 0;
+}
+
+// Builds the tape for the single bencoded value at the start of |buf|.
+// Trailing bytes after it are ignored.
+//
+// RETURNS
+// Zero on success, -1 on malformed input or allocation failure.
+int bd_tape_build(bd_tape* tape, const unsigned char* buf, size_t size)
+{
+	size_t pos = 0;
+	size_t end;
+	size_t words = (size + 63) / 64;
+	size_t open[BD_STREAM_DEPTH];
+	uint64_t count[BD_STREAM_DEPTH];
+	uint64_t n;
+	uint64_t* m;
+	bd_scan sc;
+	int depth = 0;
+	int negative;
+	unsigned char c;
+
+	tape->used = 0;
+	if(size == 0)
+		return -1;
+
+	if(words > tape->masks_allocated)
+	{
+		m = realloc(tape->structural, sizeof(uint64_t) * words);
+		if(m == NULL)
+			return -1;
+		tape->structural = m;
+		m = realloc(tape->digits, sizeof(uint64_t) * words);
+		if(m == NULL)
+			return -1;
+		tape->digits = m;
+		tape->masks_allocated = words;
+	}
+	sc.buf = buf;
+	sc.size = size;
+	sc.words = words;
+	sc.hi = 0;
+	sc.structural = tape->structural;
+	sc.digits = tape->digits;
+
+	do
+	{
+		if(pos >= size)
+			return -1;
+
+		c = buf[pos];
+		if(depth > 0 && c != 'e')
+		{
+			count[depth - 1]++;
+
+			// Keys must be strings.
+			if((count[depth - 1] & 1) && BD_TAPE_TYPE(tape->words[open[depth - 1]]) == BD_TAPE_DICT && (unsigned char)(c - '0') >= 10)
+				return -1;
+		}
+
+		switch(c)
+		{
+			case 'd':
+			case 'l':
+				if(depth == BD_STREAM_DEPTH)
+					return -1;
+				open[depth] = tape->used;
+				count[depth] = 0;
+				depth++;
+				if(bd_tape_emit(tape, c, pos, 0) < 0)
+					return -1;
+				pos++;
+				break;
+			case 'e':
+				if(depth == 0)
+					return -1;
+				depth--;
+				// Dictionaries need a value for every key.
+				if(BD_TAPE_TYPE(tape->words[open[depth]]) == BD_TAPE_DICT && (count[depth] & 1))
+					return -1;
+				tape->words[open[depth] + 1] = tape->used;
+				if(bd_tape_emit(tape, BD_TAPE_END, pos, count[depth]) < 0)
+					return -1;
+				pos++;
+				break;
+			case 'i':
+				end = bd_scan_next(&sc, sc.structural, 0, pos + 1);
+				if(end == size || buf[end] != 'e')
+					return -1;
+				negative = (buf[pos + 1] == '-');
+				if(bd_scan_next(&sc, sc.digits, ~0ULL, pos + 1 + negative) != end)
+					return -1;
+				if(bd_parse_digits(buf, pos + 1 + negative, end, &n) < 0 || n > INT64_MAX)
+					return -1;
+				if(bd_tape_emit(tape, BD_TAPE_NUMBER, pos, negative ? (uint64_t)(-(int64_t)n) : n) < 0)
+					return -1;
+				pos = end + 1;
+				break;
+			default:
+				end = bd_scan_next(&sc, sc.digits, ~0ULL, pos);
+				if(end == pos || end == size || buf[end] != ':')
+					return -1;
+				if(bd_parse_digits(buf, pos, end, &n) < 0)
+					return -1;
+				pos = end + 1;
+				if(n > size - pos)
+					return -1;
+				if(bd_tape_emit(tape, BD_TAPE_STRING, pos, n) < 0)
+					return -1;
+				pos += n;
+				break;
+		}
+	} while(depth > 0);
+
+	return 0;
+}
+void bd_tape_free(bd_tape* tape)
+{
+	free(tape->words);
+	free(tape->structural);
+	free(tape->digits);
+	memset(tape, 0, sizeof(bd_tape));
+}
+
+static char* bd_tape_string(bd_ctx* ctx, unsigned char* buf, uint64_t* w)
+{
+	size_t off = BD_TAPE_OFFSET(w[0]);
+	size_t len = w[1];
+	char* str;
+
+	if(ctx->flags & BD_ZEROCOPY)
+		return (char*)&buf[off];
+
+	str = bd_alloc(ctx, len + 1);
+	if(str == NULL)
+		return NULL;
+	memcpy(str, &buf[off], len);
+	str[len] = '\0';
+	return str;
+}
+
+static int bd_tape_value(bd_ctx* ctx, unsigned char* buf, size_t* t, void** val, enum bd_type* type, size_t* len);
+
+// Keys whose values BD_LAZY leaves undecoded whatever their size. They
+// are only needed to verify data, never to browse it.
+static const char* bd_lazy_keys[] =
+{
+	"attr",
+	"md5sum",
+	"piece layers",
+	"pieces",
+	"sha1",
+};
+
+// Decides whether the value following the key at tape index |t - 2| is
+// deferred and if so records it in |e| and steps |*t| past it.
+static int bd_tape_defer(bd_ctx* ctx, unsigned char* buf, size_t* t, const char* key, size_t keylen, bd_entry* e)
+{
+	uint64_t* w = &ctx->tape.words[*t];
+	size_t start = BD_TAPE_OFFSET(w[0]);
+	int type = BD_TAPE_TYPE(w[0]);
+	size_t i;
+
+	if(type == BD_TAPE_NUMBER)
+		return 0;
+	if(type != BD_TAPE_STRING || w[1] < BD_LAZY_MIN)
+	{
+		for(i = 0; i < sizeof(bd_lazy_keys) / sizeof(bd_lazy_keys[0]); i++)
+		{
+			if(strlen(bd_lazy_keys[i]) == keylen && memcmp(bd_lazy_keys[i], key, keylen) == 0)
+				break;
+		}
+		if(i == sizeof(bd_lazy_keys) / sizeof(bd_lazy_keys[0]))
+			return 0;
+	}
+
+	e->data = &buf[start];
+	if(type == BD_TAPE_STRING)
+	{
+		e->type = STRING;
+		e->len = w[1];
+		*t += 2;
+	}
+	else
+	{
+		e->type = (type == BD_TAPE_DICT) ? DICTIONARY : LIST;
+		e->len = BD_TAPE_OFFSET(ctx->tape.words[w[1]]) + 1 - start;
+		*t = w[1] + 2;
+	}
+	return 1;
+}
+
+// Frees a value decoded into the heap. Arena memory and borrowed
+// strings go with the context or source instead.
+static void bd_tape_drop(bd_ctx* ctx, enum bd_type type, void* val)
+{
+	if(ctx->arena)
+		return;
+	if(type == DICTIONARY)
+		bd_dict_destroy(val);
+	else if(type == LIST)
+		bd_list_destroy(val);
+	else if(type == STRING && !(ctx->flags & BD_ZEROCOPY))
+		free(val);
+}
+
+// RETURNS
+// The dictionary at |*t|, or NULL if memory ran out.
+static bd_dict* bd_tape_dict(bd_ctx* ctx, unsigned char* buf, size_t* t)
+{
+	uint64_t* w = ctx->tape.words;
+	size_t start = BD_TAPE_OFFSET(w[*t]);
+	size_t end = w[*t + 1];
+	int count = w[end + 1] / 2;
+	int ent_flags = (ctx->flags & BD_ZEROCOPY) ? BD_BORROWED : 0;
+	int lazy = (ctx->flags & BD_LAZY) && ctx->arena;
+	bd_dict* dict = bd_dict_create(ctx, count);
+	char* key;
+	size_t keylen;
+	void* val;
+	size_t len;
+	enum bd_type type;
+	bd_entry deferred;
+
+	if(dict == NULL)
+		return NULL;
+
+	*t += 2;
+	while(*t < end)
+	{
+		key = bd_tape_string(ctx, buf, &w[*t]);
+		if(key == NULL)
+			goto fail;
+		keylen = w[*t + 1];
+		*t += 2;
+		if(lazy && bd_tape_defer(ctx, buf, t, (char*)&buf[BD_TAPE_OFFSET(w[*t - 2])], keylen, &deferred))
+		{
+			if(bd_dict_add(ctx, dict, key, keylen, deferred.type, deferred.data, deferred.len, ent_flags | BD_DEFERRED) < 0)
+				goto fail;
+			continue;
+		}
+		if(bd_tape_value(ctx, buf, t, &val, &type, &len) < 0)
+		{
+			bd_tape_drop(ctx, STRING, key);
+			goto fail;
+		}
+		if(bd_dict_add(ctx, dict, key, keylen, type, val, len, ent_flags) < 0)
+		{
+			bd_tape_drop(ctx, type, val);
+			bd_tape_drop(ctx, STRING, key);
+			goto fail;
+		}
+	}
+	*t = end + 2;
+	bd_dict_seal(ctx, dict);
+	dict->start = start;
+	dict->end = BD_TAPE_OFFSET(w[end]) + 1;
+	dict->ctx = lazy ? ctx : NULL;
+	return dict;
+
+fail:
+	bd_tape_drop(ctx, DICTIONARY, dict);
+	return NULL;
+}
+// RETURNS
+// The list at |*t|, or NULL if memory ran out.
+static bd_list* bd_tape_list(bd_ctx* ctx, unsigned char* buf, size_t* t)
+{
+	uint64_t* w = ctx->tape.words;
+	size_t start = BD_TAPE_OFFSET(w[*t]);
+	size_t end = w[*t + 1];
+	int ent_flags = (ctx->flags & BD_ZEROCOPY) ? BD_BORROWED : 0;
+	bd_list* list = bd_list_create(ctx, w[end + 1]);
+	bd_entry* e;
+
+	if(list == NULL)
+		return NULL;
+
+	*t += 2;
+	while(*t < end)
+	{
+		// Counted only once it is whole, so a failure leaves the list
+		// safe to destroy.
+		e = &list->entries[list->used];
+		e->flags = ent_flags;
+		if(bd_tape_value(ctx, buf, t, &e->data, &e->type, &e->len) < 0)
+		{
+			bd_tape_drop(ctx, LIST, list);
+			return NULL;
+		}
+		list->used++;
+	}
+	*t = end + 2;
+	list->start = start;
+	list->end = BD_TAPE_OFFSET(w[end]) + 1;
+	return list;
+}
+// Materializes the tape token at |*t| into |*val| and advances |*t|
+// past it.
+//
+// RETURNS
+// Zero on success, -1 if memory ran out.
+static int bd_tape_value(bd_ctx* ctx, unsigned char* buf, size_t* t, void** val, enum bd_type* type, size_t* len)
+{
+	uint64_t* w = &ctx->tape.words[*t];
+
+	*len = 0;
+	switch(BD_TAPE_TYPE(w[0]))
+	{
+		case BD_TAPE_DICT:
+			*type = DICTIONARY;
+			*val = bd_tape_dict(ctx, buf, t);
+			return (*val != NULL) ? 0 : -1;
+		case BD_TAPE_LIST:
+			*type = LIST;
+			*val = bd_tape_list(ctx, buf, t);
+			return (*val != NULL) ? 0 : -1;
+		case BD_TAPE_NUMBER:
+			*type = NUMBER;
+			*val = (void*)(intptr_t)(int64_t)w[1];
+			break;
+		default:
+			*type = STRING;
+			*len = w[1];
+			*val = bd_tape_string(ctx, buf, w);
+			if(*val == NULL)
+				return -1;
+			break;
+	}
+	*t += 2;
+	return 0;
+}
+
+// Decodes the dictionary at the start of |buf| through the structural
+// tape, allocating every container at its final size straight from the
+// element counts recorded on the tape.
+//
+// RETURNS
+// The root dictionary, or NULL if the input is malformed or is not a
+// dictionary.
+void* decode_tape(bd_ctx* ctx, unsigned char* buf, size_t size)
+{
+	size_t t = 0;
+
+	if(bd_tape_build(&ctx->tape, buf, size) < 0)
+		return NULL;
+	if(BD_TAPE_TYPE(ctx->tape.words[0]) != BD_TAPE_DICT)
+		return NULL;
+	ctx->source = buf;
+	return bd_tape_dict(ctx, buf, &t);
+}
+
+// Decodes a value that a BD_LAZY decode deferred. The bytes were already
+// validated by the original decode, so only running out of memory can
+// fail here. Containers are decoded from their own tape, shifted to the
+// original buffer's offsets so that their spans match an eager decode.
+//
+// RETURNS
+// Zero on success, -1 on failure, leaving |e| deferred.
+//
+// POSTCONDITION
+// |e| is an ordinary entry; BD_DEFERRED is cleared.
+int bd_tape_materialize(bd_ctx* ctx, bd_entry* e)
+{
+	unsigned char* raw = e->data;
+	size_t base = raw - ctx->source;
+	size_t t = 0;
+	size_t i;
+	uint64_t w[2];
+	void* val;
+	enum bd_type type;
+	size_t len;
+
+	if(e->type == STRING)
+	{
+		w[0] = base;
+		w[1] = e->len;
+		val = bd_tape_string(ctx, ctx->source, w);
+		if(val == NULL)
+			return -1;
+		e->data = val;
+		e->flags &= ~BD_DEFERRED;
+		return 0;
+	}
+
+	if(bd_tape_build(&ctx->tape, raw, e->len) < 0)
+		return -1;
+	for(i = 0; i < ctx->tape.used; i += 2)
+		ctx->tape.words[i] += base;
+
+	if(bd_tape_value(ctx, ctx->source, &t, &val, &type, &len) < 0)
+		return -1;
+	e->data = val;
+	e->type = type;
+	e->len = len;
+	e->flags &= ~BD_DEFERRED;
+	return 0;
+}
+
+// Finds |key| among the direct children of the dictionary whose token
+// is at tape index |t|, stepping over nested containers via their
+// recorded end index.
+//
+// RETURNS
+// Tape index of the value stored under |key|, or -1 if there is none.
+long bd_tape_find(bd_tape* tape, const unsigned char* buf, size_t t, const char* key)
+{
+	uint64_t* w = tape->words;
+	size_t end;
+	size_t keylen = strlen(key);
+	int type;
+	int match;
+
+	if(t >= tape->used || BD_TAPE_TYPE(w[t]) != BD_TAPE_DICT)
+		return -1;
+
+	end = w[t + 1];
+	t += 2;
+	while(t < end)
+	{
+		// |t| is at a key; its value follows.
+		match = (w[t + 1] == keylen && memcmp(&buf[BD_TAPE_OFFSET(w[t])], key, keylen) == 0);
+		t += 2;
+		if(match)
+			return t;
+
+		type = BD_TAPE_TYPE(w[t]);
+		if(type == BD_TAPE_DICT || type == BD_TAPE_LIST)
+			t = w[t + 1] + 2;
+		else
+			t += 2;
+	}
+	return -1;
+}
+
+// Computes the infohash of the torrent in |buf| without building a
+// tree. Only the tape scratch in |ctx| is used, so once it has grown to
+// fit, keying a whole directory of torrents allocates nothing.
+//
+// RETURNS
+// Zero on success, -1 on malformed input or if there is no 'info'
+// dictionary.
+int bd_infohash_scan(bd_ctx* ctx, const unsigned char* buf, size_t size, unsigned char hash[20])
+{
+	long t;
+	size_t start;
+	size_t end;
+	uint64_t* w;
+
+	if(bd_tape_build(&ctx->tape, buf, size) < 0)
+		return -1;
+
+	t = bd_tape_find(&ctx->tape, buf, 0, "info");
+	w = ctx->tape.words;
+	if(t < 0 || BD_TAPE_TYPE(w[t]) != BD_TAPE_DICT)
+		return -1;
+
+	start = BD_TAPE_OFFSET(w[t]);
+	end = BD_TAPE_OFFSET(w[w[t + 1]]) + 1;
+	sha1(&buf[start], end - start, hash);
+	return 0;
+}
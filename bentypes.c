@@ -1,28 +1,177 @@
 #include "bdecode.h"
 
-bd_list* bd_list_create()
+// Size of the first arena block. Each further block doubles, so even
+// very large torrents are served from a handful of blocks.
+#define BD_BLOCK_MIN (64 * 1024)
+
+// Arena allocations are rounded up to keep every node aligned.
+#define BD_ALIGN(n) (((n) + 15) & ~((size_t)15))
+
+bd_ctx* bd_ctx_create(int flags)
+{
+	bd_ctx* ctx = calloc(1, sizeof(bd_ctx));
+	if(ctx == NULL)
+		return NULL;
+
+	ctx->flags = flags;
+	ctx->arena = 1;
+	ctx->block_size = BD_BLOCK_MIN;
+	return ctx;
+}
+// Releases every tree decoded with |ctx| but keeps its largest block
+// and scratch stack around, so that a context can be reused across many
+// decodes without going back to malloc.
+void bd_ctx_reset(bd_ctx* ctx)
+{
+	bd_block* b;
+	bd_block* bt;
+
+	if(ctx->blocks == NULL)
+		return;
+
+	// The head of the chain is always the most recent, and largest, block.
+	b = ctx->blocks->next;
+	while(b)
+	{
+		bt = b->next;
+		free(b);
+		b = bt;
+	}
+	ctx->blocks->next = NULL;
+	ctx->blocks->used = 0;
+	ctx->stack_used = 0;
+}
+void bd_ctx_destroy(bd_ctx* ctx)
 {
-	bd_list* list = malloc(sizeof(bd_list));
-	// TODO: Nomem check hurr.
+	bd_block* b;
+	bd_block* bt;
+
+	if(ctx == NULL)
+		return;
+
+	b = ctx->blocks;
+	while(b)
+	{
+		bt = b->next;
+		free(b);
+		b = bt;
+	}
+	free(ctx->stack);
+	bd_tape_free(&ctx->tape);
+	free(ctx);
+}
+// Allocates |size| bytes from the context arena, or from the heap when
+// |ctx| is NULL or not arena-backed.
+void* bd_alloc(bd_ctx* ctx, size_t size)
+{
+	bd_block* b;
+	void* p;
+
+	if(ctx == NULL || !ctx->arena)
+		return malloc(size);
+
+	size = BD_ALIGN(size);
+	b = ctx->blocks;
+	if(b == NULL || b->size - b->used < size)
+	{
+		if(b != NULL)
+			ctx->block_size *= 2;
+		while(ctx->block_size < size)
+			ctx->block_size *= 2;
+
+		b = malloc(sizeof(bd_block) + ctx->block_size);
+		if(b == NULL)
+			return NULL;
 
-	list->entries = malloc(sizeof(bd_entry) * 2);
-	list->allocated = 2;
+		b->size = ctx->block_size;
+		b->used = 0;
+		b->next = ctx->blocks;
+		ctx->blocks = b;
+	}
+
+	p = &b->data[b->used];
+	b->used += size;
+	return p;
+}
+// Pushes an entry onto the context scratch stack.
+//
+// RETURNS
+// Zero on success, -1 if the stack could not be grown.
+int bd_ctx_push(bd_ctx* ctx, enum bd_type type, void* data, size_t len, int flags)
+{
+	bd_entry* e;
+	if(ctx->stack_used == ctx->stack_allocated)
+	{
+		ctx->stack_allocated = ctx->stack_allocated ? ctx->stack_allocated * 2 : 64;
+		e = realloc(ctx->stack, sizeof(bd_entry) * ctx->stack_allocated);
+		if(e == NULL)
+			return -1;
+		ctx->stack = e;
+	}
+
+	e = &ctx->stack[ctx->stack_used++];
+	e->type = type;
+	e->flags = flags;
+	e->len = len;
+	e->data = data;
+	return 0;
+}
+
+// RETURNS
+// An empty list with room for |allocated| entries, or NULL if memory ran
+// out.
+bd_list* bd_list_create(bd_ctx* ctx, int allocated)
+{
+	bd_list* list = bd_alloc(ctx, sizeof(bd_list));
+	if(list == NULL)
+		return NULL;
+
+	allocated = (allocated > 0) ? allocated : 2;
+	list->entries = bd_alloc(ctx, sizeof(bd_entry) * allocated);
+	if(list->entries == NULL)
+	{
+		if(ctx == NULL || !ctx->arena)
+			free(list);
+		return NULL;
+	}
+	list->allocated = allocated;
 	list->used = 0;
+	list->start = 0;
+	list->end = 0;
 	return list;
 }
-void bd_list_add(bd_list* list, enum bd_type type, void* data)
+// RETURNS
+// Zero on success, -1 if the list had to grow and memory ran out, in
+// which case it is left as it was.
+int bd_list_add(bd_ctx* ctx, bd_list* list, enum bd_type type, void* data, size_t len, int flags)
 {
 	bd_entry* e;
+	int allocated;
 	if(list->used == list->allocated)
 	{
-		list->allocated = list->allocated + (list->allocated / 2);
-		e = realloc(list->entries, sizeof(bd_entry) * (list->allocated));
+		allocated = list->allocated + (list->allocated / 2);
+		if(ctx != NULL && ctx->arena)
+		{
+			// Arena memory can't be resized; the old array is simply
+			// abandoned until the context is released.
+			e = bd_alloc(ctx, sizeof(bd_entry) * allocated);
+			if(e != NULL)
+				memcpy(e, list->entries, sizeof(bd_entry) * list->used);
+		}
+		else
+			e = realloc(list->entries, sizeof(bd_entry) * allocated);
+		if(e == NULL)
+			return -1;
 		list->entries = e;
+		list->allocated = allocated;
 	}
 
 	list->entries[list->used].type = type;
+	list->entries[list->used].flags = flags;
+	list->entries[list->used].len = len;
 	list->entries[list->used].data = data;
 	list->used++;
+	return 0;
 }
 void bd_list_destroy(bd_list* list)
 {
@@ -38,7 +187,8 @@ void bd_list_destroy(bd_list* list)
 				bd_list_destroy(list->entries[i].list);
 				break;
 			case STRING:
-				free(list->entries[i].str);
+				if(!(list->entries[i].flags & BD_BORROWED))
+					free(list->entries[i].str);
 				break;
 			default:
 				break;
@@ -48,83 +198,258 @@ void bd_list_destroy(bd_list* list)
 	free(list);
 }
 
-void bd_dict_add(bd_dict** dict, char* key, enum bd_type type, void* data)
+// Orders two keys the way canonical bencoding does: as raw byte
+// strings, shorter prefix first.
+static int bd_key_cmp(const char* a, size_t alen, const char* b, size_t blen)
 {
-	bd_dict* kvp = malloc(sizeof(bd_dict));
+	int c = memcmp(a, b, (alen < blen) ? alen : blen);
+	if(c != 0)
+		return c;
+	return (alen < blen) ? -1 : (alen > blen);
+}
 
-	// TODO: Nomem check hurr.
+// RETURNS
+// An empty dictionary with room for |allocated| entries, or NULL if
+// memory ran out.
+bd_dict* bd_dict_create(bd_ctx* ctx, int allocated)
+{
+	bd_dict* dict = bd_alloc(ctx, sizeof(bd_dict));
+	if(dict == NULL)
+		return NULL;
 
-	kvp->key = key;
-	kvp->data = data;
-	kvp->type = type;
-	kvp->next = *dict;
-	*dict = kvp;
+	allocated = (allocated > 0) ? allocated : 2;
+	dict->entries = bd_alloc(ctx, sizeof(bd_kvp) * allocated);
+	if(dict->entries == NULL)
+	{
+		if(ctx == NULL || !ctx->arena)
+			free(dict);
+		return NULL;
+	}
+	dict->allocated = allocated;
+	dict->used = 0;
+	dict->sorted = 1;
+	dict->index = NULL;
+	dict->start = 0;
+	dict->end = 0;
+	dict->ctx = NULL;
+	return dict;
 }
-bd_entry* bd_dict_find(bd_dict* dict, char* key)
+// Appends a key/value pair, preserving insertion (on-wire) order.
+//
+// RETURNS
+// Zero on success, -1 if the dictionary had to grow and memory ran out,
+// in which case it is left as it was.
+int bd_dict_add(bd_ctx* ctx, bd_dict* dict, char* key, size_t keylen, enum bd_type type, void* data, size_t len, int flags)
 {
-	bd_dict* iter = dict;
-	while(iter)
+	bd_kvp* e;
+	bd_kvp* prev;
+	int allocated;
+	if(dict->used == dict->allocated)
 	{
-		if(strcmp(iter->key, key) == 0)
+		allocated = dict->allocated + (dict->allocated / 2);
+		if(ctx != NULL && ctx->arena)
 		{
-			return iter;
+			e = bd_alloc(ctx, sizeof(bd_kvp) * allocated);
+			if(e != NULL)
+				memcpy(e, dict->entries, sizeof(bd_kvp) * dict->used);
 		}
-		iter = iter->next;
+		else
+			e = realloc(dict->entries, sizeof(bd_kvp) * allocated);
+		if(e == NULL)
+			return -1;
+		dict->entries = e;
+		dict->allocated = allocated;
+	}
+
+	if(dict->used > 0)
+	{
+		prev = &dict->entries[dict->used - 1];
+		if(bd_key_cmp(prev->key, prev->keylen, key, keylen) >= 0)
+			dict->sorted = 0;
 	}
+
+	e = &dict->entries[dict->used];
+	e->key = key;
+	e->keylen = keylen;
+	e->value.type = type;
+	e->value.flags = flags;
+	e->value.len = len;
+	e->value.data = data;
+	dict->used++;
+
+	// Any previously built index no longer covers every entry.
+	if(dict->index != NULL && !(ctx != NULL && ctx->arena))
+		free(dict->index);
+	dict->index = NULL;
 	return 0;
 }
+// Orders two entries of a dictionary by key for qsort(). Equal keys
+// keep their on-wire order.
+static int bd_kvp_cmp(const void* a, const void* b)
+{
+	const bd_kvp* x = *(const bd_kvp**)a;
+	const bd_kvp* y = *(const bd_kvp**)b;
+	int c = bd_key_cmp(x->key, x->keylen, y->key, y->keylen);
+
+	if(c != 0)
+		return c;
+	return (x > y) - (x < y);
+}
+// Prepares |dict| for O(log n) lookups. Dictionaries in canonical
+// bencode order are searched in place; for anything else a sorted
+// permutation of the entries is built so on-wire order is kept intact.
+void bd_dict_seal(bd_ctx* ctx, bd_dict* dict)
+{
+	int i;
+	bd_kvp** order;
+
+	if(dict->sorted || dict->index != NULL)
+		return;
+
+	// Any .torrent can hand us an unsorted dictionary, so this has to
+	// stay O(n log n) however far out of order it is.
+	order = malloc(sizeof(bd_kvp*) * dict->used);
+	if(order == NULL)
+		return;
+	for(i = 0; i < dict->used; i++)
+		order[i] = &dict->entries[i];
+	qsort(order, dict->used, sizeof(bd_kvp*), bd_kvp_cmp);
+
+	dict->index = bd_alloc(ctx, sizeof(int) * dict->used);
+	if(dict->index != NULL)
+	{
+		for(i = 0; i < dict->used; i++)
+			dict->index[i] = order[i] - dict->entries;
+	}
+	free(order);
+}
+// Binary (or, for unsealed dictionaries, linear) search for |key|.
+// Deferred values are returned as they are.
+static bd_entry* bd_dict_find_raw(bd_dict* dict, char* key)
+{
+	int lo;
+	int hi;
+	int mid;
+	int c;
+	bd_kvp* e;
+	size_t keylen = strlen(key);
+
+	if(dict == NULL)
+		return NULL;
+
+	if(!dict->sorted && dict->index == NULL)
+	{
+		for(mid = 0; mid < dict->used; mid++)
+		{
+			e = &dict->entries[mid];
+			if(e->keylen == keylen && memcmp(e->key, key, keylen) == 0)
+				return &e->value;
+		}
+		return NULL;
+	}
+
+	lo = 0;
+	hi = dict->used - 1;
+	while(lo <= hi)
+	{
+		mid = lo + ((hi - lo) / 2);
+		e = &dict->entries[dict->sorted ? mid : dict->index[mid]];
+		c = bd_key_cmp(e->key, e->keylen, key, keylen);
+		if(c == 0)
+			return &e->value;
+		else if(c < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+// Looks up |key| in |dict|.
+//
+// RETURNS
+// The value stored under |key|, or NULL if there is none. Sealed or
+// canonically ordered dictionaries are binary searched, anything else
+// falls back to a linear scan.
+//
+// POSTCONDITION
+// A value deferred by BD_LAZY has been decoded in place; NULL is
+// returned if that fails.
+bd_entry* bd_dict_find(bd_dict* dict, char* key)
+{
+	bd_entry* e = bd_dict_find_raw(dict, key);
+
+	if(e != NULL && (e->flags & BD_DEFERRED))
+	{
+		if(dict->ctx == NULL || bd_tape_materialize(dict->ctx, e) < 0)
+			return NULL;
+	}
+	return e;
+}
 void bd_dict_destroy(bd_dict* dict)
 {
-	bd_dict* dt;
-	bd_dict* d = dict;
+	int i;
+	bd_kvp* d;
+
+	if(dict == NULL)
+		return;
 
-	while(d)
+	for(i = 0; i < dict->used; i++)
 	{
-		dt = d->next;
-		switch(d->type)
+		d = &dict->entries[i];
+		switch(d->value.type)
 		{
 			case DICTIONARY:
-				bd_dict_destroy(d->dict);
+				bd_dict_destroy(d->value.dict);
 				break;
 			case LIST:
-				bd_list_destroy(d->list);
+				bd_list_destroy(d->value.list);
 				break;
 			case STRING:
-				free(d->str);
+				if(!(d->value.flags & BD_BORROWED))
+					free(d->value.str);
 				break;
 			default:
 				break;
 		}
-		free(d);
-		d = dt;
+		if(!(d->value.flags & BD_BORROWED))
+			free(d->key);
 	}
+	free(dict->index);
+	free(dict->entries);
+	free(dict);
 }
 
 void bd_dict_print(bd_dict* dict, int indent)
 {
 	indent = (indent > 32) ? 0 : indent;
-	bd_dict* itr = dict;
-	while(itr)
+	int i;
+	bd_kvp* itr;
+	for(i = 0; i < dict->used; i++)
 	{
-		printf("%*s" "%s::\n", indent, "  ", itr->key);
-		switch(itr->type)
+		itr = &dict->entries[i];
+		printf("%*s" "%.*s::\n", indent, "  ", (int)itr->keylen, itr->key);
+		if(itr->value.flags & BD_DEFERRED)
+		{
+			printf("%*s" "<%zu bytes, not decoded>\n", indent + 1, "  ", itr->value.len);
+			continue;
+		}
+		switch(itr->value.type)
 		{
 			case DICTIONARY:
-				bd_dict_print(itr->data, indent + 1);
+				bd_dict_print(itr->value.dict, indent + 1);
 				break;
 			case STRING:
-				printf("%*s" "%s\n", indent + 1, "  ", itr->str);
+				printf("%*s" "%.*s\n", indent + 1, "  ", (int)itr->value.len, itr->value.str);
 				break;
 			case NUMBER:
-				printf("%*s" "%lli\n", indent + 1, "  ", (long long)itr->data);
+				printf("%*s" "%lli\n", indent + 1, "  ", (long long)itr->value.data);
 				break;
 			case LIST:
-				bd_list_print(itr->data, indent + 1);
+				bd_list_print(itr->value.list, indent + 1);
 				break;
 			default:
 				break;
 		}
-		itr = itr->next;
 	}
 }
 void bd_list_print(bd_list* list, int indent)
@@ -145,7 +470,7 @@ void bd_list_print(bd_list* list, int indent)
 				bd_list_print(list->entries[i].list, indent + 1);
 				break;
 			case STRING:
-				printf("%*s" "%s\n", indent, "  ", list->entries[i].str);
+				printf("%*s" "%.*s\n", indent, "  ", (int)list->entries[i].len, list->entries[i].str);
 				break;
 			default:
 				break;
@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include "corsair.h"
+
+#define COR_BITS_WORD(i) ((i) >> 6)
+#define COR_BITS_MASK(i) ((uint64_t)1 << ((i) & 63))
+
+// Creates a bitmap of |num_bits| bits, all clear.
+//
+// RETURNS
+// The bitmap, freed with free(), or NULL if memory ran out.
+uint64_t* cor_bits_create(uint32_t num_bits)
+{
+	return calloc(((size_t)num_bits + 63) / 64, sizeof(uint64_t));
+}
+
+// Sets bit |i|. Anyone who then sees it set also sees whatever was
+// written before it was set.
+//
+// RETURNS
+// Nonzero if this call is the one that set it.
+int cor_bits_set(uint64_t* bits, uint32_t i)
+{
+	return (__atomic_fetch_or(&bits[COR_BITS_WORD(i)], COR_BITS_MASK(i), __ATOMIC_ACQ_REL) & COR_BITS_MASK(i)) == 0;
+}
+
+// RETURNS
+// Nonzero if bit |i| is set.
+int cor_bits_test(const uint64_t* bits, uint32_t i)
+{
+	return (__atomic_load_n(&bits[COR_BITS_WORD(i)], __ATOMIC_ACQUIRE) & COR_BITS_MASK(i)) != 0;
+}
+
+// Mask of the bits of word |w| that fall in [first, last].
+static inline uint64_t cor_bits_span(uint32_t w, uint32_t first, uint32_t last)
+{
+	uint64_t mask = ~(uint64_t)0;
+
+	if(w == COR_BITS_WORD(first))
+		mask &= ~(uint64_t)0 << (first & 63);
+	if(w == COR_BITS_WORD(last))
+		mask &= ~(uint64_t)0 >> (63 - (last & 63));
+	return mask;
+}
+
+// RETURNS
+// The number of bits set in [first, last].
+uint32_t cor_bits_count(const uint64_t* bits, uint32_t first, uint32_t last)
+{
+	uint32_t count = 0;
+	uint32_t w;
+
+	if(first > last)
+		return 0;
+
+	for(w = COR_BITS_WORD(first); w <= COR_BITS_WORD(last); w++)
+		count += __builtin_popcountll(__atomic_load_n(&bits[w], __ATOMIC_ACQUIRE) & cor_bits_span(w, first, last));
+	return count;
+}
+
+// RETURNS
+// Nonzero if every bit in [first, last] is set.
+int cor_bits_all(const uint64_t* bits, uint32_t first, uint32_t last)
+{
+	uint64_t mask;
+	uint32_t w;
+
+	if(first > last)
+		return 1;
+
+	for(w = COR_BITS_WORD(first); w <= COR_BITS_WORD(last); w++)
+	{
+		mask = cor_bits_span(w, first, last);
+		if((__atomic_load_n(&bits[w], __ATOMIC_ACQUIRE) & mask) != mask)
+			return 0;
+	}
+	return 1;
+}
+
+// RETURNS
+// The first bit in [first, last] that is set, if |set| is nonzero, or
+// clear otherwise; last + 1 if there is none.
+uint32_t cor_bits_find(const uint64_t* bits, uint32_t first, uint32_t last, int set)
+{
+	uint64_t word;
+	uint32_t w;
+
+	if(first > last)
+		return last + 1;
+
+	for(w = COR_BITS_WORD(first); w <= COR_BITS_WORD(last); w++)
+	{
+		word = __atomic_load_n(&bits[w], __ATOMIC_ACQUIRE);
+		if(!set)
+			word = ~word;
+		word &= cor_bits_span(w, first, last);
+		if(word != 0)
+			return (w * 64) + __builtin_ctzll(word);
+	}
+	return last + 1;
+}
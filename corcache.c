@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "corsair.h"
+
+// Number of shards; a piece always lands in the same one, so readers of
+// different pieces rarely contend on a lock.
+#define COR_CACHE_SHARDS 16
+
+// Rough piece size used to size the hash tables. Chains absorb any
+// difference.
+#define COR_CACHE_PIECE_GUESS (256 * 1024)
+
+struct cor_cache_entry
+{
+	// Hash chain, and the shard's LRU list (most recently used first).
+	struct cor_cache_entry* chain;
+	struct cor_cache_entry* newer;
+	struct cor_cache_entry* older;
+
+	uint32_t torrent;
+	uint32_t piece;
+	size_t len;
+	char data[];
+};
+
+struct cor_cache_shard
+{
+	pthread_mutex_t lock;
+	struct cor_cache_entry** buckets;
+	size_t mask;
+	struct cor_cache_entry* newest;
+	struct cor_cache_entry* oldest;
+	size_t used;
+	size_t budget;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+struct cor_cache
+{
+	struct cor_cache_shard shards[COR_CACHE_SHARDS];
+	size_t max_entry;
+};
+
+static inline uint64_t cor_cache_hash(uint32_t torrent, uint32_t piece)
+{
+	uint64_t h = ((uint64_t)torrent << 32) | piece;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+static inline struct cor_cache_shard* cor_cache_shard(struct cor_cache* cache, uint64_t h)
+{
+	return &cache->shards[h % COR_CACHE_SHARDS];
+}
+
+// Creates a cache holding at most |budget| bytes of piece data.
+//
+// RETURNS
+// The cache, or NULL if |budget| is zero (caching disabled) or memory
+// ran out.
+struct cor_cache* cor_cache_create(size_t budget)
+{
+	struct cor_cache* cache;
+	struct cor_cache_shard* s;
+	size_t buckets;
+	int i;
+
+	if(budget == 0)
+		return NULL;
+
+	cache = calloc(1, sizeof(struct cor_cache));
+	if(cache == NULL)
+		return NULL;
+
+	// A single piece may take up to a quarter of its shard; anything
+	// bigger would just flush the shard on every insert.
+	cache->max_entry = (budget / COR_CACHE_SHARDS) / 4;
+
+	buckets = 64;
+	while(buckets < (budget / COR_CACHE_SHARDS) / COR_CACHE_PIECE_GUESS)
+		buckets *= 2;
+
+	for(i = 0; i < COR_CACHE_SHARDS; i++)
+	{
+		s = &cache->shards[i];
+		s->buckets = calloc(buckets, sizeof(struct cor_cache_entry*));
+		if(s->buckets == NULL)
+		{
+			while(i-- > 0)
+			{
+				free(cache->shards[i].buckets);
+				pthread_mutex_destroy(&cache->shards[i].lock);
+			}
+			free(cache);
+			return NULL;
+		}
+		pthread_mutex_init(&s->lock, NULL);
+		s->mask = buckets - 1;
+		s->budget = budget / COR_CACHE_SHARDS;
+	}
+	return cache;
+}
+void cor_cache_destroy(struct cor_cache* cache)
+{
+	struct cor_cache_entry* e;
+	struct cor_cache_entry* et;
+	int i;
+
+	if(cache == NULL)
+		return;
+
+	for(i = 0; i < COR_CACHE_SHARDS; i++)
+	{
+		e = cache->shards[i].newest;
+		while(e)
+		{
+			et = e->older;
+			free(e);
+			e = et;
+		}
+		free(cache->shards[i].buckets);
+		pthread_mutex_destroy(&cache->shards[i].lock);
+	}
+	free(cache);
+}
+
+// Unlinks |e| from the LRU list of |s|.
+static void cor_cache_unlink(struct cor_cache_shard* s, struct cor_cache_entry* e)
+{
+	if(e->newer)
+		e->newer->older = e->older;
+	else
+		s->newest = e->older;
+	if(e->older)
+		e->older->newer = e->newer;
+	else
+		s->oldest = e->newer;
+}
+static void cor_cache_push(struct cor_cache_shard* s, struct cor_cache_entry* e)
+{
+	e->newer = NULL;
+	e->older = s->newest;
+	if(s->newest)
+		s->newest->newer = e;
+	else
+		s->oldest = e;
+	s->newest = e;
+}
+
+// Finds the entry for |piece| and the chain link pointing at it.
+static struct cor_cache_entry** cor_cache_slot(struct cor_cache_shard* s, uint64_t h, uint32_t torrent, uint32_t piece)
+{
+	struct cor_cache_entry** p = &s->buckets[(h / COR_CACHE_SHARDS) & s->mask];
+
+	while(*p != NULL && ((*p)->torrent != torrent || (*p)->piece != piece))
+		p = &(*p)->chain;
+	return p;
+}
+
+// Drops entries from the cold end of |s| until |need| more bytes fit.
+static void cor_cache_evict(struct cor_cache_shard* s, size_t need)
+{
+	struct cor_cache_entry* e;
+	struct cor_cache_entry** p;
+
+	while(s->oldest != NULL && s->used + need > s->budget)
+	{
+		e = s->oldest;
+		p = cor_cache_slot(s, cor_cache_hash(e->torrent, e->piece), e->torrent, e->piece);
+		*p = e->chain;
+		cor_cache_unlink(s, e);
+		s->used -= e->len;
+		free(e);
+	}
+}
+
+// RETURNS
+// Nonzero if a piece of |len| bytes would be cached at all.
+int cor_cache_fits(struct cor_cache* cache, size_t len)
+{
+	return len <= cache->max_entry;
+}
+
+// Copies |len| bytes at |offset| within |piece| of |torrent| to |dst|.
+//
+// RETURNS
+// The number of bytes copied (less than |len| only at the end of the
+// piece), or -1 if the piece isn't cached.
+long cor_cache_read(struct cor_cache* cache, uint32_t torrent, uint32_t piece, size_t offset, char* dst, size_t len)
+{
+	uint64_t h = cor_cache_hash(torrent, piece);
+	struct cor_cache_shard* s = cor_cache_shard(cache, h);
+	struct cor_cache_entry* e;
+
+	pthread_mutex_lock(&s->lock);
+	e = *cor_cache_slot(s, h, torrent, piece);
+	if(e == NULL || offset > e->len)
+	{
+		s->misses++;
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+
+	len = (len < e->len - offset) ? len : e->len - offset;
+	memcpy(dst, &e->data[offset], len);
+	cor_cache_unlink(s, e);
+	cor_cache_push(s, e);
+	s->hits++;
+	pthread_mutex_unlock(&s->lock);
+	return len;
+}
+
+// Inserts a copy of the verified |piece| of |torrent|, |len| bytes at
+// |data|, unless it is already cached.
+//
+// RETURNS
+// Zero if the piece was cached, -1 if it is too large for the cache or
+// memory ran out.
+int cor_cache_insert(struct cor_cache* cache, uint32_t torrent, uint32_t piece, const char* data, size_t len)
+{
+	uint64_t h = cor_cache_hash(torrent, piece);
+	struct cor_cache_shard* s = cor_cache_shard(cache, h);
+	struct cor_cache_entry* e;
+	struct cor_cache_entry** p;
+
+	if(!cor_cache_fits(cache, len))
+		return -1;
+
+	// Copy outside the lock; pieces can be several megabytes.
+	e = malloc(sizeof(struct cor_cache_entry) + len);
+	if(e == NULL)
+		return -1;
+	e->torrent = torrent;
+	e->piece = piece;
+	e->len = len;
+	memcpy(e->data, data, len);
+
+	pthread_mutex_lock(&s->lock);
+	p = cor_cache_slot(s, h, torrent, piece);
+	if(*p != NULL)
+	{
+		// Someone else got there first; keep theirs.
+		pthread_mutex_unlock(&s->lock);
+		free(e);
+		return 0;
+	}
+
+	cor_cache_evict(s, len);
+	// Eviction may have emptied the chain |p| pointed into.
+	p = cor_cache_slot(s, h, torrent, piece);
+	e->chain = NULL;
+	*p = e;
+	cor_cache_push(s, e);
+	s->used += len;
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+// Sums the counters of every shard.
+void cor_cache_stats(struct cor_cache* cache, uint64_t* hits, uint64_t* misses, size_t* used)
+{
+	int i;
+
+	*hits = 0;
+	*misses = 0;
+	*used = 0;
+	for(i = 0; i < COR_CACHE_SHARDS; i++)
+	{
+		pthread_mutex_lock(&cache->shards[i].lock);
+		*hits += cache->shards[i].hits;
+		*misses += cache->shards[i].misses;
+		*used += cache->shards[i].used;
+		pthread_mutex_unlock(&cache->shards[i].lock);
+	}
+}
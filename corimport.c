@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "corsair.h"
+
+#define COR_IMPORT_MAX_THREADS 32
+
+// Shared state of one import. Workers claim torrents by bumping |next|,
+// so each slot of |torrents| is written by exactly one thread.
+struct cor_import
+{
+	struct cor_torrent* torrents;
+	int count;
+	int next;
+	const char* cache_dir;
+};
+
+static void* cor_import_worker(void* arg)
+{
+	struct cor_import* job = arg;
+	bd_ctx* ctx;
+	int i;
+
+	// Every worker decodes into its own context; the arena is reset by
+	// cor_meta_open after each torrent, so it only ever grows to the
+	// largest one. libtorrent's own parse is done here too, so the
+	// session only has to take the result. It runs on every mount,
+	// cached metadata or not, and costs about as much as a cache miss.
+	ctx = bd_ctx_create(BD_ZEROCOPY);
+	if(ctx == NULL)
+		return NULL;
+
+	while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+	{
+		job->torrents[i].meta = cor_meta_open(ctx, job->torrents[i].path, job->cache_dir);
+		if(job->torrents[i].meta != NULL)
+			job->torrents[i].params = cor_tor_parse(job->torrents[i].path);
+	}
+
+	bd_ctx_destroy(ctx);
+	return NULL;
+}
+
+static int cor_import_path_cmp(const void* a, const void* b)
+{
+	return strcmp(((const struct cor_torrent*)a)->path, ((const struct cor_torrent*)b)->path);
+}
+static int cor_import_hash_cmp(const void* a, const void* b)
+{
+	return memcmp(((const struct cor_torrent*)a)->meta->hdr->infohash,
+			((const struct cor_torrent*)b)->meta->hdr->infohash, 20);
+}
+
+// Lists the .torrent files in |dir|.
+//
+// RETURNS
+// The number of torrents found, or -1 if |dir| can't be read or memory
+// ran out.
+static int cor_import_scan(const char* dir, struct cor_torrent** torrents)
+{
+	DIR* dp;
+	struct dirent* de;
+	char path[PATH_MAX];
+	struct cor_torrent* list = NULL;
+	struct cor_torrent* grown;
+	int count = 0;
+	int allocated = 0;
+	size_t len;
+
+	dp = opendir(dir);
+	if(dp == NULL)
+		return -1;
+
+	while((de = readdir(dp)) != NULL)
+	{
+		len = strlen(de->d_name);
+		if(len < 9 || strcmp(de->d_name + len - 8, ".torrent") != 0)
+			continue;
+		if(snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path))
+			continue;
+
+		if(count == allocated)
+		{
+			grown = realloc(list, sizeof(struct cor_torrent) * (allocated ? allocated * 2 : 64));
+			if(grown == NULL)
+				goto nomem;
+			list = grown;
+			allocated = allocated ? allocated * 2 : 64;
+		}
+		list[count].path = strdup(path);
+		if(list[count].path == NULL)
+			goto nomem;
+		list[count].meta = NULL;
+		list[count].params = NULL;
+		list[count].handle = NULL;
+		list[count].have = NULL;
+		list[count].progress = NULL;
+		count++;
+	}
+	closedir(dp);
+
+	// Decode in a stable order so that reruns report the same thing.
+	qsort(list, count, sizeof(struct cor_torrent), cor_import_path_cmp);
+	*torrents = list;
+	return count;
+
+nomem:
+	COR_LOG(LOG_ERR, "No memory to list the torrents in %s.", dir);
+	closedir(dp);
+	while(count > 0)
+		free(list[--count].path);
+	free(list);
+	return -1;
+}
+
+// Decodes every .torrent in |dir| on a pool of |threads| workers (zero
+// picks one per online CPU). Torrents that fail to load are reported and
+// dropped, as are duplicates of an infohash already imported.
+//
+// RETURNS
+// The number of torrents in |*torrents|, sorted by infohash, or -1 if
+// |dir| can't be read or memory ran out listing it.
+//
+// POSTCONDITION
+// Each entry has its |meta| loaded and its |params| parsed, or NULL if
+// libtorrent couldn't make sense of it; the caller adds them to the
+// session.
+int cor_import_dir(const char* dir, const char* cache_dir, int threads, struct cor_torrent** torrents)
+{
+	struct cor_import job;
+	pthread_t pool[COR_IMPORT_MAX_THREADS];
+	int started = 0;
+	int count;
+	int used;
+	int i;
+
+	count = cor_import_scan(dir, &job.torrents);
+	if(count < 0)
+		return -1;
+	job.count = count;
+	job.next = 0;
+	job.cache_dir = cache_dir;
+
+	if(threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > COR_IMPORT_MAX_THREADS)
+		threads = COR_IMPORT_MAX_THREADS;
+	if(threads > count)
+		threads = count;
+
+	for(i = 0; i < threads; i++)
+	{
+		if(pthread_create(&pool[started], NULL, cor_import_worker, &job) == 0)
+			started++;
+	}
+
+	// Whatever the pool didn't get to (all of it, if no thread could be
+	// started) is done here.
+	cor_import_worker(&job);
+	for(i = 0; i < started; i++)
+		pthread_join(pool[i], NULL);
+
+	// Compact out the failures.
+	used = 0;
+	for(i = 0; i < count; i++)
+	{
+		if(job.torrents[i].meta == NULL)
+		{
+			COR_LOG(LOG_WARNING, "Could not load torrent %s.", job.torrents[i].path);
+			free(job.torrents[i].path);
+			continue;
+		}
+		job.torrents[used++] = job.torrents[i];
+	}
+
+	// The session refuses a second copy of a torrent, so drop those
+	// before they get that far.
+	qsort(job.torrents, used, sizeof(struct cor_torrent), cor_import_hash_cmp);
+	count = used;
+	used = 0;
+	for(i = 0; i < count; i++)
+	{
+		if(used > 0 && cor_import_hash_cmp(&job.torrents[used - 1], &job.torrents[i]) == 0)
+		{
+			COR_LOG(LOG_WARNING, "Skipping %s, same torrent as %s.", job.torrents[i].path, job.torrents[used - 1].path);
+			cor_meta_free(job.torrents[i].meta);
+			cor_tor_discard(job.torrents[i].params);
+			free(job.torrents[i].path);
+			continue;
+		}
+		job.torrents[used++] = job.torrents[i];
+	}
+
+	*torrents = job.torrents;
+	return used;
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "corsair.h"
+
+// Lines a thread can have waiting for the flusher. Past that its lines
+// are dropped, and counted, rather than ever making it wait.
+#define COR_LOG_SLOTS 128
+
+// Longest line kept, terminator included; longer ones are cut short.
+#define COR_LOG_LINE 240
+
+static char const* priority[] =
+{
+		"EMERG:",
+		"ALERT:",
+		"CRIT:",
+		"ERR:",
+		"WARNING:",
+		"NOTICE:",
+		"INFO:",
+		"DEBUG:",
+};
+
+struct cor_log_rec
+{
+	struct timespec when;
+	int level;
+	char text[COR_LOG_LINE];
+};
+
+// The lines of one thread. Only the owner advances |head| and only the
+// flusher |tail|, so neither ever waits on the other.
+struct cor_log_ring
+{
+	struct cor_log_ring* next;
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	struct cor_log_rec recs[COR_LOG_SLOTS];
+};
+
+int cor_log_threshold = LOG_INFO;
+
+// Every thread's ring, newest first. Rings are only ever pushed on while
+// the flusher runs.
+static struct cor_log_ring* cor_log_rings;
+static __thread struct cor_log_ring* cor_log_mine;
+
+// Where lines go: syslog if |cor_log_syslog| is set, otherwise
+// |cor_log_file|, or stderr before cor_log_init() picks one.
+static FILE* cor_log_file;
+static int cor_log_syslog;
+
+// Until the flusher is running, lines are written out right away under
+// |cor_log_lock|. The flusher sleeps on |cor_log_cond| with
+// |cor_log_sleeping| set when it has nothing to do. |cor_log_stopped| is
+// set once it has been joined, after which whoever queues a line also
+// drains it, under |cor_log_lock|.
+static int cor_log_running;
+static int cor_log_stopping;
+static int cor_log_sleeping;
+static int cor_log_stopped;
+static pthread_t cor_log_thread;
+static pthread_mutex_t cor_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cor_log_cond = PTHREAD_COND_INITIALIZER;
+
+// Sets up where lines go: syslog if |sink| is "syslog", the file |sink|
+// (appended to) otherwise, or stderr if it is NULL or empty. Lines less
+// severe than |threshold|, a syslog level, are skipped.
+//
+// PRECONDITION
+// Nothing is logging yet.
+void cor_log_init(const char* sink, int threshold)
+{
+	cor_log_threshold = (threshold < LOG_EMERG) ? LOG_EMERG : (threshold > LOG_DEBUG) ? LOG_DEBUG : threshold;
+	cor_log_file = stderr;
+
+	if(sink == NULL || *sink == '\0')
+		return;
+
+	if(strcmp(sink, "syslog") == 0)
+	{
+		openlog("corsair", LOG_PID, LOG_DAEMON);
+		cor_log_syslog = 1;
+		return;
+	}
+
+	cor_log_file = fopen(sink, "a");
+	if(cor_log_file == NULL)
+	{
+		cor_log_file = stderr;
+		COR_LOG(LOG_WARNING, "Could not open log %s, logging to stderr.", sink);
+	}
+}
+
+static FILE* cor_log_out()
+{
+	return (cor_log_file != NULL) ? cor_log_file : stderr;
+}
+static void cor_log_emit(const struct timespec* when, int level, const char* text)
+{
+	struct tm tm;
+	char stamp[32];
+
+	if(cor_log_syslog)
+	{
+		syslog(level, "%s", text);
+		return;
+	}
+
+	localtime_r(&when->tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(cor_log_out(), "%s.%03ld %s %s\n", stamp, when->tv_nsec / 1000000, priority[level], text);
+}
+
+static struct cor_log_ring* cor_log_ring_new()
+{
+	struct cor_log_ring* r;
+
+	r = calloc(1, sizeof(struct cor_log_ring));
+	if(r == NULL)
+		return NULL;
+
+	r->next = __atomic_load_n(&cor_log_rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&cor_log_rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return r;
+}
+
+// RETURNS
+// Nonzero if any thread has lines waiting.
+static int cor_log_pending()
+{
+	struct cor_log_ring* r;
+
+	for(r = __atomic_load_n(&cor_log_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+	{
+		if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail)
+			return 1;
+	}
+	return 0;
+}
+
+// Writes out every line waiting.
+//
+// RETURNS
+// The number of lines written.
+static int cor_log_drain()
+{
+	struct cor_log_ring* r;
+	struct cor_log_rec* rec;
+	struct timespec now;
+	char text[64];
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	int count = 0;
+
+	for(r = __atomic_load_n(&cor_log_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+	{
+		head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+		for(tail = r->tail; tail != head; tail++)
+		{
+			rec = &r->recs[tail % COR_LOG_SLOTS];
+			cor_log_emit(&rec->when, rec->level, rec->text);
+			count++;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if(dropped > 0)
+		{
+			clock_gettime(CLOCK_REALTIME, &now);
+			snprintf(text, sizeof(text), "%llu lines dropped.", (unsigned long long)dropped);
+			cor_log_emit(&now, LOG_WARNING, text);
+			count++;
+		}
+	}
+
+	if(count > 0 && !cor_log_syslog)
+		fflush(cor_log_out());
+	return count;
+}
+
+// Logs a line at |level|, printf style. Use COR_LOG(), which skips the
+// call for lines under the threshold.
+//
+// Once the flusher is running this never blocks or makes a syscall
+// beyond reading the clock, except to wake the flusher when it sleeps.
+void cor_log_write(int level, const char* fmt, ...)
+{
+	struct cor_log_ring* r;
+	struct cor_log_rec* rec;
+	struct timespec when;
+	char text[COR_LOG_LINE];
+	uint32_t head;
+	va_list ap;
+
+	level = (level < LOG_EMERG) ? LOG_EMERG : (level > LOG_DEBUG) ? LOG_DEBUG : level;
+
+	if(!__atomic_load_n(&cor_log_running, __ATOMIC_ACQUIRE))
+	{
+		clock_gettime(CLOCK_REALTIME, &when);
+		va_start(ap, fmt);
+		vsnprintf(text, sizeof(text), fmt, ap);
+		va_end(ap);
+
+		pthread_mutex_lock(&cor_log_lock);
+		cor_log_emit(&when, level, text);
+		if(!cor_log_syslog)
+			fflush(cor_log_out());
+		pthread_mutex_unlock(&cor_log_lock);
+		return;
+	}
+
+	r = cor_log_mine;
+	if(r == NULL)
+	{
+		r = cor_log_mine = cor_log_ring_new();
+		if(r == NULL)
+			return;
+	}
+
+	head = r->head;
+	if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == COR_LOG_SLOTS)
+	{
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &r->recs[head % COR_LOG_SLOTS];
+	clock_gettime(CLOCK_REALTIME, &rec->when);
+	rec->level = level;
+	va_start(ap, fmt);
+	vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+
+	// Publishing the line and then looking for a sleeping flusher pairs
+	// with the flusher announcing its sleep and then looking for lines,
+	// so one of the two always sees the other. The same goes for a line
+	// that raced cor_log_stop() and the flusher's last drain.
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&cor_log_stopped, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&cor_log_lock);
+		cor_log_drain();
+		pthread_mutex_unlock(&cor_log_lock);
+	}
+	else if(__atomic_load_n(&cor_log_sleeping, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&cor_log_lock);
+		pthread_cond_signal(&cor_log_cond);
+		pthread_mutex_unlock(&cor_log_lock);
+	}
+}
+
+// Sleeps until there are lines, with no timeout: the handshake with
+// cor_log_write() means it is always woken for one.
+static void* cor_log_flusher(void* arg)
+{
+	for(;;)
+	{
+		if(cor_log_drain() > 0)
+			continue;
+		if(__atomic_load_n(&cor_log_stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		pthread_mutex_lock(&cor_log_lock);
+		__atomic_store_n(&cor_log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if(!cor_log_pending() && !__atomic_load_n(&cor_log_stopping, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&cor_log_cond, &cor_log_lock);
+		__atomic_store_n(&cor_log_sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&cor_log_lock);
+	}
+
+	cor_log_drain();
+	return NULL;
+}
+
+// Starts the flusher. Lines are queued per thread from here on instead
+// of written out by whoever logs them.
+//
+// PRECONDITION
+// The process won't fork again; the flusher wouldn't come along.
+//
+// RETURNS
+// Zero on success, -1 if the thread couldn't be started, in which case
+// lines keep being written out directly.
+int cor_log_start()
+{
+	if(pthread_create(&cor_log_thread, NULL, cor_log_flusher, NULL) != 0)
+		return -1;
+	__atomic_store_n(&cor_log_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Writes out whatever is queued and stops the flusher. Lines logged after
+// this are written out directly again.
+void cor_log_stop()
+{
+	if(!__atomic_load_n(&cor_log_running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&cor_log_running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&cor_log_stopping, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&cor_log_lock);
+	pthread_cond_signal(&cor_log_cond);
+	pthread_mutex_unlock(&cor_log_lock);
+	pthread_join(cor_log_thread, NULL);
+
+	// A thread that saw the flusher running may have queued its line
+	// after the flusher's last drain. Either this drain finds it or the
+	// thread sees |cor_log_stopped| and drains it itself.
+	pthread_mutex_lock(&cor_log_lock);
+	__atomic_store_n(&cor_log_stopped, 1, __ATOMIC_SEQ_CST);
+	cor_log_drain();
+	pthread_mutex_unlock(&cor_log_lock);
+
+	// The rings are left for the process to take down; threads may
+	// still hold theirs.
+}
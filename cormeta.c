@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "corsair.h"
+#include "sha1.h"
+
+#define COR_ALIGN8(n) (((n) + 7) & ~((size_t)7))
+
+// Builds "<cache_dir>/<hex key>.cmeta" into |path|.
+static void cor_meta_path(char path[PATH_MAX], const char* cache_dir, const unsigned char key[20])
+{
+	char hex[41];
+	int i;
+
+	for(i = 0; i < 20; i++)
+		sprintf(&hex[i * 2], "%02x", key[i]);
+	snprintf(path, PATH_MAX, "%s/%s.cmeta", cache_dir, hex);
+}
+
+// Points the section pointers of |meta| into its image.
+static void cor_meta_bind(struct cor_meta* meta)
+{
+	unsigned char* base = meta->image;
+
+	meta->hdr = meta->image;
+	meta->files = (struct cor_meta_file*)(base + meta->hdr->files_off);
+	meta->hashes = base + meta->hdr->hashes_off;
+	meta->strings = (char*)(base + meta->hdr->strings_off);
+}
+
+// A path component is usable if it is non-empty, cannot climb out of
+// the save path and contains no separators of its own.
+static int cor_meta_component_ok(bd_entry* e)
+{
+	if(e->type != STRING || e->len == 0)
+		return 0;
+	if(memchr(e->str, '/', e->len) != NULL || memchr(e->str, '\0', e->len) != NULL)
+		return 0;
+	if((e->len == 1 && e->str[0] == '.') || (e->len == 2 && e->str[0] == '.' && e->str[1] == '.'))
+		return 0;
+	return 1;
+}
+
+// Compiles the decoded .torrent |root| into a metadata image.
+//
+// RETURNS
+// The compiled metadata, or NULL if |root| is not a usable torrent
+// (missing fields, malformed piece hashes or unsafe paths).
+struct cor_meta* cor_meta_compile(bd_dict* root, const unsigned char infohash[20])
+{
+	bd_entry* info;
+	bd_entry* name;
+	bd_entry* plen;
+	bd_entry* pieces;
+	bd_entry* files;
+	bd_entry* length;
+	bd_entry* path;
+	bd_dict* fd;
+	struct cor_meta* meta;
+	struct cor_meta_header* hdr;
+	struct cor_meta_file* f;
+	size_t strings = 0;
+	size_t size;
+	size_t s;
+	uint64_t offset = 0;
+	int num_files;
+	int i;
+	int j;
+
+	info = bd_dict_find(root, "info");
+	if(info == NULL || info->type != DICTIONARY)
+		return NULL;
+
+	name = bd_dict_find(info->dict, "name");
+	plen = bd_dict_find(info->dict, "piece length");
+	pieces = bd_dict_find(info->dict, "pieces");
+	files = bd_dict_find(info->dict, "files");
+	if(name == NULL || !cor_meta_component_ok(name))
+		return NULL;
+	if(plen == NULL || plen->type != NUMBER || (long long)plen->data <= 0 || (long long)plen->data > UINT32_MAX)
+		return NULL;
+	if(pieces == NULL || pieces->type != STRING || pieces->len % 20 != 0)
+		return NULL;
+
+	// Size the string table: the torrent name, then one joined path
+	// per file.
+	strings = name->len + 1;
+	if(files != NULL)
+	{
+		if(files->type != LIST)
+			return NULL;
+		num_files = files->list->used;
+		for(i = 0; i < num_files; i++)
+		{
+			if(files->list->entries[i].type != DICTIONARY)
+				return NULL;
+			fd = files->list->entries[i].dict;
+			length = bd_dict_find(fd, "length");
+			path = bd_dict_find(fd, "path");
+			if(length == NULL || length->type != NUMBER || (long long)length->data < 0)
+				return NULL;
+			if(path == NULL || path->type != LIST || path->list->used == 0)
+				return NULL;
+
+			strings += name->len + 1;
+			for(j = 0; j < path->list->used; j++)
+			{
+				if(!cor_meta_component_ok(&path->list->entries[j]))
+					return NULL;
+				strings += path->list->entries[j].len + 1;
+			}
+		}
+	}
+	else
+	{
+		length = bd_dict_find(info->dict, "length");
+		if(length == NULL || length->type != NUMBER || (long long)length->data < 0)
+			return NULL;
+		num_files = 1;
+		strings += name->len + 1;
+	}
+
+	size = COR_ALIGN8(sizeof(struct cor_meta_header));
+	size += COR_ALIGN8(sizeof(struct cor_meta_file) * num_files);
+	size += COR_ALIGN8(pieces->len);
+	size += strings;
+	if(strings > UINT32_MAX)
+		return NULL;
+
+	meta = calloc(1, sizeof(struct cor_meta));
+	if(meta == NULL)
+		return NULL;
+	meta->image = calloc(1, size);
+	if(meta->image == NULL)
+	{
+		free(meta);
+		return NULL;
+	}
+
+	hdr = meta->image;
+	memcpy(hdr->magic, COR_META_MAGIC, sizeof(COR_META_MAGIC));
+	hdr->version = COR_META_VERSION;
+	hdr->num_files = num_files;
+	hdr->image_size = size;
+	hdr->piece_length = (uint32_t)(long long)plen->data;
+	hdr->num_pieces = pieces->len / 20;
+	memcpy(hdr->infohash, infohash, 20);
+	hdr->files_off = COR_ALIGN8(sizeof(struct cor_meta_header));
+	hdr->hashes_off = hdr->files_off + COR_ALIGN8(sizeof(struct cor_meta_file) * num_files);
+	hdr->strings_off = hdr->hashes_off + COR_ALIGN8(pieces->len);
+	cor_meta_bind(meta);
+
+	memcpy(meta->hashes, pieces->str, pieces->len);
+
+	hdr->name_off = 0;
+	memcpy(meta->strings, name->str, name->len);
+	s = name->len + 1;
+
+	for(i = 0; i < num_files; i++)
+	{
+		f = &meta->files[i];
+		f->path_off = s;
+
+		if(files == NULL)
+		{
+			length = bd_dict_find(info->dict, "length");
+			memcpy(&meta->strings[s], name->str, name->len);
+			s += name->len;
+		}
+		else
+		{
+			fd = files->list->entries[i].dict;
+			length = bd_dict_find(fd, "length");
+			path = bd_dict_find(fd, "path");
+
+			memcpy(&meta->strings[s], name->str, name->len);
+			s += name->len;
+			for(j = 0; j < path->list->used; j++)
+			{
+				meta->strings[s++] = '/';
+				memcpy(&meta->strings[s], path->list->entries[j].str, path->list->entries[j].len);
+				s += path->list->entries[j].len;
+			}
+		}
+		meta->strings[s++] = '\0';
+
+		f->path_len = s - f->path_off - 1;
+		f->offset = offset;
+		f->length = (long long)length->data;
+		offset += f->length;
+	}
+	hdr->total_size = offset;
+
+	return meta;
+}
+
+// Records in |hdr| which file the image is compiled from.
+static void cor_meta_stamp(struct cor_meta_header* hdr, const struct stat* st)
+{
+	hdr->source_dev = st->st_dev;
+	hdr->source_ino = st->st_ino;
+	hdr->source_size = st->st_size;
+	hdr->source_mtime_sec = st->st_mtim.tv_sec;
+	hdr->source_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+// Maps the cached image under |key| from |cache_dir|, if it was compiled
+// from the file |source| describes as it is now.
+//
+// RETURNS
+// The metadata, or NULL if there is no cache entry, it is stale or it
+// fails the header and bounds checks (in which case it is simply
+// rebuilt).
+struct cor_meta* cor_meta_load(const char* cache_dir, const unsigned char key[20], const struct stat* source)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct cor_meta* meta;
+	struct cor_meta_header* hdr;
+	void* image;
+	int fd;
+	uint32_t i;
+
+	cor_meta_path(path, cache_dir, key);
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cor_meta_header))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(image == MAP_FAILED)
+		return NULL;
+
+	hdr = image;
+	if(memcmp(hdr->magic, COR_META_MAGIC, sizeof(COR_META_MAGIC)) != 0
+		|| hdr->version != COR_META_VERSION
+		|| hdr->image_size != (uint64_t)st.st_size
+		|| hdr->source_dev != (uint64_t)source->st_dev
+		|| hdr->source_ino != (uint64_t)source->st_ino
+		|| hdr->source_size != (uint64_t)source->st_size
+		|| hdr->source_mtime_sec != (int64_t)source->st_mtim.tv_sec
+		|| hdr->source_mtime_nsec != (int64_t)source->st_mtim.tv_nsec
+		|| hdr->files_off + ((uint64_t)hdr->num_files * sizeof(struct cor_meta_file)) > hdr->hashes_off
+		|| hdr->hashes_off + ((uint64_t)hdr->num_pieces * 20) > hdr->strings_off
+		|| hdr->strings_off >= hdr->image_size)
+	{
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	meta = calloc(1, sizeof(struct cor_meta));
+	if(meta == NULL)
+	{
+		munmap(image, st.st_size);
+		return NULL;
+	}
+	meta->image = image;
+	meta->mapped = 1;
+	cor_meta_bind(meta);
+
+	// The name and every path must be terminated inside the string
+	// table.
+	if(hdr->name_off >= hdr->image_size - hdr->strings_off
+		|| memchr(&meta->strings[hdr->name_off], '\0', hdr->image_size - hdr->strings_off - hdr->name_off) == NULL)
+	{
+		cor_meta_free(meta);
+		return NULL;
+	}
+	for(i = 0; i < hdr->num_files; i++)
+	{
+		if(hdr->strings_off + meta->files[i].path_off + meta->files[i].path_len >= hdr->image_size
+			|| meta->strings[meta->files[i].path_off + meta->files[i].path_len] != '\0')
+		{
+			cor_meta_free(meta);
+			return NULL;
+		}
+	}
+	return meta;
+}
+
+// Creates |dir| and any missing parents.
+static int cor_mkdirs(const char* dir)
+{
+	char tmp[PATH_MAX];
+	char* p;
+
+	snprintf(tmp, sizeof(tmp), "%s", dir);
+	for(p = tmp + 1; *p; p++)
+	{
+		if(*p == '/')
+		{
+			*p = '\0';
+			if(mkdir(tmp, 0700) < 0 && errno != EEXIST)
+				return -1;
+			*p = '/';
+		}
+	}
+	if(mkdir(tmp, 0700) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+// Writes |meta| to |cache_dir| under |key|. The image is written to a
+// temporary file and renamed into place so a concurrent or interrupted
+// mount never maps a partial entry.
+//
+// RETURNS
+// Zero on success, -1 on failure.
+int cor_meta_save(struct cor_meta* meta, const char* cache_dir, const unsigned char key[20])
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	const unsigned char* p = meta->image;
+	size_t left = meta->hdr->image_size;
+	ssize_t n;
+	int fd;
+
+	if(cor_mkdirs(cache_dir) < 0)
+		return -1;
+
+	cor_meta_path(path, cache_dir, key);
+	if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return -1;
+
+	// Unique per writer: an import may compile the same torrent twice at
+	// once when a directory holds duplicates.
+	fd = mkstemp(tmp);
+	if(fd < 0)
+		return -1;
+
+	while(left > 0)
+	{
+		n = write(fd, p, left);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		p += n;
+		left -= n;
+	}
+
+	if(close(fd) < 0 || rename(tmp, path) < 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+// Releases |meta| and its image.
+void cor_meta_free(struct cor_meta* meta)
+{
+	if(meta == NULL)
+		return;
+
+	if(meta->mapped)
+		munmap(meta->image, meta->hdr->image_size);
+	else
+		free(meta->image);
+	free(meta);
+}
+
+// Resolves the compiled metadata for the .torrent at |torrent|, using
+// |ctx| as decode scratch.
+//
+// Cache entries are keyed on the SHA-1 of the torrent's real path and
+// only used while the file still has the device, inode, size and mtime
+// the image was compiled from. A hit is a stat() and a mmap(), whatever
+// the size of the torrent; the file is only read, decoded and its
+// infohash taken on a miss, after which the image is written back to
+// |cache_dir|.
+//
+// RETURNS
+// The metadata, or NULL if the torrent can't be read or isn't valid.
+struct cor_meta* cor_meta_open(bd_ctx* ctx, const char* torrent, const char* cache_dir)
+{
+	char real[PATH_MAX];
+	bd_source* src;
+	bd_dict* root;
+	struct cor_meta* meta = NULL;
+	struct stat st;
+	unsigned char key[20];
+	unsigned char infohash[20];
+
+	// Stamped before the file is read: if it is replaced in between, the
+	// stamp is the older one and the next mount simply recompiles.
+	if(stat(torrent, &st) < 0 || realpath(torrent, real) == NULL)
+		return NULL;
+	sha1(real, strlen(real), key);
+
+	if(cache_dir != NULL)
+	{
+		meta = cor_meta_load(cache_dir, key, &st);
+		if(meta != NULL)
+			return meta;
+	}
+
+	src = bd_source_map(torrent);
+	if(src == NULL)
+		return NULL;
+
+	root = decode_ctx(ctx, src->buf, src->size);
+	if(root != NULL && bd_infohash(root, src->buf, src->size, infohash) == 0)
+		meta = cor_meta_compile(root, infohash);
+	if(meta != NULL)
+	{
+		cor_meta_stamp(meta->hdr, &st);
+		if(cache_dir != NULL && cor_meta_save(meta, cache_dir, key) < 0)
+			COR_LOG(LOG_WARNING, "Could not cache metadata for %s.", torrent);
+	}
+
+	bd_ctx_reset(ctx);
+	bd_source_unmap(src);
+	return meta;
+}
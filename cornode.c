@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "corsair.h"
+
+static int cor_node_cmp(const char* a, size_t alen, const char* b, size_t blen)
+{
+	int c = memcmp(a, b, (alen < blen) ? alen : blen);
+	if(c != 0)
+		return c;
+	return (alen < blen) ? -1 : (alen > blen);
+}
+static int cor_node_sort(const void* a, const void* b)
+{
+	const struct cor_node* x = *(struct cor_node* const*)a;
+	const struct cor_node* y = *(struct cor_node* const*)b;
+	return cor_node_cmp(x->name, x->namelen, y->name, y->namelen);
+}
+
+static uint64_t cor_node_hash(size_t parent, const char* name, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL ^ parent;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Open-addressed table of (parent, name) -> node, only used while the
+// tree is built; afterwards every directory is searched by bisection.
+struct cor_node_table
+{
+	size_t* slots;
+	size_t mask;
+};
+
+// Names of the control files, by enum cor_ctl.
+static char const* cor_ctl_names[COR_CTL_COUNT] =
+{
+	NULL,
+	COR_CTL_NAME,
+	"stats",
+	"session",
+	"torrents",
+};
+
+// Finds the child |name| of |parent|, or the empty slot it would go in.
+static size_t* cor_node_slot(struct cor_ns* ns, struct cor_node_table* tab, size_t parent, const char* name, size_t len)
+{
+	size_t i = cor_node_hash(parent, name, len) & tab->mask;
+	struct cor_node* n;
+
+	// Slots hold node index + 1, so zero is empty.
+	while(tab->slots[i] != 0)
+	{
+		n = &ns->nodes[tab->slots[i] - 1];
+		if((size_t)(n->parent - ns->nodes) == parent && n->namelen == len && memcmp(n->name, name, len) == 0)
+			break;
+		i = (i + 1) & tab->mask;
+	}
+	return &tab->slots[i];
+}
+
+// Appends the child |name| of |parent|, filing it under |slot|.
+static struct cor_node* cor_node_add(struct cor_ns* ns, size_t* slot, size_t parent, const char* name, size_t len)
+{
+	struct cor_node* n = &ns->nodes[ns->num_nodes];
+
+	n->name = name;
+	n->namelen = len;
+	n->parent = &ns->nodes[parent];
+	n->ino = ns->num_nodes + 1;
+	ns->nodes[parent].num_children++;
+	*slot = ++ns->num_nodes;
+	return n;
+}
+
+// Builds the directory tree of every file of |torrents|, along with the
+// control directory. Names point into the torrents' metadata, which must
+// outlive the tree.
+//
+// Where two torrents claim the same path, or a path runs through what
+// another torrent has as a file, the first claim wins and the other file
+// is left out. The control directory is claimed before any torrent.
+//
+// RETURNS
+// The tree, or NULL if memory ran out.
+struct cor_ns* cor_ns_build(struct cor_torrent* torrents, int num_torrents)
+{
+	struct cor_ns* ns;
+	struct cor_node_table tab;
+	struct cor_node* n;
+	struct cor_meta* m;
+	struct cor_node** links;
+	size_t max_nodes = COR_CTL_COUNT;
+	size_t parent;
+	size_t ctl;
+	size_t* slot;
+	const char* path;
+	const char* sep;
+	size_t len;
+	size_t i;
+	int t;
+	int c;
+	uint32_t f;
+
+	for(t = 0; t < num_torrents; t++)
+	{
+		m = torrents[t].meta;
+		for(f = 0; f < m->hdr->num_files; f++)
+		{
+			path = m->strings + m->files[f].path_off;
+			max_nodes++;
+			while((path = strchr(path, '/')) != NULL)
+			{
+				max_nodes++;
+				path++;
+			}
+		}
+	}
+
+	ns = calloc(1, sizeof(struct cor_ns));
+	if(ns == NULL)
+		return NULL;
+	ns->nodes = calloc(max_nodes, sizeof(struct cor_node));
+
+	tab.mask = 1;
+	while(tab.mask < max_nodes * 2)
+		tab.mask <<= 1;
+	tab.slots = calloc(tab.mask, sizeof(size_t));
+	tab.mask--;
+
+	if(ns->nodes == NULL || tab.slots == NULL)
+	{
+		free(tab.slots);
+		cor_ns_free(ns);
+		return NULL;
+	}
+
+	// The root.
+	ns->nodes[0].name = "";
+	ns->nodes[0].parent = &ns->nodes[0];
+	ns->nodes[0].ino = 1;
+	ns->num_nodes = 1;
+
+	len = strlen(COR_CTL_NAME);
+	n = cor_node_add(ns, cor_node_slot(ns, &tab, 0, COR_CTL_NAME, len), 0, COR_CTL_NAME, len);
+	n->ctl = COR_CTL_DIR;
+	ns->nodes[0].num_dirs++;
+	ctl = n - ns->nodes;
+	for(c = COR_CTL_DIR + 1; c < COR_CTL_COUNT; c++)
+	{
+		len = strlen(cor_ctl_names[c]);
+		n = cor_node_add(ns, cor_node_slot(ns, &tab, ctl, cor_ctl_names[c], len), ctl, cor_ctl_names[c], len);
+		n->ctl = c;
+	}
+
+	for(t = 0; t < num_torrents; t++)
+	{
+		m = torrents[t].meta;
+		for(f = 0; f < m->hdr->num_files; f++)
+		{
+			path = m->strings + m->files[f].path_off;
+			parent = 0;
+			for(;;)
+			{
+				sep = strchr(path, '/');
+				len = (sep != NULL) ? (size_t)(sep - path) : strlen(path);
+				slot = cor_node_slot(ns, &tab, parent, path, len);
+
+				if(*slot != 0)
+				{
+					n = &ns->nodes[*slot - 1];
+					if(sep == NULL || n->file != NULL || n->ctl != COR_CTL_NONE)
+					{
+						COR_LOG(LOG_WARNING, "Skipping %s of %s, path is already taken.", m->strings + m->files[f].path_off, torrents[t].path);
+						break;
+					}
+				}
+				else
+				{
+					n = cor_node_add(ns, slot, parent, path, len);
+					if(sep == NULL)
+					{
+						n->torrent = &torrents[t];
+						n->file = &m->files[f];
+					}
+					else
+						ns->nodes[parent].num_dirs++;
+				}
+
+				if(sep == NULL)
+					break;
+				parent = n - ns->nodes;
+				path = sep + 1;
+			}
+		}
+	}
+	free(tab.slots);
+
+	// Hand every directory its slice of one shared array of child links,
+	// then sort each slice by name.
+	links = calloc(ns->num_nodes, sizeof(struct cor_node*));
+	if(links == NULL)
+	{
+		cor_ns_free(ns);
+		return NULL;
+	}
+	ns->links = links;
+	for(i = 0; i < ns->num_nodes; i++)
+	{
+		ns->nodes[i].children = links;
+		links += ns->nodes[i].num_children;
+		ns->nodes[i].num_children = 0;
+	}
+	for(i = 1; i < ns->num_nodes; i++)
+	{
+		n = ns->nodes[i].parent;
+		n->children[n->num_children++] = &ns->nodes[i];
+	}
+	for(i = 0; i < ns->num_nodes; i++)
+	{
+		n = &ns->nodes[i];
+		if(n->num_children > 1)
+			qsort(n->children, n->num_children, sizeof(struct cor_node*), cor_node_sort);
+	}
+	return ns;
+}
+void cor_ns_free(struct cor_ns* ns)
+{
+	if(ns == NULL)
+		return;
+
+	free(ns->links);
+	free(ns->nodes);
+	free(ns);
+}
+
+// RETURNS
+// The child of |dir| called |name| (|len| bytes), or NULL.
+struct cor_node* cor_ns_child(struct cor_node* dir, const char* name, size_t len)
+{
+	int lo = 0;
+	int hi = (int)dir->num_children - 1;
+	int mid;
+	int c;
+
+	while(lo <= hi)
+	{
+		mid = lo + ((hi - lo) / 2);
+		c = cor_node_cmp(dir->children[mid]->name, dir->children[mid]->namelen, name, len);
+		if(c == 0)
+			return dir->children[mid];
+		else if(c < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+// Resolves the mount-relative |path|.
+//
+// RETURNS
+// Its node, or NULL if no torrent has anything at |path| (or there is
+// no tree).
+struct cor_node* cor_ns_lookup(struct cor_ns* ns, const char* path)
+{
+	struct cor_node* n;
+	const char* sep;
+	size_t len;
+
+	if(ns == NULL)
+		return NULL;
+
+	n = &ns->nodes[0];
+
+	while(n != NULL)
+	{
+		while(*path == '/')
+			path++;
+		if(*path == '\0')
+			return n;
+
+		sep = strchr(path, '/');
+		len = (sep != NULL) ? (size_t)(sep - path) : strlen(path);
+		n = COR_NODE_DIR(n) ? cor_ns_child(n, path, len) : NULL;
+		path += len;
+	}
+	return NULL;
+}
+
+// RETURNS
+// The node with inode number |ino|, or NULL if there is none.
+struct cor_node* cor_ns_node(struct cor_ns* ns, uint64_t ino)
+{
+	if(ns == NULL || ino == 0 || ino > ns->num_nodes)
+		return NULL;
+	return &ns->nodes[ino - 1];
+}
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "corsair.h"
+
+// The attributes, after COR_XATTR_PREFIX.
+static char const* cor_progress_names[] =
+{
+	"percent",
+	"verified_bytes",
+	"missing_pieces",
+	"map",
+};
+#define COR_PROGRESS_NAMES (sizeof(cor_progress_names) / sizeof(cor_progress_names[0]))
+
+// Pieces [*first, *last] of |t| overlap |f|; none if |f| is empty.
+static void cor_progress_span(struct cor_torrent* t, struct cor_meta_file* f, uint32_t* first, uint32_t* last)
+{
+	uint32_t plen = t->meta->hdr->piece_length;
+
+	*first = f->offset / plen;
+	*last = (f->length > 0) ? (f->offset + f->length - 1) / plen : *first - 1;
+}
+
+// RETURNS
+// How many bytes of |piece| of |t| lie in |f|.
+static uint64_t cor_progress_overlap(struct cor_torrent* t, struct cor_meta_file* f, uint32_t piece)
+{
+	uint64_t start = (uint64_t)piece * t->meta->hdr->piece_length;
+	uint64_t end = start + t->meta->hdr->piece_length;
+
+	start = (start > f->offset) ? start : f->offset;
+	end = (end < f->offset + f->length) ? end : f->offset + f->length;
+	return (end > start) ? end - start : 0;
+}
+
+// Counts what the bitmap of |t| already has, file by file. From here on
+// cor_progress_piece() must hear of every piece newly set in it.
+//
+// RETURNS
+// The progress of each file of |t|, or NULL if memory ran out.
+struct cor_file_progress* cor_progress_create(struct cor_torrent* t)
+{
+	struct cor_file_progress* progress;
+	struct cor_file_progress* p;
+	struct cor_meta_file* f;
+	uint32_t first;
+	uint32_t last;
+	uint32_t i;
+
+	progress = calloc(t->meta->hdr->num_files ? t->meta->hdr->num_files : 1, sizeof(struct cor_file_progress));
+	if(progress == NULL)
+		return NULL;
+
+	for(i = 0; i < t->meta->hdr->num_files; i++)
+	{
+		p = &progress[i];
+		f = &t->meta->files[i];
+		pthread_mutex_init(&p->lock, NULL);
+		p->map_have = UINT32_MAX;
+
+		if(f->length == 0)
+			continue;
+
+		// Only the pieces at either end can be partly someone else's.
+		cor_progress_span(t, f, &first, &last);
+		p->have = cor_bits_count(t->have, first, last);
+		if(first == last)
+		{
+			p->done = p->have ? f->length : 0;
+			continue;
+		}
+		if(cor_bits_test(t->have, first))
+			p->done += cor_progress_overlap(t, f, first);
+		if(cor_bits_test(t->have, last))
+			p->done += cor_progress_overlap(t, f, last);
+		p->done += (uint64_t)cor_bits_count(t->have, first + 1, last - 1) * t->meta->hdr->piece_length;
+	}
+	return progress;
+}
+void cor_progress_free(struct cor_torrent* t)
+{
+	uint32_t i;
+
+	if(t->progress == NULL)
+		return;
+
+	for(i = 0; i < t->meta->hdr->num_files; i++)
+	{
+		pthread_mutex_destroy(&t->progress[i].lock);
+		free(t->progress[i].map);
+	}
+	free(t->progress);
+	t->progress = NULL;
+}
+
+// Credits the files |piece| of |t| overlaps with it.
+//
+// PRECONDITION
+// The piece was just set in the bitmap, by the caller.
+void cor_progress_piece(struct cor_torrent* t, uint32_t piece)
+{
+	struct cor_meta* m = t->meta;
+	struct cor_meta_file* f;
+	uint64_t start = (uint64_t)piece * m->hdr->piece_length;
+	uint64_t end = start + m->hdr->piece_length;
+	uint64_t bytes;
+	int lo = 0;
+	int hi = m->hdr->num_files - 1;
+	int mid;
+
+	if(t->progress == NULL || m->hdr->num_files == 0)
+		return;
+
+	// Last file starting at or before the piece.
+	while(lo < hi)
+	{
+		mid = lo + ((hi - lo + 1) / 2);
+		if(m->files[mid].offset <= start)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	for(f = &m->files[lo]; f < &m->files[m->hdr->num_files] && f->offset < end; f++)
+	{
+		bytes = cor_progress_overlap(t, f, piece);
+		if(bytes == 0)
+			continue;
+		__atomic_fetch_add(&t->progress[f - m->files].have, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&t->progress[f - m->files].done, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+// Renders the byte ranges of |f| that are verified into |p|'s map, as
+// comma-separated "<offset>+<length>" runs, unless it is up to date.
+//
+// PRECONDITION
+// |p->lock| is held.
+static int cor_progress_map(struct cor_torrent* t, struct cor_meta_file* f, struct cor_file_progress* p)
+{
+	uint32_t plen = t->meta->hdr->piece_length;
+	uint32_t have = __atomic_load_n(&p->have, __ATOMIC_RELAXED);
+	uint32_t first;
+	uint32_t last;
+	uint32_t run;
+	uint32_t end;
+	uint64_t from;
+	uint64_t to;
+	char* map = NULL;
+	size_t len;
+	FILE* out;
+	int sep = 0;
+
+	// |have| is read before the bitmap, and every piece is set in the
+	// bitmap before it is counted, so a map is never kept past a piece
+	// it is missing.
+	if(p->map != NULL && p->map_have == have)
+		return 0;
+
+	out = open_memstream(&map, &len);
+	if(out == NULL)
+		return -ENOMEM;
+
+	cor_progress_span(t, f, &first, &last);
+	for(run = cor_bits_find(t->have, first, last, 1); f->length > 0 && run <= last; run = cor_bits_find(t->have, end, last, 1))
+	{
+		end = cor_bits_find(t->have, run, last, 0);
+		from = (uint64_t)run * plen;
+		to = (uint64_t)end * plen;
+		from = ((from > f->offset) ? from : f->offset) - f->offset;
+		to = ((to < f->offset + f->length) ? to : f->offset + f->length) - f->offset;
+		fprintf(out, "%s%llu+%llu", sep ? "," : "", (unsigned long long)from, (unsigned long long)(to - from));
+		sep = 1;
+	}
+
+	if(fclose(out) != 0)
+	{
+		free(map);
+		return -ENOMEM;
+	}
+	free(p->map);
+	p->map = map;
+	p->map_len = len;
+	p->map_have = have;
+	return 0;
+}
+
+// Gets the attribute |name| of the file |f| of |t| into |value|, as
+// getxattr(2) does: with |size| zero, only its length is returned.
+//
+// RETURNS
+// The length of the value, -ENODATA if there is no attribute |name| and
+// -ERANGE if it doesn't fit in |size| bytes. Files of torrents the
+// session refused have none.
+int cor_progress_getxattr(struct cor_torrent* t, struct cor_meta_file* f, const char* name, char* value, size_t size)
+{
+	struct cor_file_progress* p;
+	char buf[32];
+	uint32_t first;
+	uint32_t last;
+	uint64_t done;
+	int len;
+	int stat;
+
+	if(t->progress == NULL || strncmp(name, COR_XATTR_PREFIX, sizeof(COR_XATTR_PREFIX) - 1) != 0)
+		return -ENODATA;
+	name += sizeof(COR_XATTR_PREFIX) - 1;
+	p = &t->progress[f - t->meta->files];
+
+	if(strcmp(name, "map") == 0)
+	{
+		pthread_mutex_lock(&p->lock);
+		stat = cor_progress_map(t, f, p);
+		if(stat == 0)
+		{
+			stat = p->map_len;
+			if(size > 0 && size < p->map_len)
+				stat = -ERANGE;
+			else if(size > 0)
+				memcpy(value, p->map, p->map_len);
+		}
+		pthread_mutex_unlock(&p->lock);
+		return stat;
+	}
+
+	done = __atomic_load_n(&p->done, __ATOMIC_RELAXED);
+	if(strcmp(name, "percent") == 0)
+		len = snprintf(buf, sizeof(buf), "%.2f", (f->length > 0) ? (done * 100.0) / f->length : 100.0);
+	else if(strcmp(name, "verified_bytes") == 0)
+		len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)done);
+	else if(strcmp(name, "missing_pieces") == 0)
+	{
+		cor_progress_span(t, f, &first, &last);
+		len = snprintf(buf, sizeof(buf), "%u", (last + 1 - first) - __atomic_load_n(&p->have, __ATOMIC_RELAXED));
+	}
+	else
+		return -ENODATA;
+
+	if(size == 0)
+		return len;
+	if(size < (size_t)len)
+		return -ERANGE;
+	memcpy(value, buf, len);
+	return len;
+}
+
+// Lists the names of the attributes every torrent file has into |list|,
+// as listxattr(2) does.
+//
+// RETURNS
+// The length of the list, or -ERANGE if it doesn't fit in |size| bytes.
+int cor_progress_listxattr(char* list, size_t size)
+{
+	size_t len = 0;
+	size_t n;
+	size_t i;
+
+	for(i = 0; i < COR_PROGRESS_NAMES; i++)
+		len += sizeof(COR_XATTR_PREFIX) - 1 + strlen(cor_progress_names[i]) + 1;
+	if(size == 0)
+		return len;
+	if(size < len)
+		return -ERANGE;
+
+	for(i = 0; i < COR_PROGRESS_NAMES; i++)
+	{
+		n = sizeof(COR_XATTR_PREFIX) - 1;
+		memcpy(list, COR_XATTR_PREFIX, n);
+		list += n;
+		n = strlen(cor_progress_names[i]) + 1;
+		memcpy(list, cor_progress_names[i], n);
+		list += n;
+	}
+	return len;
+}
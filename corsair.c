@@ -1,6 +1,7 @@
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 29
 
 #include <fuse/fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
@@ -9,27 +10,139 @@
 #include <dirent.h>
 #include <libtorrent.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
 
 #include "bdecode.h"
-
-#define COR_DATA ((struct cor_state*) fuse_get_context()->private_data)
+#include "corsair.h"
+
+// The mounted state. Low-level requests carry no context to find it in,
+// so both APIs reach it through here.
+static struct cor_state* cor_self;
+#define COR_DATA (cor_self)
+
+// How long a read waits for missing pieces before failing with EIO, in
+// seconds.
+#define COR_READ_TIMEOUT 120
+
+// Deadline given to the first piece a read is waiting on, and how much
+// later each following one is due, in milliseconds.
+#define COR_READ_DEADLINE 500
+#define COR_READ_DEADLINE_STEP 100
+
+// Reads waiting on a piece are woken by the alert pump the moment it is
+// verified. Only if the pump couldn't be started do they wake every
+// COR_READ_POLL seconds to ask the session themselves.
+#define COR_READ_POLL 1
+
+// Longest the alert pump sleeps in the session at once, in milliseconds.
+// Alerts and cor_destroy()'s cor_tor_wake() end the wait early. This
+// only bounds how long unmount takes if that wakeup is lost, as it is
+// when the session's alert queue is already full.
+#define COR_ALERT_WAIT 1000
+
+// Wait queues reads waiting on pieces are spread over, by piece.
+#define COR_WAIT_QUEUES 64
+
+// Readahead. A handle counts as sequential after COR_RA_STREAK reads in
+// a row that each continue the last one. Its window then covers about
+// COR_RA_SECONDS of reading at the measured rate, between COR_RA_MIN
+// and COR_RA_MAX pieces and never more than COR_RA_MAX_BYTES.
+#define COR_RA_STREAK 2
+#define COR_RA_SECONDS 10
+#define COR_RA_MIN 2
+#define COR_RA_MAX 64
+#define COR_RA_MAX_BYTES (64 * 1024 * 1024)
+
+// Pieces at the start and end of a file that are requested as soon as
+// it is opened, unless overridden by $CORSAIR_PREFETCH_HEAD and
+// $CORSAIR_PREFETCH_TAIL. Their deadlines are COR_PREFETCH_DEADLINE
+// apart, head first.
+#define COR_PREFETCH_HEAD 2
+#define COR_PREFETCH_TAIL 2
+#define COR_PREFETCH_DEADLINE 250
+
+// Default size of the piece cache in megabytes; $CORSAIR_PIECE_CACHE_MB
+// overrides it and zero turns the cache off.
+#define COR_PIECE_CACHE_MB 256
+
+// How long the kernel may cache entries and attributes handed out by the
+// low-level API, in seconds. The tree doesn't change while mounted.
+#define COR_LL_ENTRY_TIMEOUT 3600.0
+#define COR_LL_ATTR_TIMEOUT 3600.0
+
+// The mount uses the path API unless $CORSAIR_LOWLEVEL is set to 1,
+// which serves the torrents through the low-level inode API instead.
+// That one only serves torrent files, read-only: writes, mkdir, create
+// and the rest of what the path API passes through to the save
+// directory are missing from it.
+#define COR_LOWLEVEL 0
+
+// How often the session and torrent status served from the control
+// directory is sampled, in milliseconds, unless overridden by
+// $CORSAIR_STATUS_MS.
+#define COR_STATUS_INTERVAL 1000
+
+// Threads serving requests, unless overridden by $CORSAIR_THREADS. A read
+// waiting on a piece ties up its thread, so this bounds how many readers
+// can wait at once without holding up everyone else.
+#define COR_WORKERS 16
 
 struct cor_state
 {
 	char* root;
 	char* torrent;
+	char* cache;
 	void* session;
-};
 
-static char const* priority[] =
-{
-		"EMERG:",
-		"ALERT:",
-		"CRIT:",
-		"ERR:",
-		"WARNING:",
-		"NOTICE:",
-		"INFO:",
+	// Torrents served by the mount, sorted by infohash. Their compiled
+	// metadata is either mapped from the cache directory or compiled from
+	// the .torrent on first mount.
+	struct cor_torrent* torrents;
+	int num_torrents;
+
+	// Directory tree of every torrent's files, built once at init. Paths
+	// it has are answered from memory; anything else falls through to the
+	// save directory. Its entries carry the mount time as their times.
+	struct cor_ns* ns;
+	time_t mounted;
+
+	// Reads waiting for a piece sleep on the queue it hashes to, and are
+	// woken when the alert pump sees it verified. |waiting| counts them,
+	// under |lock|. |stopping| is set on unmount to send them all home,
+	// and stops the pump.
+	struct cor_waitq
+	{
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		int waiting;
+	} waitq[COR_WAIT_QUEUES];
+	pthread_t pump;
+	int pumping;
+	int stopping;
+
+	// Threads serving requests; one if mounted with -s.
+	int workers;
+
+	// Sampled session and torrent status, or NULL if there is none, and
+	// how often it is sampled.
+	struct cor_status* status;
+	int status_interval;
+
+	// Verified pieces recently read, or NULL if caching is off.
+	struct cor_cache* pieces;
+
+	// Pieces prefetched at each end of a file when it is opened.
+	int prefetch_head;
+	int prefetch_tail;
+
+	// Time-to-first-byte of opened torrent files: how many were measured,
+	// their sum and the worst, in milliseconds. Only ever added to.
+	uint64_t ttfb_count;
+	uint64_t ttfb_total;
+	uint64_t ttfb_max;
 };
 
 // Helper Functions
@@ -38,23 +151,1016 @@ void cor_usage()
 	printf("Do things to the thing and you get the thing.");
 }
 
+// Directory compiled torrent metadata is cached in: $CORSAIR_CACHE, or
+// ~/.cache/corsair. NULL disables the cache.
+static char* cor_cache_dir()
+{
+	char dir[PATH_MAX];
+	char* env;
+
+	env = getenv("CORSAIR_CACHE");
+	if(env != NULL)
+		return (*env != '\0') ? strdup(env) : NULL;
+
+	env = getenv("HOME");
+	if(env == NULL)
+		return NULL;
+
+	snprintf(dir, sizeof(dir), "%s/.cache/corsair", env);
+	return strdup(dir);
+}
+
 static void cor_expand_path(char epath[PATH_MAX], const char* path)
 {
-	strcpy(epath, COR_DATA);
+	strcpy(epath, COR_DATA->root);
 	strncat(epath, path, PATH_MAX);
 }
 
 
 
+// Records |piece| of |t| as verified, crediting its files the first
+// time around.
+static void cor_piece_verified(struct cor_torrent* t, int piece)
+{
+	if(t->have != NULL && cor_bits_set(t->have, piece))
+		cor_progress_piece(t, piece);
+}
+
+// RETURNS
+// 1 if |t| has every piece in [first, last], 0 if it doesn't and -1 if
+// the torrent has gone away.
+static int cor_have_pieces(struct cor_torrent* t, int first, int last)
+{
+	int i;
+	int have;
+
+	// Pieces stay verified once they are, so only those not yet known
+	// to be are asked about.
+	if(t->have != NULL && cor_bits_all(t->have, first, last))
+		return 1;
+
+	for(i = first; i <= last; i++)
+	{
+		if(t->have != NULL && cor_bits_test(t->have, i))
+			continue;
+
+		have = cor_tor_have_piece(t->handle, i);
+		if(have <= 0)
+			return have;
+		cor_piece_verified(t, i);
+	}
+	return 1;
+}
+
+static double cor_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// Reads a non-negative count from the environment variable |name|.
+static int cor_env_count(const char* name, int def)
+{
+	char* env = getenv(name);
+	char* end;
+	long n;
+
+	if(env == NULL || *env == '\0')
+		return def;
+
+	n = strtol(env, &end, 10);
+	if(*end != '\0' || n < 0 || n > INT_MAX)
+	{
+		COR_LOG(LOG_WARNING, "Ignoring bad %s, using %d.", name, def);
+		return def;
+	}
+	return n;
+}
+
+// Fills |st| in for |n|. Torrent data is read-only through the mount,
+// and files have their full size whether or not any of it has arrived.
+// Control files have no size until they are opened and rendered, like
+// those of /proc.
+static void cor_node_stat(struct cor_node* n, struct stat* st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = n->ino;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = COR_DATA->mounted;
+	st->st_mtime = COR_DATA->mounted;
+	st->st_ctime = COR_DATA->mounted;
+
+	if(n->file != NULL)
+	{
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+		st->st_size = n->file->length;
+		st->st_blocks = (n->file->length + 511) / 512;
+	}
+	else if(!COR_NODE_DIR(n))
+	{
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+	}
+	else
+	{
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2 + n->num_dirs;
+	}
+	st->st_blksize = 4096;
+}
+
+// RETURNS
+// The queue reads waiting on |piece| of |t| sleep on.
+static struct cor_waitq* cor_waitq(struct cor_torrent* t, int piece)
+{
+	uint64_t h = ((uint64_t)(t - COR_DATA->torrents) << 32) | (uint32_t)piece;
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return &COR_DATA->waitq[(h >> 32) % COR_WAIT_QUEUES];
+}
+static void cor_waitq_wake(struct cor_waitq* q)
+{
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+// Wakes every waiting read, to look at its pieces again.
+static void cor_wake_all()
+{
+	int i;
+
+	for(i = 0; i < COR_WAIT_QUEUES; i++)
+		cor_waitq_wake(&COR_DATA->waitq[i]);
+}
+static void cor_wait_interrupt(fuse_req_t req, void* q)
+{
+	cor_waitq_wake(q);
+}
+
+// RETURNS
+// How many reads sleep on |q|.
+static int cor_waitq_waiting(struct cor_waitq* q)
+{
+	int waiting;
+
+	pthread_mutex_lock(&q->lock);
+	waiting = q->waiting;
+	pthread_mutex_unlock(&q->lock);
+	return waiting;
+}
+
+// Requests the pieces [first, last] of |t| as cor_tor_want_pieces()
+// does, counting them as wanted once more. Each call is paired with a
+// cor_release_pieces() of the same pieces.
+//
+// RETURNS
+// Zero on success, -1 if the torrent is gone.
+static int cor_want_pieces(struct cor_torrent* t, int first, int last, int deadline, int step)
+{
+	int stat;
+	int i;
+
+	if(t->wanted == NULL)
+		return cor_tor_want_pieces(t->handle, first, last, deadline, step);
+
+	pthread_mutex_lock(&t->want_lock);
+	for(i = first; i <= last; i++)
+		t->wanted[i]++;
+	stat = cor_tor_want_pieces(t->handle, first, last, deadline, step);
+	pthread_mutex_unlock(&t->want_lock);
+	return stat;
+}
+
+// Undoes the count of one cor_want_pieces() of [first, last]. With
+// |drop| set, pieces nothing counts any more and no read waits on are
+// handed back to the normal download order; the rest keep their
+// priority and deadlines for whoever still wants them.
+static void cor_release_pieces(struct cor_torrent* t, int first, int last, int drop)
+{
+	int run = -1;
+	int i;
+
+	if(t->wanted == NULL || first > last)
+		return;
+
+	pthread_mutex_lock(&t->want_lock);
+	for(i = first; i <= last; i++)
+	{
+		if(t->wanted[i] > 0)
+			t->wanted[i]--;
+		if(drop && t->wanted[i] == 0 && cor_waitq_waiting(cor_waitq(t, i)) == 0)
+		{
+			run = (run < 0) ? i : run;
+			continue;
+		}
+		if(run >= 0)
+			cor_tor_unwant_pieces(t->handle, run, i - 1);
+		run = -1;
+	}
+	if(run >= 0)
+		cor_tor_unwant_pieces(t->handle, run, last);
+	pthread_mutex_unlock(&t->want_lock);
+}
+
+// Creates the handle for |fd|, opened on the node |n| or, if NULL, on
+// something only the save directory has.
+static struct cor_handle* cor_handle_create(struct cor_node* n, int fd)
+{
+	struct cor_handle* h;
+	uint32_t plen;
+
+	h = calloc(1, sizeof(struct cor_handle));
+	if(h == NULL)
+		return NULL;
+
+	h->fd = fd;
+	h->ready = COR_READY_NONE;
+	h->opened = cor_now();
+	pthread_mutex_init(&h->lock, NULL);
+	h->node = n;
+
+	if(n != NULL && n->file != NULL)
+	{
+		plen = n->torrent->meta->hdr->piece_length;
+		h->torrent = n->torrent;
+		h->file = n->file;
+		h->base = n->file->offset;
+		h->first_piece = n->file->offset / plen;
+		h->last_piece = (n->file->length > 0) ? (n->file->offset + n->file->length - 1) / plen : h->first_piece;
+	}
+	h->claim_first = 1;
+	h->claim_last = 0;
+	h->prefetch_head = h->first_piece - 1;
+	h->prefetch_tail = h->last_piece + 1;
+	return h;
+}
+static void cor_handle_destroy(struct cor_handle* h)
+{
+	if(h->torrent != NULL)
+	{
+		cor_release_pieces(h->torrent, h->claim_first, h->claim_last, 0);
+		cor_release_pieces(h->torrent, h->first_piece, h->prefetch_head, 0);
+		cor_release_pieces(h->torrent, h->prefetch_tail, h->last_piece, 0);
+	}
+	pthread_mutex_destroy(&h->lock);
+	free(h->text);
+	free(h);
+}
+
+// Opens the control file |n|, rendering its contents now.
+//
+// RETURNS
+// The handle, or NULL if memory ran out.
+static struct cor_handle* cor_ctl_open(struct cor_node* n)
+{
+	struct cor_handle* h;
+
+	h = cor_handle_create(n, -1);
+	if(h == NULL)
+		return NULL;
+
+	switch(n->ctl)
+	{
+		case COR_CTL_STATS:
+			h->text = cor_stat_render(&h->text_len);
+			break;
+		// Empty if the status isn't being sampled.
+		case COR_CTL_SESSION:
+			h->text = (COR_DATA->status != NULL) ? cor_status_session(COR_DATA->status, &h->text_len) : calloc(1, 1);
+			break;
+		case COR_CTL_TORRENTS:
+			h->text = (COR_DATA->status != NULL) ? cor_status_torrents(COR_DATA->status, &h->text_len) : calloc(1, 1);
+			break;
+	}
+	if(h->text == NULL)
+	{
+		cor_handle_destroy(h);
+		return NULL;
+	}
+	return h;
+}
+
+// RETURNS
+// The backing file of |h|, opening it now if the torrent hadn't created
+// it yet at open time, or -errno.
+static int cor_handle_fd(struct cor_handle* h)
+{
+	char fpath[PATH_MAX];
+	int fd = __atomic_load_n(&h->fd, __ATOMIC_ACQUIRE);
+	int none = -1;
+
+	if(fd >= 0 || h->file == NULL)
+		return fd;
+
+	snprintf(fpath, sizeof(fpath), "%s/%s", COR_DATA->root, h->torrent->meta->strings + h->file->path_off);
+	fd = open(fpath, O_RDONLY);
+	if(fd < 0)
+		return -errno;
+
+	// Two reads may race to open it; the loser closes its copy.
+	if(!__atomic_compare_exchange_n(&h->fd, &none, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		close(fd);
+		fd = none;
+	}
+	return fd;
+}
+
+// Records [first, last] as verified on |h|, merged with the range
+// already known if the two touch.
+static void cor_handle_ready(struct cor_handle* h, int first, int last)
+{
+	uint64_t ready = __atomic_load_n(&h->ready, __ATOMIC_ACQUIRE);
+	int rfirst = ready >> 32;
+	int rlast = (uint32_t)ready;
+
+	if(rfirst <= rlast && first <= rlast + 1 && last + 1 >= rfirst)
+	{
+		first = (first < rfirst) ? first : rfirst;
+		last = (last > rlast) ? last : rlast;
+	}
+	__atomic_store_n(&h->ready, ((uint64_t)first << 32) | (uint32_t)last, __ATOMIC_RELEASE);
+}
+
+// Feeds a completed read of |n| bytes at |offset| into the access
+// pattern of |h| and keeps its readahead window requested.
+//
+// The window starts at COR_RA_MIN pieces once the handle turns
+// sequential and doubles each time the reader catches up with half of
+// it, up to what the consumption rate calls for. Any seek drops it and
+// hands the pieces it had requested back to the normal download order,
+// so that several streams out of one torrent each only hold the pieces
+// right ahead of them. Pieces another stream's window, a prefetch or a
+// waiting read still wants are left requested.
+static void cor_readahead(struct cor_handle* h, off_t offset, size_t n)
+{
+	struct cor_torrent* t = h->torrent;
+	uint32_t plen;
+	double now = cor_now();
+	double dt;
+	double rate;
+	int piece;
+	int target;
+	int first = 0;
+	int last = -1;
+	int release_first = 0;
+	int release_last = -1;
+	int drop = 0;
+	int step;
+
+	pthread_mutex_lock(&h->lock);
+	h->reads++;
+	h->bytes_read += n;
+
+	if(t != NULL)
+	{
+		plen = t->meta->hdr->piece_length;
+		piece = (h->base + offset) / plen;
+		if(offset != h->next_offset && (piece < h->claim_first || piece > h->claim_last))
+		{
+			// Seek out of the window. Whatever was read ahead is of no
+			// use any more.
+			release_first = h->claim_first;
+			release_last = h->claim_last;
+			drop = 1;
+			h->claim_first = 1;
+			h->claim_last = 0;
+			h->ahead = 0;
+		}
+		else if(h->claim_first <= h->claim_last && piece > h->claim_first)
+		{
+			// Pieces the reader has reached are its own to wait for now;
+			// the window stops counting them.
+			release_first = h->claim_first;
+			release_last = (piece - 1 < h->claim_last) ? piece - 1 : h->claim_last;
+			h->claim_first = release_last + 1;
+		}
+	}
+
+	if(offset != h->next_offset)
+	{
+		// Unless the reader only skipped forward into the window, which
+		// stays requested up to |ahead|, it starts over.
+		h->streak = 0;
+		h->window = 0;
+		h->rate = 0;
+	}
+	else
+	{
+		h->streak++;
+		dt = now - h->stamp;
+		if(h->streak > 1 && dt > 0)
+			h->rate = (h->rate > 0) ? (0.75 * h->rate) + (0.25 * (n / dt)) : (n / dt);
+	}
+	h->stamp = now;
+	h->next_offset = offset + n;
+
+	if(t != NULL && t->handle != NULL && h->streak >= COR_RA_STREAK)
+	{
+		plen = t->meta->hdr->piece_length;
+		piece = (h->base + offset + n) / plen;
+
+		target = (h->rate * COR_RA_SECONDS) / plen;
+		target = (target < COR_RA_MIN) ? COR_RA_MIN : target;
+		target = (target > COR_RA_MAX) ? COR_RA_MAX : target;
+		if((uint64_t)target * plen > COR_RA_MAX_BYTES)
+			target = (COR_RA_MAX_BYTES / plen > COR_RA_MIN) ? COR_RA_MAX_BYTES / plen : COR_RA_MIN;
+
+		if(h->window == 0)
+			h->window = COR_RA_MIN;
+		else if(h->ahead - piece < h->window / 2)
+			h->window *= 2;
+		h->window = (h->window > target) ? target : h->window;
+
+		first = (h->ahead >= piece) ? h->ahead + 1 : piece;
+		last = piece + h->window;
+		last = (last > h->last_piece) ? h->last_piece : last;
+		if(first <= last)
+		{
+			// A reader that got past the window leaves a gap the window
+			// never counted; what is left of it is given up first.
+			if(h->claim_first <= h->claim_last && first > h->claim_last + 1)
+			{
+				release_first = (release_first <= release_last) ? release_first : h->claim_first;
+				release_last = h->claim_last;
+				h->claim_first = 1;
+				h->claim_last = 0;
+			}
+			h->ahead = last;
+			if(h->claim_first > h->claim_last)
+				h->claim_first = first;
+			h->claim_last = last;
+		}
+	}
+	rate = h->rate;
+	pthread_mutex_unlock(&h->lock);
+
+	if(release_first <= release_last)
+		cor_release_pieces(t, release_first, release_last, drop);
+
+	if(first <= last)
+	{
+		// Space the deadlines by how long the reader takes to get through
+		// a piece, so the pieces come in the order they are needed.
+		step = (rate > 0) ? (int)((plen * 1000.0) / rate) : COR_READ_DEADLINE_STEP;
+		step = (step < COR_READ_DEADLINE_STEP) ? COR_READ_DEADLINE_STEP : step;
+		cor_want_pieces(t, first, last, COR_READ_DEADLINE + ((first - piece) * step), step);
+	}
+}
+
+// Requests the first and last pieces of the file behind |h| right away,
+// ahead of the swarm's rarest-first order. That is where players and
+// archivers look first: container headers, moov atoms, zip central
+// directories.
+static void cor_prefetch(struct cor_handle* h)
+{
+	struct cor_state* state = COR_DATA;
+	int head_last = h->first_piece - 1;
+	int tail_first;
+
+	if(h->file == NULL || h->torrent->handle == NULL || h->file->length == 0)
+		return;
+
+	if(state->prefetch_head > 0)
+	{
+		head_last = h->first_piece + state->prefetch_head - 1;
+		head_last = (head_last > h->last_piece) ? h->last_piece : head_last;
+		cor_want_pieces(h->torrent, h->first_piece, head_last, COR_READ_DEADLINE, COR_PREFETCH_DEADLINE);
+		h->prefetch_head = head_last;
+	}
+
+	if(state->prefetch_tail > 0)
+	{
+		tail_first = h->last_piece - state->prefetch_tail + 1;
+		tail_first = (tail_first <= head_last) ? head_last + 1 : tail_first;
+		if(tail_first <= h->last_piece)
+		{
+			cor_want_pieces(h->torrent, tail_first, h->last_piece,
+					COR_READ_DEADLINE + ((head_last - h->first_piece + 1) * COR_PREFETCH_DEADLINE), COR_PREFETCH_DEADLINE);
+			h->prefetch_tail = tail_first;
+		}
+	}
+}
+
+// Accounts |ms|, the time from open to the first completed read of the
+// torrent file |path|.
+static void cor_record_ttfb(const char* path, uint64_t ms)
+{
+	struct cor_state* state = COR_DATA;
+	uint64_t max;
+
+	__atomic_fetch_add(&state->ttfb_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&state->ttfb_total, ms, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&state->ttfb_max, __ATOMIC_RELAXED);
+	while(ms > max && !__atomic_compare_exchange_n(&state->ttfb_max, &max, ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	COR_LOG(LOG_INFO, "First byte of %s after %llu ms.", path, (unsigned long long)ms);
+}
+
+// Reads |piece| of |t| from the files it lies in under the save path.
+//
+// RETURNS
+// The piece's length, or -1 if any part of it couldn't be read.
+static long cor_piece_load(struct cor_torrent* t, int piece, char* buf)
+{
+	struct cor_meta* m = t->meta;
+	struct cor_meta_file* f;
+	char fpath[PATH_MAX];
+	uint64_t start = (uint64_t)piece * m->hdr->piece_length;
+	uint64_t end = start + m->hdr->piece_length;
+	uint64_t pos;
+	uint64_t fend;
+	size_t want;
+	ssize_t n;
+	int lo = 0;
+	int hi = m->hdr->num_files - 1;
+	int mid;
+	int fd;
+
+	end = (end > m->hdr->total_size) ? m->hdr->total_size : end;
+	if(start >= end)
+		return -1;
+
+	// Last file starting at or before the piece.
+	while(lo < hi)
+	{
+		mid = lo + ((hi - lo + 1) / 2);
+		if(m->files[mid].offset <= start)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	for(pos = start, f = &m->files[lo]; pos < end; f++)
+	{
+		fend = f->offset + f->length;
+		if(fend <= pos)
+			continue;
+
+		snprintf(fpath, sizeof(fpath), "%s/%s", COR_DATA->root, m->strings + f->path_off);
+		fd = open(fpath, O_RDONLY);
+		if(fd < 0)
+			return -1;
+
+		want = ((fend < end) ? fend : end) - pos;
+		while(want > 0)
+		{
+			n = pread(fd, &buf[pos - start], want, pos - f->offset);
+			if(n <= 0)
+			{
+				if(n < 0 && errno == EINTR)
+					continue;
+				close(fd);
+				return -1;
+			}
+			pos += n;
+			want -= n;
+		}
+		close(fd);
+	}
+	return end - start;
+}
+
+// Serves a read of the torrent file behind |h| through the piece cache.
+// Cached pieces are copied straight out; a missing piece is loaded
+// whole, cached and copied, unless it is too big to cache, in which case
+// only the part asked for is read.
+//
+// PRECONDITION
+// The pieces covering the read have been verified.
+//
+// RETURNS
+// The number of bytes read, or -errno.
+static int cor_read_cached(struct cor_handle* h, char* rbuf, size_t size, off_t offset)
+{
+	struct cor_state* state = COR_DATA;
+	struct cor_torrent* t = h->torrent;
+	uint32_t plen = t->meta->hdr->piece_length;
+	uint32_t idx = t - state->torrents;
+	uint64_t pos;
+	uint64_t end;
+	size_t done = 0;
+	size_t want;
+	uint32_t piece;
+	uint32_t poff;
+	uint64_t start;
+	long n;
+	char* buf;
+	int fd;
+
+	if(offset < 0 || (uint64_t)offset >= h->file->length)
+		return 0;
+	if((uint64_t)offset + size > h->file->length)
+		size = h->file->length - offset;
+
+	pos = h->base + offset;
+	end = pos + size;
+	while(pos < end)
+	{
+		piece = pos / plen;
+		poff = pos % plen;
+		want = ((end - pos) < (plen - poff)) ? (end - pos) : (plen - poff);
+
+		n = cor_cache_read(state->pieces, idx, piece, poff, rbuf + done, want);
+		if(n < 0 && cor_cache_fits(state->pieces, plen))
+		{
+			buf = malloc(plen);
+			start = cor_stat_clock();
+			n = (buf != NULL) ? cor_piece_load(t, piece, buf) : -1;
+			if(buf != NULL)
+				cor_stat_record(COR_OP_DISK, start, n < 0);
+			if(n > poff)
+			{
+				cor_cache_insert(state->pieces, idx, piece, buf, n);
+				n = ((size_t)(n - poff) < want) ? n - poff : (long)want;
+				memcpy(rbuf + done, &buf[poff], n);
+			}
+			else
+				n = -1;
+			free(buf);
+		}
+		if(n < 0)
+		{
+			fd = cor_handle_fd(h);
+			if(fd < 0)
+				return fd;
+			start = cor_stat_clock();
+			n = pread(fd, rbuf + done, want, offset + done);
+			cor_stat_record(COR_OP_DISK, start, n < 0);
+			if(n < 0)
+				return -errno;
+		}
+		if(n == 0)
+			break;
+
+		pos += n;
+		done += n;
+	}
+	return done;
+}
+
+// RETURNS
+// The mounted torrent with |infohash|, or NULL.
+static struct cor_torrent* cor_torrent_by_hash(const unsigned char infohash[20])
+{
+	struct cor_state* state = COR_DATA;
+	int lo = 0;
+	int hi = state->num_torrents - 1;
+	int mid;
+	int c;
+
+	while(lo <= hi)
+	{
+		mid = lo + ((hi - lo) / 2);
+		c = memcmp(state->torrents[mid].meta->hdr->infohash, infohash, 20);
+		if(c == 0)
+			return &state->torrents[mid];
+		else if(c < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+static void cor_on_alert(void* arg, int type, const unsigned char infohash[20], int piece, const char* message)
+{
+	struct cor_torrent* t = cor_torrent_by_hash(infohash);
+	struct cor_waitq* q;
+	int waiting;
+
+	if(t == NULL)
+		return;
+
+	if(type == COR_ALERT_PIECE)
+	{
+		if(t->have == NULL || piece < 0 || (uint32_t)piece >= t->meta->hdr->num_pieces)
+			return;
+
+		// The bit goes in before the wakeup, so a reader either sees it
+		// before going to sleep or is asleep by the time it is woken.
+		// The piece isn't loaded into the cache here; a woken reader
+		// does that itself (see the PIECE CACHE notes in corsair.h).
+		cor_piece_verified(t, piece);
+		cor_waitq_wake(cor_waitq(t, piece));
+	}
+	else if(type == COR_ALERT_HASH_FAILED)
+	{
+		if(t->handle == NULL || piece < 0 || (uint32_t)piece >= t->meta->hdr->num_pieces)
+			return;
+
+		// The piece goes back to be downloaded again. If a read may be
+		// waiting on it, or a window wants it, it must not lose its place
+		// at the front of the queue while that happens.
+		q = cor_waitq(t, piece);
+		waiting = cor_waitq_waiting(q);
+		if(t->wanted != NULL)
+		{
+			pthread_mutex_lock(&t->want_lock);
+			waiting += t->wanted[piece];
+			pthread_mutex_unlock(&t->want_lock);
+		}
+		if(waiting > 0)
+		{
+			COR_LOG(LOG_INFO, "%s: piece %d failed its hash check, requesting it again.", t->path, piece);
+			cor_tor_want_pieces(t->handle, piece, piece, COR_READ_DEADLINE, COR_READ_DEADLINE_STEP);
+			cor_waitq_wake(q);
+		}
+	}
+	else
+	{
+		COR_LOG(LOG_ERR, "%s: %s", t->path, message);
+		cor_wake_all();
+	}
+}
+
+// Drains the session's alerts for as long as the mount is up, turning
+// verified pieces into wakeups for the reads waiting on them. Sleeps in
+// the session until there is something to do, checking |stopping| at
+// least every COR_ALERT_WAIT milliseconds.
+static void* cor_alert_pump(void* arg)
+{
+	struct cor_state* state = arg;
+
+	while(!__atomic_load_n(&state->stopping, __ATOMIC_ACQUIRE))
+		cor_tor_pump_alerts(state->session, COR_ALERT_WAIT, cor_on_alert, state);
+
+	return NULL;
+}
+
+// Blocks until the pieces backing |size| bytes at |offset| in the file
+// of |h| have been downloaded and verified, moving them to the front of
+// the queue first. |req| is the low-level request being served, or NULL
+// under the path API.
+//
+// Only the alert pump, an interrupt of |req|, unmount or the timeout
+// wake it (see COR_READ_POLL for a mount without a pump). The path API
+// has no way to be told of an interrupt, so those are only noticed on
+// waking for one of the others.
+//
+// RETURNS
+// Zero once the data is there, -EINTR if the read was interrupted and
+// -EIO if the torrent is gone or the data didn't arrive in time.
+static int cor_wait_range(struct cor_handle* h, fuse_req_t req, size_t size, off_t offset)
+{
+	struct cor_state* state = COR_DATA;
+	struct cor_torrent* t = h->torrent;
+	uint64_t start;
+	uint64_t end;
+	uint64_t ready;
+	uint64_t waited;
+	int first;
+	int last;
+	int piece;
+	int have;
+	int stat = 0;
+	int rc;
+	struct cor_waitq* q;
+	struct timespec until;
+	struct timespec wake;
+	struct timespec now;
+
+	if(offset < 0 || (uint64_t)offset >= h->file->length || size == 0)
+		return 0;
+
+	start = h->base + offset;
+	end = h->base + (((uint64_t)offset + size < h->file->length) ? (uint64_t)offset + size : h->file->length);
+	first = start / t->meta->hdr->piece_length;
+	last = (end - 1) / t->meta->hdr->piece_length;
+
+	ready = __atomic_load_n(&h->ready, __ATOMIC_ACQUIRE);
+	if(first >= (int)(ready >> 32) && last <= (int)(uint32_t)ready)
+		return 0;
+
+	if(t->handle == NULL || t->have == NULL)
+		return -EIO;
+
+	have = cor_have_pieces(t, first, last);
+	if(have > 0)
+	{
+		cor_handle_ready(h, first, last);
+		return 0;
+	}
+	if(have < 0)
+		return -EIO;
+
+	if(cor_want_pieces(t, first, last, COR_READ_DEADLINE, COR_READ_DEADLINE_STEP) < 0)
+	{
+		cor_release_pieces(t, first, last, 0);
+		return -EIO;
+	}
+
+	waited = cor_stat_clock();
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += COR_READ_TIMEOUT;
+
+	// Sleep on the first piece still missing until it arrives, then move
+	// on to the next. Nothing is held while the pieces are checked, and
+	// only the piece's queue while asleep.
+	piece = first;
+	while(stat == 0)
+	{
+		while(piece <= last && cor_bits_test(t->have, piece))
+			piece++;
+		if(piece > last)
+			break;
+
+		wake = until;
+		if(!state->pumping)
+		{
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_sec += COR_READ_POLL;
+			if(wake.tv_sec > until.tv_sec)
+				wake = until;
+		}
+
+		q = cor_waitq(t, piece);
+		if(req != NULL)
+			fuse_req_interrupt_func(req, cor_wait_interrupt, q);
+
+		rc = 0;
+		pthread_mutex_lock(&q->lock);
+		q->waiting++;
+		while(rc != ETIMEDOUT && !cor_bits_test(t->have, piece) && !__atomic_load_n(&state->stopping, __ATOMIC_ACQUIRE)
+				&& !(req != NULL && fuse_req_interrupted(req)))
+			rc = pthread_cond_timedwait(&q->cond, &q->lock, &wake);
+		q->waiting--;
+		pthread_mutex_unlock(&q->lock);
+
+		if(req != NULL)
+			fuse_req_interrupt_func(req, NULL, NULL);
+
+		if((req != NULL) ? fuse_req_interrupted(req) : fuse_interrupted())
+			stat = -EINTR;
+		else if(__atomic_load_n(&state->stopping, __ATOMIC_ACQUIRE))
+			stat = -EIO;
+		else if(rc == ETIMEDOUT)
+		{
+			// Ask the session, in case the alert was lost, before giving
+			// up or sleeping again.
+			have = cor_have_pieces(t, piece, piece);
+			clock_gettime(CLOCK_REALTIME, &now);
+			if(have < 0)
+				stat = -EIO;
+			else if(have == 0 && (now.tv_sec > until.tv_sec || (now.tv_sec == until.tv_sec && now.tv_nsec >= until.tv_nsec)))
+			{
+				COR_LOG(LOG_WARNING, "Timed out waiting for pieces %d-%d.", piece, last);
+				stat = -EIO;
+			}
+		}
+	}
+
+	cor_release_pieces(t, first, last, 0);
+	cor_stat_record(COR_OP_PIECE_WAIT, waited, stat != 0);
+	if(stat == 0)
+		cor_handle_ready(h, first, last);
+	return stat;
+}
+
+// Frees |bufv| and the memory its buffers own, as FUSE does with the
+// ones read_buf returns.
+static void cor_bufvec_free(struct fuse_bufvec* bufv)
+{
+	size_t i;
+
+	for(i = 0; i < bufv->count; i++)
+		free(bufv->buf[i].mem);
+	free(bufv);
+}
+
+// Sets up a read of |size| bytes at |offset| from the file behind |h|
+// for either API, once the pieces are in. |req| is as for
+// cor_wait_range().
+//
+// Sequential readers, and everyone when the piece cache is off, get a
+// reference to the backing file that FUSE splices into /dev/fuse without
+// the data ever being copied through here. Other reads go through the
+// piece cache, since they are the ones likely to come back to the same
+// pieces.
+//
+// RETURNS
+// The data to reply with, freed with cor_bufvec_free(), or NULL with
+// |*err| set to -errno.
+static struct fuse_bufvec* cor_handle_read_buf(struct cor_handle* h, fuse_req_t req, size_t size, off_t offset, int* err)
+{
+	struct fuse_bufvec* bufv;
+	int stat = 0;
+	int streak;
+	double opened;
+
+	if(h->text != NULL)
+	{
+		bufv = malloc(sizeof(struct fuse_bufvec));
+		if(bufv == NULL)
+		{
+			*err = -ENOMEM;
+			return NULL;
+		}
+		size = (offset < 0 || (size_t)offset >= h->text_len) ? 0
+				: (size < h->text_len - offset) ? size : h->text_len - offset;
+		*bufv = FUSE_BUFVEC_INIT(size);
+		bufv->buf[0].mem = malloc(size ? size : 1);
+		if(bufv->buf[0].mem == NULL)
+		{
+			free(bufv);
+			*err = -ENOMEM;
+			return NULL;
+		}
+		memcpy(bufv->buf[0].mem, h->text + offset, size);
+		return bufv;
+	}
+
+	// Pieces that haven't arrived read back as holes in the backing
+	// file, so wait for the real data first.
+	if(h->file != NULL)
+	{
+		stat = cor_wait_range(h, req, size, offset);
+		if(stat < 0)
+		{
+			*err = stat;
+			return NULL;
+		}
+
+		if(offset < 0 || (uint64_t)offset >= h->file->length)
+			size = 0;
+		else if((uint64_t)offset + size > h->file->length)
+			size = h->file->length - offset;
+	}
+
+	bufv = malloc(sizeof(struct fuse_bufvec));
+	if(bufv == NULL)
+	{
+		*err = -ENOMEM;
+		return NULL;
+	}
+	*bufv = FUSE_BUFVEC_INIT(size);
+
+	pthread_mutex_lock(&h->lock);
+	streak = h->streak;
+	pthread_mutex_unlock(&h->lock);
+
+	if(h->file != NULL && COR_DATA->pieces != NULL && streak < COR_RA_STREAK)
+	{
+		bufv->buf[0].mem = malloc(size ? size : 1);
+		stat = (bufv->buf[0].mem != NULL) ? cor_read_cached(h, bufv->buf[0].mem, size, offset) : -ENOMEM;
+		if(stat >= 0)
+			bufv->buf[0].size = stat;
+	}
+	else
+	{
+		stat = cor_handle_fd(h);
+		if(stat >= 0)
+		{
+			bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+			bufv->buf[0].fd = stat;
+			bufv->buf[0].pos = offset;
+			stat = size;
+		}
+	}
+	if(stat < 0)
+	{
+		cor_bufvec_free(bufv);
+		*err = stat;
+		return NULL;
+	}
+
+	// The first read to finish on a handle gives its time to first byte.
+	pthread_mutex_lock(&h->lock);
+	opened = h->opened;
+	h->opened = 0;
+	pthread_mutex_unlock(&h->lock);
+	if(opened > 0 && h->file != NULL)
+		cor_record_ttfb(h->torrent->meta->strings + h->file->path_off, (cor_now() - opened) * 1000);
+
+	cor_readahead(h, offset, stat);
+
+	return bufv;
+}
+
 // FUSE Operations
 static int cor_getattr(const char* path, struct stat* stbuf)
 {
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_getattr");
+	struct cor_node* n;
+
+	COR_LOG(LOG_DEBUG, "cor_getattr");
+	n = cor_ns_lookup(COR_DATA->ns, path);
+	if(n != NULL)
+	{
+		cor_node_stat(n, stbuf);
+		return stat;
+	}
+
 	cor_expand_path(fpath, path);
 	stat = lstat(fpath, stbuf);
+	if(stat < 0)
+		return -errno;
 
 	return stat;
 }
@@ -63,7 +1169,7 @@ static int cor_readlink(const char* path, char* link, size_t size)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_readlink");
+	COR_LOG(LOG_DEBUG, "cor_readlink");
 	cor_expand_path(fpath, path);
 	stat = readlink(fpath, link, size - 1);
 
@@ -74,24 +1180,24 @@ static int cor_mknod(const char* path, mode_t mode, dev_t dev)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_mknod");
+	COR_LOG(LOG_DEBUG, "cor_mknod");
 	cor_expand_path(fpath, path);
 
 	if(S_ISREG(mode))
 	{
 		stat = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
 		if(stat < 0)
-			fprintf(stderr, "Failed to create node %s.\n", path);
+			COR_LOG(LOG_WARNING, "Failed to create node %s.", path);
 		else
 		{
 			stat = close(stat);
 			if(stat < 0)
-				fprintf(stderr, "Failed to drop node reference %s.\n", path);
+				COR_LOG(LOG_WARNING, "Failed to drop node reference %s.", path);
 		}
 	}
 	else
 	{
-		fprintf(stderr, "Attempted to create node of unsupported type %d.\n", mode);
+		COR_LOG(LOG_WARNING, "Attempted to create node of unsupported type %d.", mode);
 	}
 	return stat;
 }
@@ -100,12 +1206,12 @@ static int cor_mkdir(const char* path, mode_t mode)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_mkdir");
+	COR_LOG(LOG_DEBUG, "cor_mkdir");
 	cor_expand_path(fpath, path);
 
 	stat = mkdir(fpath, mode);
 	if(stat < 0)
-		fprintf(stderr, "Failed to make directory %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to make directory %s.", path);
 
 	return stat;
 }
@@ -114,12 +1220,12 @@ static int cor_unlink(const char* path)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_unlink");
+	COR_LOG(LOG_DEBUG, "cor_unlink");
 	cor_expand_path(fpath, path);
 
 	stat = unlink(fpath);
 	if(stat < 0)
-		fprintf(stderr, "Failed to unlink file %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to unlink file %s.", path);
 
 	return stat;
 }
@@ -128,12 +1234,12 @@ static int cor_rmdir(const char* path)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_rmdir");
+	COR_LOG(LOG_DEBUG, "cor_rmdir");
 	cor_expand_path(fpath, path);
 
 	stat = rmdir(fpath);
 	if(stat < 0)
-		fprintf(stderr, "Failed to remove directory %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to remove directory %s.", path);
 
 	return stat;
 }
@@ -142,12 +1248,12 @@ static int cor_symlink(const char* path, const char* link)
 	int stat = 0;
 	char flink[PATH_MAX];
 
-	fprintf(stderr, "cor_symlink");
+	COR_LOG(LOG_DEBUG, "cor_symlink");
 	cor_expand_path(flink, link);
 
 	stat = symlink(path, flink);
 	if(stat < 0)
-		fprintf(stderr, "Failed to create symbolic link %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to create symbolic link %s.", path);
 
 	return stat;
 }
@@ -157,13 +1263,13 @@ static int cor_rename(const char* path, const char* new)
 	char fpath[PATH_MAX];
 	char fnew[PATH_MAX];
 
-	fprintf(stderr, "cor_rename");
+	COR_LOG(LOG_DEBUG, "cor_rename");
 	cor_expand_path(fpath, path);
 	cor_expand_path(fnew, new);
 
 	stat = rename(fpath, fnew);
 	if(stat < 0)
-		fprintf(stderr, "Failed to rename %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to rename %s.", path);
 
 	return stat;
 }
@@ -173,13 +1279,13 @@ static int cor_link(const char* path, const char* new)
 	char fpath[PATH_MAX];
 	char fnew[PATH_MAX];
 
-	fprintf(stderr, "cor_link");
+	COR_LOG(LOG_DEBUG, "cor_link");
 	cor_expand_path(fpath, path);
 	cor_expand_path(fnew, new);
 
 	stat = link(fpath, fnew);
 	if(stat < 0)
-		fprintf(stderr, "Failed to create hard link to %s.\n", new);
+		COR_LOG(LOG_WARNING, "Failed to create hard link to %s.", new);
 
 	return stat;
 }
@@ -188,10 +1294,10 @@ static int cor_chmod(const char* path, mode_t mode)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_chmod");
+	COR_LOG(LOG_DEBUG, "cor_chmod");
 	stat = chmod(fpath, mode);
 	if(stat < 0)
-		fprintf(stderr, "Failed to change file mode for %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to change file mode for %s.", path);
 
 	return stat;
 }
@@ -199,13 +1305,19 @@ static int cor_truncate(const char* path, off_t size)
 {
 	int stat = 0;
 	char fpath[PATH_MAX];
+	struct cor_node* n;
 
-	fprintf(stderr, "cor_truncate");
+	COR_LOG(LOG_DEBUG, "cor_truncate");
 	cor_expand_path(fpath, path);
 
+	// As in cor_open(), torrent data is only ever written by the session.
+	n = cor_ns_lookup(COR_DATA->ns, path);
+	if(n != NULL && (n->file != NULL || n->ctl != COR_CTL_NONE))
+		return -EACCES;
+
 	stat = truncate(fpath, size);
 	if(stat < 0)
-		fprintf(stderr, "Failed to resize file %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to resize file %s.", path);
 
 	return stat;
 }
@@ -214,53 +1326,126 @@ static int cor_utime(const char* path, struct utimbuf* ubuf)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_utime");
+	COR_LOG(LOG_DEBUG, "cor_utime");
 	cor_expand_path(fpath, path);
 
 	stat = utime(fpath, ubuf);
 	if(stat < 0)
-		fprintf(stderr, "Could not change time attributes of %s.\n", path);
+		COR_LOG(LOG_WARNING, "Could not change time attributes of %s.", path);
 
 	return stat;
 }
-// TODO: Swap out the integer file-descriptor for our more useful
-// struct that keeps track of the file's download progress.
 static int cor_open(const char* path, struct fuse_file_info* fi)
 {
 	int fd;
 	int stat = 0;
 	char fpath[PATH_MAX];
+	struct cor_handle* h;
+
+	struct cor_node* n;
 
-	fprintf(stderr, "cor_open");
+	COR_LOG(LOG_DEBUG, "cor_open");
 	cor_expand_path(fpath, path);
 
+	// Torrent data is only ever written by the session.
+	n = cor_ns_lookup(COR_DATA->ns, path);
+	if(n != NULL && (n->file != NULL || n->ctl != COR_CTL_NONE) && (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	if(n != NULL && n->ctl != COR_CTL_NONE)
+	{
+		if(COR_NODE_DIR(n))
+			return -EISDIR;
+		h = cor_ctl_open(n);
+		if(h == NULL)
+			return -ENOMEM;
+		fi->fh = (uintptr_t)h;
+
+		// The size reported is zero; reads must reach here regardless.
+		fi->direct_io = 1;
+		return stat;
+	}
+
 	fd = open(fpath, fi->flags);
-	if(fd < 0)
-		fprintf(stderr, "Could not open file %s.\n", path);
+	if(fd < 0 && !(errno == ENOENT && n != NULL && n->file != NULL))
+	{
+		COR_LOG(LOG_WARNING, "Could not open file %s.", path);
+		return -errno;
+	}
 
-	fi->fh = fd;
+	h = cor_handle_create(n, fd);
+	if(h == NULL)
+	{
+		if(fd >= 0)
+			close(fd);
+		return -ENOMEM;
+	}
+	fi->fh = (uintptr_t)h;
+
+	if((fi->flags & O_ACCMODE) != O_WRONLY)
+		cor_prefetch(h);
+
+	return stat;
+}
+static int cor_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	int stat = 0;
+
+	COR_LOG(LOG_DEBUG, "cor_read_buf");
+	*bufp = cor_handle_read_buf(COR_HANDLE(fi), NULL, size, offset, &stat);
+	if(*bufp == NULL)
+		COR_LOG(LOG_WARNING, "Failed to read from file %s.", path);
 
 	return stat;
 }
 static int cor_read(const char* path, char* rbuf, size_t size, off_t offset, struct fuse_file_info* fi)
 {
 	int stat = 0;
+	struct fuse_bufvec* bufv;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	uint64_t start;
+
+	COR_LOG(LOG_DEBUG, "cor_read");
+	stat = cor_read_buf(path, &bufv, size, offset, fi);
+	if(stat < 0)
+		return stat;
+
+	dst.buf[0].mem = rbuf;
+	start = cor_stat_clock();
+	stat = fuse_buf_copy(&dst, bufv, 0);
+	if(bufv->buf[0].flags & FUSE_BUF_IS_FD)
+		cor_stat_record(COR_OP_DISK, start, stat < 0);
+	cor_bufvec_free(bufv);
+
+	return stat;
+}
+static int cor_write(const char* path, char* wbuf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	int stat = 0;
+	struct cor_handle* h = COR_HANDLE(fi);
 
-	fprintf(stderr, "cor_read");
-	stat = pread(fi->fh, rbuf, size, offset);
+	COR_LOG(LOG_DEBUG, "cor_write");
+	stat = pwrite(h->fd, wbuf, size, offset);
 	if(stat < 0)
-		fprintf(stderr, "Failed to read from file %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to write to file %s.", path);
 
 	return stat;
 }
-static int cor_write(const char* path, char* wbuf, size_t size, off_t offset, struct fuse_file_info* fi)
+// Writes |buf| to the backing file, spliced straight out of /dev/fuse
+// when the kernel allows it.
+static int cor_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi)
 {
 	int stat = 0;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	COR_LOG(LOG_DEBUG, "cor_write_buf");
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = COR_HANDLE(fi)->fd;
+	dst.buf[0].pos = offset;
 
-	fprintf(stderr, "cor_write");
-	stat = pwrite(fi->fh, wbuf, size, offset);
+	stat = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
 	if(stat < 0)
-		fprintf(stderr, "Failed to write to file %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to write to file %s.", path);
 
 	return stat;
 }
@@ -269,12 +1454,12 @@ static int cor_statfs(const char* path, struct statvfs* statv)
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_statfs");
+	COR_LOG(LOG_DEBUG, "cor_statfs");
 	cor_expand_path(fpath, path);
 
 	stat = statvfs(fpath, statv);
 	if(stat < 0)
-		fprintf(stderr, "Failed to stat %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to stat %s.", path);
 
 	return stat;
 }
@@ -283,7 +1468,7 @@ static int cor_flush(const char* path, struct fuse_file_info* fi)
 	(void) path;
 	(void) fi;
 
-	fprintf(stderr, "cor_flush");
+	COR_LOG(LOG_DEBUG, "cor_flush");
 
 	return 0;
 }
@@ -291,22 +1476,27 @@ static int cor_release(const char* path, struct fuse_file_info* fi)
 {
 	int stat = 0;
 
-	fprintf(stderr, "cor_release");
-	stat = close(fi->fh);
+	COR_LOG(LOG_DEBUG, "cor_release");
+	if(COR_HANDLE(fi)->fd >= 0)
+		stat = close(COR_HANDLE(fi)->fd);
+	cor_handle_destroy(COR_HANDLE(fi));
+	fi->fh = 0;
 	return stat;
 }
 static int cor_fsync(const char* path, int datasync, struct fuse_file_info* fi)
 {
 	int stat = 0;
 
-	fprintf(stderr, "cor_fsync");
+	COR_LOG(LOG_DEBUG, "cor_fsync");
+	if(COR_HANDLE(fi)->fd < 0)
+		return stat;
 	if(datasync)
-		stat = fdatasync(fi->fh);
+		stat = fdatasync(COR_HANDLE(fi)->fd);
 	else
-		stat = fsync(fi->fh);
+		stat = fsync(COR_HANDLE(fi)->fd);
 
 	if(stat < 0)
-		fprintf(stderr, "Failed to sync data for %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to sync data for %s.", path);
 
 	return stat;
 }
@@ -315,108 +1505,192 @@ static int cor_setxattr(const char* path, const char* name, const char* value, s
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_setxattr");
+	COR_LOG(LOG_DEBUG, "cor_setxattr");
 	cor_expand_path(fpath, path);
 
 	stat = lsetxattr(fpath, name, value, size, flags);
 	if(stat < 0)
-		fprintf(stderr, "Could not set extended attribute of %s.\n", path);
+		COR_LOG(LOG_WARNING, "Could not set extended attribute of %s.", path);
 
 	return stat;
 }
+// Torrent files answer the COR_XATTR_PREFIX attributes themselves;
+// everything else is the backing file's.
 static int cor_getxattr(const char* path, const char* name, char* value, size_t size)
 {
 	int stat = 0;
 	char fpath[PATH_MAX];
+	struct cor_node* n;
+
+	COR_LOG(LOG_DEBUG, "cor_getxattr");
+	n = cor_ns_lookup(COR_DATA->ns, path);
+	if(n != NULL && n->file != NULL && strncmp(name, COR_XATTR_PREFIX, sizeof(COR_XATTR_PREFIX) - 1) == 0)
+		return cor_progress_getxattr(n->torrent, n->file, name, value, size);
 
-	fprintf(stderr, "cor_getxattr");
 	cor_expand_path(fpath, path);
 
 	stat = lgetxattr(fpath, name, value, size);
 	if(stat < 0)
-		fprintf(stderr, "Could not get extended attribute of %s.\n", path);
+	{
+		stat = -errno;
+		COR_LOG(LOG_WARNING, "Could not get extended attribute of %s.", path);
+	}
 
 	return stat;
 }
 static int cor_listxattr(const char* path, char* list, size_t size)
 {
 	int stat = 0;
+	int extra;
 	char fpath[PATH_MAX];
 	char* atptr;
+	struct cor_node* n;
 
-	fprintf(stderr, "cor_listxattr");
+	COR_LOG(LOG_DEBUG, "cor_listxattr");
 	cor_expand_path(fpath, path);
+	n = cor_ns_lookup(COR_DATA->ns, path);
 
+	// A torrent file the session hasn't created yet still has ours.
 	stat = llistxattr(fpath, list, size);
+	if(stat < 0 && !(errno == ENOENT && n != NULL && n->file != NULL))
+	{
+		stat = -errno;
+		COR_LOG(LOG_WARNING, "Failed to list extended attributes for %s.", path);
+		return stat;
+	}
 	if(stat < 0)
-		fprintf(stderr, "Failed to list extended attributes for %s.\n", path);
+		stat = 0;
 
-	return stat;
+	if(n == NULL || n->file == NULL || n->torrent->progress == NULL)
+		return stat;
+
+	if(size == 0)
+		extra = cor_progress_listxattr(NULL, 0);
+	else
+		extra = (size > (size_t)stat) ? cor_progress_listxattr(list + stat, size - stat) : -ERANGE;
+	return (extra < 0) ? extra : stat + extra;
 }
 static int cor_removexattr(const char* path, const char* name)
 {
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_removexattr");
+	COR_LOG(LOG_DEBUG, "cor_removexattr");
 	cor_expand_path(fpath, path);
 
 	stat = lremovexattr(fpath, name);
 	if(stat < 0)
-		fprintf(stderr, "Failed to remove extended attribute from %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to remove extended attribute from %s.", path);
 
 	return stat;
 }
-static int cor_opendir(const char* path, struct fuse_file_info* fi)
+// Open directory: its node, if the torrents have a directory there, and
+// the backing directory, if there is one.
+struct cor_dir
 {
+	struct cor_node* node;
 	DIR* dp;
+};
+
+static int cor_opendir(const char* path, struct fuse_file_info* fi)
+{
+	struct cor_dir* d;
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_opendir");
+	COR_LOG(LOG_DEBUG, "cor_opendir");
 	cor_expand_path(fpath, path);
 
-	dp = opendir(fpath);
-	if(dp == NULL)
-		fprintf(stderr, "Could not open directory %s.\n", path);
+	d = calloc(1, sizeof(struct cor_dir));
+	if(d == NULL)
+		return -ENOMEM;
+
+	d->node = cor_ns_lookup(COR_DATA->ns, path);
+	if(d->node != NULL && !COR_NODE_DIR(d->node))
+	{
+		free(d);
+		return -ENOTDIR;
+	}
+
+	d->dp = opendir(fpath);
+	if(d->dp == NULL && d->node == NULL)
+	{
+		stat = -errno;
+		COR_LOG(LOG_WARNING, "Could not open directory %s.", path);
+		free(d);
+		return stat;
+	}
 
-	fi->fh = (intptr_t)dp;
+	fi->fh = (uintptr_t)d;
 
 	return stat;
 }
 static int cor_readdir(const char* path, void* rdbuf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi)
 {
-	DIR* dp;
-	int stat = 0;
+	struct cor_dir* d;
+	struct cor_node* c;
 	struct dirent* de;
+	struct stat st;
+	char name[NAME_MAX + 1];
+	int stat = 0;
+	uint32_t i;
 
-	fprintf(stderr, "cor_readdir");
-	dp = (DIR*)(uintptr_t)fi->fh;
+	COR_LOG(LOG_DEBUG, "cor_readdir");
+	d = (struct cor_dir*)(uintptr_t)fi->fh;
 
-	de = readdir(dp);
-	if(de == 0)
+	if(d->node != NULL)
 	{
-		fprintf(stderr, "Failed to read directory entry for %s.\n", path);
-		return stat;
+		if(filler(rdbuf, ".", NULL, 0) != 0 || filler(rdbuf, "..", NULL, 0) != 0)
+			return -ENOMEM;
+
+		for(i = 0; i < d->node->num_children; i++)
+		{
+			c = d->node->children[i];
+			if(c->namelen > NAME_MAX)
+				continue;
+			memcpy(name, c->name, c->namelen);
+			name[c->namelen] = '\0';
+			cor_node_stat(c, &st);
+			if(filler(rdbuf, name, &st, 0) != 0)
+			{
+				COR_LOG(LOG_WARNING, "Filler couldn't complete task due to buffer overflow.");
+				return -ENOMEM;
+			}
+		}
 	}
 
-	do
+	// Whatever else is in the save directory, less what the torrents
+	// already listed.
+	if(d->dp != NULL)
 	{
-		if(filler(rdbuf, de->d_name, NULL, 0) != 0)
+		rewinddir(d->dp);
+		while((de = readdir(d->dp)) != NULL)
 		{
-			fprintf(stderr, "Filler couldn't complete task due to buffer overflow.\n");
-			return -ENOMEM;
+			if(d->node != NULL && (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0
+					|| cor_ns_child(d->node, de->d_name, strlen(de->d_name)) != NULL))
+				continue;
+
+			if(filler(rdbuf, de->d_name, NULL, 0) != 0)
+			{
+				COR_LOG(LOG_WARNING, "Filler couldn't complete task due to buffer overflow.");
+				return -ENOMEM;
+			}
 		}
-	} while((de == readdir(dp)) != NULL);
+	}
 
 	return stat;
 }
 static int cor_releasedir(const char* path, struct fuse_file_info* fi)
 {
+	struct cor_dir* d;
 	int stat = 0;
 
-	fprintf(stderr, "cor_releasedir");
-	closedir((DIR*)(uintptr_t)fi->fh);
+	COR_LOG(LOG_DEBUG, "cor_releasedir");
+	d = (struct cor_dir*)(uintptr_t)fi->fh;
+	if(d->dp != NULL)
+		closedir(d->dp);
+	free(d);
+	fi->fh = 0;
 	return stat;
 }
 static int cor_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi)
@@ -425,41 +1699,24 @@ static int cor_fsyncdir(const char* path, int datasync, struct fuse_file_info* f
 	(void) datasync;
 	(void) fi;
 
-	fprintf(stderr, "cor_fsyncdir");
+	COR_LOG(LOG_DEBUG, "cor_fsyncdir");
 	return 0;
 }
 static void* cor_init(struct fuse_conn_info* ci)
 {
-	printf("Mounting %s as volume...\n", COR_DATA->torrent);
-
-	FILE* inf;
-	char* fbuf;
-	long flen;
+	struct cor_torrent* t;
+	int i;
 
-	fprintf(stderr, "cor_init");
-	// Attempt to open torrent file for reading.
-	inf = fopen(COR_DATA->torrent, "r");
-	if(inf == NULL)
-		return 1;
-
-	// Seek to end of file to determine its length.
-	fseek(inf, 0L, SEEK_END);
-	flen = ftell(inf);
-	fseek(inf, 0L, SEEK_SET);
-
-	// Allocate buffer of appropriate size.
-	fbuf = (char*)calloc(flen, sizeof(char));
-	if(fbuf == NULL)
-		return 1;
+	// Only now, with the mount daemonized, can the flusher be started;
+	// a thread started before the fork would not come along.
+	cor_log_start();
 
-	fread(fbuf, sizeof(char), flen, inf);
-	fclose(inf);
+	COR_LOG(LOG_NOTICE, "Mounting %s as volume...", COR_DATA->torrent);
 
-	// Decode the bencoded torrent description.
-	bd_dict* file_dict = decode(fbuf, flen);
+	COR_LOG(LOG_DEBUG, "cor_init");
 
-	// Free file buffer.
-	free(fbuf);
+	// Let replies be spliced from the backing files, and writes into them.
+	ci->want |= ci->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
 
 	// Create session.
 	COR_DATA->session = session_create
@@ -474,16 +1731,61 @@ static void* cor_init(struct fuse_conn_info* ci)
 		TAG_END
 	);
 
-	// Add the mounted torrent to the session.
-	int tnum = session_add_torrent
-	(
-		COR_DATA->session,
-		TOR_FILENAME, COR_DATA->torrent,
-		TOR_SAVE_PATH, COR_DATA->root,
-		TAG_END
-	);
+	// Only what the pump turns into wakeups, and errors worth a log line.
+	// Failed hash checks are status alerts, so those come along too.
+	session_set_settings(COR_DATA->session, SET_ALERT_MASK, cat_progress | cat_storage | cat_error | cat_status, TAG_END);
+
+	// Add the mounted torrents to the session, as parsed at import. The
+	// mount doesn't serve anything until init returns, so it is ready
+	// once all are in.
+	for(i = 0; i < COR_DATA->num_torrents; i++)
+	{
+		t = &COR_DATA->torrents[i];
+		pthread_mutex_init(&t->want_lock, NULL);
+		t->handle = cor_tor_add(COR_DATA->session, t->params, COR_DATA->root);
+		t->params = NULL;
+		if(t->handle == NULL)
+		{
+			COR_LOG(LOG_ERR, "Session refused torrent %s.", t->path);
+			continue;
+		}
+
+		// Nobody wants any piece yet.
+		t->wanted = calloc(t->meta->hdr->num_pieces ? t->meta->hdr->num_pieces : 1, sizeof(uint32_t));
+		if(t->wanted == NULL)
+			COR_LOG(LOG_WARNING, "No memory to count wanted pieces of %s; readahead will keep them requested.", t->path);
 
-	printf("Mounting to %s.\n", COR_DATA->root);
+		// Whatever was already on disk and checked out.
+		t->have = cor_bits_create(t->meta->hdr->num_pieces);
+		if(t->have != NULL)
+			cor_tor_have_pieces(t->handle, t->have, t->meta->hdr->num_pieces);
+		else
+			COR_LOG(LOG_ERR, "No memory to track the pieces of %s.", t->path);
+
+		// Progress is counted up from what is there now, before the pump
+		// can add to it.
+		if(t->have != NULL)
+			t->progress = cor_progress_create(t);
+		if(t->have != NULL && t->progress == NULL)
+			COR_LOG(LOG_ERR, "No memory to track the progress of %s.", t->path);
+	}
+
+	// Pieces that arrive from here on are picked up from the alerts.
+	COR_DATA->pumping = (pthread_create(&COR_DATA->pump, NULL, cor_alert_pump, COR_DATA) == 0);
+	if(!COR_DATA->pumping)
+		COR_LOG(LOG_WARNING, "Could not start the alert pump; reads will poll for pieces.");
+
+	// Status for the control directory.
+	COR_DATA->status = cor_status_create(COR_DATA->session, COR_DATA->torrents, COR_DATA->num_torrents, COR_DATA->status_interval);
+	if(COR_DATA->status == NULL || cor_status_start(COR_DATA->status) < 0)
+		COR_LOG(LOG_WARNING, "Could not start sampling the session status.");
+
+	COR_DATA->mounted = time(NULL);
+	COR_DATA->ns = cor_ns_build(COR_DATA->torrents, COR_DATA->num_torrents);
+	if(COR_DATA->ns == NULL)
+		COR_LOG(LOG_ERR, "Could not build the file tree, serving the save directory only.");
+
+	COR_LOG(LOG_NOTICE, "Mounting to %s.", COR_DATA->root);
 
 	return COR_DATA;
 }
@@ -491,20 +1793,76 @@ static void* cor_init(struct fuse_conn_info* ci)
 // entire volume to a .torrent and submit to a tracker?
 static void cor_destroy(void* userdata)
 {
-	fprintf(stderr, "cor_destroy");
-	(void) userdata;
+	struct cor_state* state = userdata;
+	int i;
+	uint64_t hits;
+	uint64_t misses;
+	size_t used;
+
+	COR_LOG(LOG_DEBUG, "cor_destroy");
+	__atomic_store_n(&state->stopping, 1, __ATOMIC_RELEASE);
+	cor_wake_all();
+	if(state->pumping)
+	{
+		// The alert only needs to exist: the pump finds |stopping| set
+		// whether it pops it or is woken by it. Should it be dropped, the
+		// pump still notices within COR_ALERT_WAIT.
+		cor_tor_wake(state->session);
+		pthread_join(state->pump, NULL);
+		state->pumping = 0;
+	}
+	cor_status_destroy(state->status);
+	state->status = NULL;
+
+	if(state->pieces != NULL)
+	{
+		cor_cache_stats(state->pieces, &hits, &misses, &used);
+		COR_LOG(LOG_INFO, "Piece cache: %llu hits, %llu misses, %zu bytes held.",
+				(unsigned long long)hits, (unsigned long long)misses, used);
+		cor_cache_destroy(state->pieces);
+		state->pieces = NULL;
+	}
+	if(state->ttfb_count > 0)
+	{
+		COR_LOG(LOG_INFO, "Time to first byte over %llu files: %llu ms average, %llu ms worst.",
+				(unsigned long long)state->ttfb_count,
+				(unsigned long long)(state->ttfb_total / state->ttfb_count),
+				(unsigned long long)state->ttfb_max);
+	}
+	cor_ns_free(state->ns);
+	state->ns = NULL;
+	for(i = 0; i < state->num_torrents; i++)
+	{
+		cor_tor_release(state->torrents[i].handle);
+		cor_progress_free(&state->torrents[i]);
+		free(state->torrents[i].wanted);
+		pthread_mutex_destroy(&state->torrents[i].want_lock);
+		free(state->torrents[i].have);
+		cor_meta_free(state->torrents[i].meta);
+		free(state->torrents[i].path);
+	}
+	free(state->torrents);
+	state->torrents = NULL;
+	state->num_torrents = 0;
+
+	cor_log_stop();
 }
 static int cor_access(const char* path, int mask)
 {
 	int stat = 0;
 	char fpath[PATH_MAX];
 
-	fprintf(stderr, "cor_access");
-	cor_expand_path(fpath, path);
+	struct cor_node* n;
+
+	COR_LOG(LOG_DEBUG, "cor_access");
+	n = cor_ns_lookup(COR_DATA->ns, path);
+	if(n != NULL)
+		return (mask & W_OK) ? -EACCES : 0;
 
+	cor_expand_path(fpath, path);
 	stat = access(fpath, mask);
 	if(stat < 0)
-		fprintf(stderr, "Could not grant access to %s.\n", stat);
+		COR_LOG(LOG_WARNING, "Could not grant access to %s.", path);
 
 	return stat;
 }
@@ -513,15 +1871,25 @@ static int cor_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 	int stat = 0;
 	char fpath[PATH_MAX];
 	int fd;
+	struct cor_handle* h;
 
-	fprintf(stderr, "cor_create");
+	COR_LOG(LOG_DEBUG, "cor_create");
 	cor_expand_path(fpath, path);
 
 	fd = creat(fpath, mode);
 	if(fd < 0)
-		fprintf(stderr, "Could not create file %s.\n", path);
+	{
+		COR_LOG(LOG_WARNING, "Could not create file %s.", path);
+		return -errno;
+	}
 
-	fi->fh = fd;
+	h = cor_handle_create(NULL, fd);
+	if(h == NULL)
+	{
+		close(fd);
+		return -ENOMEM;
+	}
+	fi->fh = (uintptr_t)h;
 
 	return stat;
 }
@@ -529,10 +1897,12 @@ static int cor_ftruncate(const char* path, off_t offset, struct fuse_file_info*
 {
 	int stat = 0;
 
-	fprintf(stderr, "cor_ftruncate");
-	stat = ftruncate(fi->fh, offset);
+	COR_LOG(LOG_DEBUG, "cor_ftruncate");
+	if(COR_HANDLE(fi)->fd < 0)
+		return -EACCES;
+	stat = ftruncate(COR_HANDLE(fi)->fd, offset);
 	if(stat < 0)
-		fprintf(stderr, "Failed to resize file %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to resize file %s.", path);
 
 	return stat;
 }
@@ -540,63 +1910,675 @@ static int cor_fgetattr(const char* path, struct stat* statbuf, struct fuse_file
 {
 	int stat = 0;
 
-	fprintf(stderr, "cor_fgetattr");
-	stat = fstat(fi->fh, statbuf);
+	COR_LOG(LOG_DEBUG, "cor_fgetattr");
+	if(COR_HANDLE(fi)->node != NULL)
+	{
+		cor_node_stat(COR_HANDLE(fi)->node, statbuf);
+		return stat;
+	}
+	stat = fstat(COR_HANDLE(fi)->fd, statbuf);
 	if(stat < 0)
-		fprintf(stderr, "Failed to get attributes for file %s.\n", path);
+		COR_LOG(LOG_WARNING, "Failed to get attributes for file %s.", path);
 
 	return stat;
 }
 
+// Every op is timed by a wrapper around it, which is what FUSE is
+// handed. Reads and writes count the same whether or not they come in
+// as buffers.
+#define COR_TIMED(fn, op, params, args) \
+	static int fn##_timed params \
+	{ \
+		uint64_t start = cor_stat_clock(); \
+		int stat = fn args; \
+		cor_stat_record((op), start, stat < 0); \
+		return stat; \
+	}
+
+COR_TIMED(cor_getattr, COR_OP_GETATTR, (const char* path, struct stat* stbuf), (path, stbuf))
+COR_TIMED(cor_readlink, COR_OP_READLINK, (const char* path, char* link, size_t size), (path, link, size))
+COR_TIMED(cor_mknod, COR_OP_MKNOD, (const char* path, mode_t mode, dev_t dev), (path, mode, dev))
+COR_TIMED(cor_mkdir, COR_OP_MKDIR, (const char* path, mode_t mode), (path, mode))
+COR_TIMED(cor_unlink, COR_OP_UNLINK, (const char* path), (path))
+COR_TIMED(cor_rmdir, COR_OP_RMDIR, (const char* path), (path))
+COR_TIMED(cor_symlink, COR_OP_SYMLINK, (const char* path, const char* link), (path, link))
+COR_TIMED(cor_rename, COR_OP_RENAME, (const char* path, const char* new), (path, new))
+COR_TIMED(cor_link, COR_OP_LINK, (const char* path, const char* new), (path, new))
+COR_TIMED(cor_chmod, COR_OP_CHMOD, (const char* path, mode_t mode), (path, mode))
+COR_TIMED(cor_truncate, COR_OP_TRUNCATE, (const char* path, off_t size), (path, size))
+COR_TIMED(cor_utime, COR_OP_UTIME, (const char* path, struct utimbuf* ubuf), (path, ubuf))
+COR_TIMED(cor_open, COR_OP_OPEN, (const char* path, struct fuse_file_info* fi), (path, fi))
+COR_TIMED(cor_read, COR_OP_READ, (const char* path, char* rbuf, size_t size, off_t offset, struct fuse_file_info* fi), (path, rbuf, size, offset, fi))
+COR_TIMED(cor_write, COR_OP_WRITE, (const char* path, char* wbuf, size_t size, off_t offset, struct fuse_file_info* fi), (path, wbuf, size, offset, fi))
+COR_TIMED(cor_statfs, COR_OP_STATFS, (const char* path, struct statvfs* statv), (path, statv))
+COR_TIMED(cor_flush, COR_OP_FLUSH, (const char* path, struct fuse_file_info* fi), (path, fi))
+COR_TIMED(cor_release, COR_OP_RELEASE, (const char* path, struct fuse_file_info* fi), (path, fi))
+COR_TIMED(cor_fsync, COR_OP_FSYNC, (const char* path, int datasync, struct fuse_file_info* fi), (path, datasync, fi))
+COR_TIMED(cor_setxattr, COR_OP_SETXATTR, (const char* path, const char* name, const char* value, size_t size, int flags), (path, name, value, size, flags))
+COR_TIMED(cor_getxattr, COR_OP_GETXATTR, (const char* path, const char* name, char* value, size_t size), (path, name, value, size))
+COR_TIMED(cor_listxattr, COR_OP_LISTXATTR, (const char* path, char* list, size_t size), (path, list, size))
+COR_TIMED(cor_removexattr, COR_OP_REMOVEXATTR, (const char* path, const char* name), (path, name))
+COR_TIMED(cor_opendir, COR_OP_OPENDIR, (const char* path, struct fuse_file_info* fi), (path, fi))
+COR_TIMED(cor_readdir, COR_OP_READDIR, (const char* path, void* rdbuf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi), (path, rdbuf, filler, offset, fi))
+COR_TIMED(cor_releasedir, COR_OP_RELEASEDIR, (const char* path, struct fuse_file_info* fi), (path, fi))
+COR_TIMED(cor_fsyncdir, COR_OP_FSYNCDIR, (const char* path, int datasync, struct fuse_file_info* fi), (path, datasync, fi))
+COR_TIMED(cor_access, COR_OP_ACCESS, (const char* path, int mask), (path, mask))
+COR_TIMED(cor_create, COR_OP_CREATE, (const char* path, mode_t mode, struct fuse_file_info* fi), (path, mode, fi))
+COR_TIMED(cor_ftruncate, COR_OP_FTRUNCATE, (const char* path, off_t offset, struct fuse_file_info* fi), (path, offset, fi))
+COR_TIMED(cor_fgetattr, COR_OP_FGETATTR, (const char* path, struct stat* statbuf, struct fuse_file_info* fi), (path, statbuf, fi))
+COR_TIMED(cor_read_buf, COR_OP_READ, (const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi), (path, bufp, size, offset, fi))
+COR_TIMED(cor_write_buf, COR_OP_WRITE, (const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi), (path, buf, offset, fi))
+
 // Struct binding implemented funcs.
 static struct fuse_operations cor_ops =
 {
-  .getattr = cor_getattr,
-  .readlink = cor_readlink,
-  .mknod = cor_mknod,
-  .mkdir = cor_mkdir,
-  .unlink = cor_unlink,
-  .rmdir = cor_rmdir,
-  .symlink = cor_symlink,
-  .rename = cor_rename,
-  .link = cor_link,
-  .chmod = cor_chmod,
-  .truncate = cor_truncate,
-  .utime = cor_utime,
-  .open = cor_open,
-  .read = cor_read,
-  .write = cor_write,
-  .statfs = cor_statfs,
-  .flush = cor_flush,
-  .release = cor_release,
-  .fsync = cor_fsync,
-  .setxattr = cor_setxattr,
-  .getxattr = cor_getxattr,
-  .listxattr = cor_listxattr,
-  .removexattr = cor_removexattr,
-  .opendir = cor_opendir,
-  .readdir = cor_readdir,
-  .releasedir = cor_releasedir,
-  .fsyncdir = cor_fsyncdir,
+  .getattr = cor_getattr_timed,
+  .readlink = cor_readlink_timed,
+  .mknod = cor_mknod_timed,
+  .mkdir = cor_mkdir_timed,
+  .unlink = cor_unlink_timed,
+  .rmdir = cor_rmdir_timed,
+  .symlink = cor_symlink_timed,
+  .rename = cor_rename_timed,
+  .link = cor_link_timed,
+  .chmod = cor_chmod_timed,
+  .truncate = cor_truncate_timed,
+  .utime = cor_utime_timed,
+  .open = cor_open_timed,
+  .read = cor_read_timed,
+  .write = cor_write_timed,
+  .statfs = cor_statfs_timed,
+  .flush = cor_flush_timed,
+  .release = cor_release_timed,
+  .fsync = cor_fsync_timed,
+  .setxattr = cor_setxattr_timed,
+  .getxattr = cor_getxattr_timed,
+  .listxattr = cor_listxattr_timed,
+  .removexattr = cor_removexattr_timed,
+  .opendir = cor_opendir_timed,
+  .readdir = cor_readdir_timed,
+  .releasedir = cor_releasedir_timed,
+  .fsyncdir = cor_fsyncdir_timed,
   .init = cor_init,
   .destroy = cor_destroy,
-  .access = cor_access,
-  .create = cor_create,
-  .ftruncate = cor_ftruncate,
-  .fgetattr = cor_fgetattr,
+  .access = cor_access_timed,
+  .create = cor_create_timed,
+  .ftruncate = cor_ftruncate_timed,
+  .fgetattr = cor_fgetattr_timed,
+  .read_buf = cor_read_buf_timed,
+  .write_buf = cor_write_buf_timed,
+};
+
+// Low-level Operations
+//
+// Inode numbers are the tree's own, so nothing here builds or resolves a
+// path; the kernel hands back the inode and it indexes straight into the
+// node array. Only the torrents' files are served this way, read-only.
+
+// Whether the low-level op running on this thread replied with an
+// error, for its timing.
+static __thread int cor_ll_failed;
+
+static int cor_ll_reply_err(fuse_req_t req, int err)
+{
+	if(err != 0)
+		cor_ll_failed = 1;
+	return fuse_reply_err(req, err);
+}
+
+static void cor_ll_init(void* userdata, struct fuse_conn_info* ci)
+{
+	cor_init(ci);
+}
+static void cor_ll_entry(struct cor_node* n, struct fuse_entry_param* e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = n->ino;
+	e->attr_timeout = COR_LL_ATTR_TIMEOUT;
+	e->entry_timeout = COR_LL_ENTRY_TIMEOUT;
+	cor_node_stat(n, &e->attr);
+}
+static void cor_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	struct cor_node* dir;
+	struct cor_node* n = NULL;
+	struct fuse_entry_param e;
+
+	dir = cor_ns_node(COR_DATA->ns, parent);
+	if(dir == NULL)
+	{
+		cor_ll_reply_err(req, ENOENT);
+		return;
+	}
+	if(COR_NODE_DIR(dir))
+		n = cor_ns_child(dir, name, strlen(name));
+
+	if(n == NULL)
+	{
+		// The tree is fixed, so misses may be cached as long as hits.
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.entry_timeout = COR_LL_ENTRY_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	cor_ll_entry(n, &e);
+	__atomic_fetch_add(&n->nlookup, 1, __ATOMIC_RELAXED);
+	if(fuse_reply_entry(req, &e) != 0)
+		__atomic_fetch_sub(&n->nlookup, 1, __ATOMIC_RELAXED);
+}
+static void cor_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+
+	if(n != NULL && __atomic_fetch_sub(&n->nlookup, nlookup, __ATOMIC_RELAXED) < nlookup)
+		COR_LOG(LOG_WARNING, "Inode %llu forgotten more often than looked up.", (unsigned long long)ino);
+	fuse_reply_none(req);
+}
+static void cor_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+	struct stat st;
+
+	if(n == NULL)
+	{
+		cor_ll_reply_err(req, ENOENT);
+		return;
+	}
+	cor_node_stat(n, &st);
+	fuse_reply_attr(req, &st, COR_LL_ATTR_TIMEOUT);
+}
+static void cor_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+
+	if(n == NULL)
+		cor_ll_reply_err(req, ENOENT);
+	else
+		cor_ll_reply_err(req, (mask & W_OK) ? EACCES : 0);
+}
+static void cor_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+	struct cor_handle* h;
+	char fpath[PATH_MAX];
+	int fd;
+
+	if(n == NULL || COR_NODE_DIR(n))
+	{
+		cor_ll_reply_err(req, (n == NULL) ? ENOENT : EISDIR);
+		return;
+	}
+	if((fi->flags & O_ACCMODE) != O_RDONLY)
+	{
+		cor_ll_reply_err(req, EACCES);
+		return;
+	}
+
+	if(n->ctl != COR_CTL_NONE)
+	{
+		h = cor_ctl_open(n);
+		if(h == NULL)
+		{
+			cor_ll_reply_err(req, ENOMEM);
+			return;
+		}
+		fi->fh = (uintptr_t)h;
+
+		// The size reported is zero; reads must reach here regardless.
+		fi->direct_io = 1;
+		if(fuse_reply_open(req, fi) != 0)
+			cor_handle_destroy(h);
+		return;
+	}
+
+	// Not there yet is fine; it is opened once its first pieces are.
+	snprintf(fpath, sizeof(fpath), "%s/%s", COR_DATA->root, n->torrent->meta->strings + n->file->path_off);
+	fd = open(fpath, O_RDONLY);
+	if(fd < 0 && errno != ENOENT)
+	{
+		cor_ll_reply_err(req, errno);
+		return;
+	}
+
+	h = cor_handle_create(n, fd);
+	if(h == NULL)
+	{
+		if(fd >= 0)
+			close(fd);
+		cor_ll_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uintptr_t)h;
+
+	// Reads only ever return verified data, which never changes, so the
+	// kernel may keep what it has cached across opens.
+	fi->keep_cache = 1;
+
+	cor_prefetch(h);
+	if(fuse_reply_open(req, fi) != 0)
+	{
+		// Interrupted; there won't be a release.
+		if(h->fd >= 0)
+			close(h->fd);
+		cor_handle_destroy(h);
+	}
+}
+static void cor_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	struct cor_handle* h = COR_HANDLE(fi);
+	struct fuse_bufvec* bufv;
+	uint64_t start;
+	int stat = 0;
+
+	bufv = cor_handle_read_buf(h, req, size, offset, &stat);
+	if(bufv == NULL)
+	{
+		if(h->file != NULL)
+			COR_LOG(LOG_WARNING, "Failed to read from file %s.", h->torrent->meta->strings + h->file->path_off);
+		cor_ll_reply_err(req, -stat);
+		return;
+	}
+
+	// Verified pieces never change, so the pages may be moved rather
+	// than copied. Spliced from the backing file, this is where it is
+	// actually read.
+	start = cor_stat_clock();
+	stat = fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	if(bufv->buf[0].flags & FUSE_BUF_IS_FD)
+		cor_stat_record(COR_OP_DISK, start, stat != 0);
+	cor_bufvec_free(bufv);
+}
+static void cor_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct cor_handle* h = COR_HANDLE(fi);
+
+	if(h->fd >= 0)
+		close(h->fd);
+	cor_handle_destroy(h);
+	fi->fh = 0;
+	cor_ll_reply_err(req, 0);
+}
+static void cor_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+
+	if(n == NULL || !COR_NODE_DIR(n))
+	{
+		cor_ll_reply_err(req, (n == NULL) ? ENOENT : ENOTDIR);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+// Lists the directory |ino| from entry |offset| on: ".", "..", then the
+// children in name order. An entry's offset is its position plus one.
+static void cor_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+	struct cor_node* c;
+	struct stat st;
+	char name[NAME_MAX + 1];
+	char* buf;
+	size_t used = 0;
+	size_t len;
+	off_t i;
+
+	if(n == NULL || !COR_NODE_DIR(n))
+	{
+		cor_ll_reply_err(req, (n == NULL) ? ENOENT : ENOTDIR);
+		return;
+	}
+
+	buf = malloc(size);
+	if(buf == NULL)
+	{
+		cor_ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	memset(&st, 0, sizeof(struct stat));
+	for(i = offset; i < (off_t)n->num_children + 2; i++)
+	{
+		if(i < 2)
+		{
+			c = (i == 0) ? n : n->parent;
+			strcpy(name, (i == 0) ? "." : "..");
+		}
+		else
+		{
+			c = n->children[i - 2];
+			if(c->namelen > NAME_MAX)
+				continue;
+			memcpy(name, c->name, c->namelen);
+			name[c->namelen] = '\0';
+		}
+
+		// Only the inode and type are passed on here.
+		st.st_ino = c->ino;
+		st.st_mode = COR_NODE_DIR(c) ? S_IFDIR : S_IFREG;
+		len = fuse_add_direntry(req, buf + used, size - used, name, &st, i + 1);
+		if(len > size - used)
+			break;
+		used += len;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+// Only torrent files have attributes here, the COR_XATTR_PREFIX ones.
+static void cor_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+	char* value = NULL;
+	int stat;
+
+	if(n == NULL)
+	{
+		cor_ll_reply_err(req, ENOENT);
+		return;
+	}
+	if(n->file == NULL)
+	{
+		cor_ll_reply_err(req, ENODATA);
+		return;
+	}
+
+	if(size > 0)
+	{
+		value = malloc(size);
+		if(value == NULL)
+		{
+			cor_ll_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	stat = cor_progress_getxattr(n->torrent, n->file, name, value, size);
+	if(stat < 0)
+		cor_ll_reply_err(req, -stat);
+	else if(size == 0)
+		fuse_reply_xattr(req, stat);
+	else
+		fuse_reply_buf(req, value, stat);
+	free(value);
+}
+static void cor_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	struct cor_node* n = cor_ns_node(COR_DATA->ns, ino);
+	char* list = NULL;
+	int stat = 0;
+
+	if(n == NULL)
+	{
+		cor_ll_reply_err(req, ENOENT);
+		return;
+	}
+
+	if(size > 0)
+	{
+		list = malloc(size);
+		if(list == NULL)
+		{
+			cor_ll_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	if(n->file != NULL && n->torrent->progress != NULL)
+		stat = cor_progress_listxattr(list, size);
+	if(stat < 0)
+		cor_ll_reply_err(req, -stat);
+	else if(size == 0)
+		fuse_reply_xattr(req, stat);
+	else
+		fuse_reply_buf(req, list, stat);
+	free(list);
+}
+static void cor_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	if(statvfs(COR_DATA->root, &st) < 0)
+		cor_ll_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+#define COR_LL_TIMED(fn, op, params, args) \
+	static void fn##_timed params \
+	{ \
+		uint64_t start = cor_stat_clock(); \
+		cor_ll_failed = 0; \
+		fn args; \
+		cor_stat_record((op), start, cor_ll_failed); \
+	}
+
+COR_LL_TIMED(cor_ll_lookup, COR_OP_LOOKUP, (fuse_req_t req, fuse_ino_t parent, const char* name), (req, parent, name))
+COR_LL_TIMED(cor_ll_forget, COR_OP_FORGET, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup))
+COR_LL_TIMED(cor_ll_getattr, COR_OP_GETATTR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+COR_LL_TIMED(cor_ll_access, COR_OP_ACCESS, (fuse_req_t req, fuse_ino_t ino, int mask), (req, ino, mask))
+COR_LL_TIMED(cor_ll_open, COR_OP_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+COR_LL_TIMED(cor_ll_read, COR_OP_READ, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi), (req, ino, size, offset, fi))
+COR_LL_TIMED(cor_ll_release, COR_OP_RELEASE, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+COR_LL_TIMED(cor_ll_opendir, COR_OP_OPENDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+COR_LL_TIMED(cor_ll_readdir, COR_OP_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi), (req, ino, size, offset, fi))
+COR_LL_TIMED(cor_ll_statfs, COR_OP_STATFS, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+COR_LL_TIMED(cor_ll_getxattr, COR_OP_GETXATTR, (fuse_req_t req, fuse_ino_t ino, const char* name, size_t size), (req, ino, name, size))
+COR_LL_TIMED(cor_ll_listxattr, COR_OP_LISTXATTR, (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size))
+
+static struct fuse_lowlevel_ops cor_ll_ops =
+{
+  .init = cor_ll_init,
+  .destroy = cor_destroy,
+  .lookup = cor_ll_lookup_timed,
+  .forget = cor_ll_forget_timed,
+  .getattr = cor_ll_getattr_timed,
+  .open = cor_ll_open_timed,
+  .read = cor_ll_read_timed,
+  .release = cor_ll_release_timed,
+  .opendir = cor_ll_opendir_timed,
+  .readdir = cor_ll_readdir_timed,
+  .statfs = cor_ll_statfs_timed,
+  .access = cor_ll_access_timed,
+  .getxattr = cor_ll_getxattr_timed,
+  .listxattr = cor_ll_listxattr_timed,
 };
 
+// Worker pool serving one session.
+struct cor_pool
+{
+	struct fuse_session* se;
+	sem_t finished;
+	int error;
+};
+
+static void* cor_worker(void* arg)
+{
+	struct cor_pool* pool = arg;
+	struct fuse_chan* ch = fuse_session_next_chan(pool->se, NULL);
+	struct fuse_chan* rch;
+	struct fuse_buf fbuf;
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char* mem;
+	int res;
+
+	mem = malloc(bufsize);
+	if(mem == NULL)
+	{
+		fuse_session_exit(pool->se);
+		pool->error = 1;
+		sem_post(&pool->finished);
+		return NULL;
+	}
+
+	// A worker cancelled in fuse_session_receive_buf() never gets to the
+	// end, so the buffer is also freed on the way out of a cancel.
+	pthread_cleanup_push(free, mem);
+	while(!fuse_session_exited(pool->se))
+	{
+		// Only ever cancelled while idle, so that no request is left
+		// half-answered with locks held.
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		memset(&fbuf, 0, sizeof(struct fuse_buf));
+		fbuf.mem = mem;
+		fbuf.size = bufsize;
+		rch = ch;
+		res = fuse_session_receive_buf(pool->se, &fbuf, &rch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if(res == -EINTR)
+			continue;
+		if(res <= 0)
+		{
+			if(res < 0)
+				pool->error = 1;
+			fuse_session_exit(pool->se);
+			break;
+		}
+		fuse_session_process_buf(pool->se, &fbuf, rch);
+	}
+	pthread_cleanup_pop(1);
+
+	sem_post(&pool->finished);
+	return NULL;
+}
+
+// Serves |se| on |workers| threads until it is unmounted or a signal
+// ends it. Every request runs start to finish on whichever thread read
+// it, so one blocked on a missing piece holds up nothing but itself.
+//
+// RETURNS
+// Zero on a clean exit, -1 otherwise.
+static int cor_serve(struct fuse_session* se, int workers)
+{
+	struct cor_pool pool;
+	pthread_t* threads;
+	sigset_t all;
+	sigset_t old;
+	int started = 0;
+	int i;
+
+	if(workers <= 1)
+		return fuse_session_loop(se);
+
+	threads = calloc(workers, sizeof(pthread_t));
+	if(threads == NULL)
+		return fuse_session_loop(se);
+
+	pool.se = se;
+	pool.error = 0;
+	sem_init(&pool.finished, 0, 0);
+
+	// Signals are left to this thread, which does nothing but wait.
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i = 0; i < workers; i++)
+	{
+		if(pthread_create(&threads[started], NULL, cor_worker, &pool) == 0)
+			started++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if(started == 0)
+	{
+		free(threads);
+		sem_destroy(&pool.finished);
+		return fuse_session_loop(se);
+	}
+	COR_LOG(LOG_INFO, "Serving on %d threads.", started);
+
+	while(!fuse_session_exited(se))
+		sem_wait(&pool.finished);
+
+	// Send reads waiting on pieces home, then take down whoever is still
+	// blocked reading the device.
+	__atomic_store_n(&COR_DATA->stopping, 1, __ATOMIC_RELEASE);
+	cor_wake_all();
+
+	for(i = 0; i < started; i++)
+		pthread_cancel(threads[i]);
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	sem_destroy(&pool.finished);
+	return pool.error ? -1 : 0;
+}
+
+// Mounts on the path API and serves requests until unmounted.
+//
+// RETURNS
+// Zero after a clean unmount, nonzero if the mount couldn't be set up.
+static int cor_path_main(struct fuse_args* args, struct cor_state* state)
+{
+	struct fuse* f;
+	char* mountpoint;
+	int multithreaded;
+	int err;
+
+	f = fuse_setup(args->argc, args->argv, &cor_ops, sizeof(cor_ops), &mountpoint, &multithreaded, state);
+	if(f == NULL)
+		return 1;
+
+	err = cor_serve(fuse_get_session(f), multithreaded ? state->workers : 1);
+	fuse_teardown(f, mountpoint);
+
+	return err ? 1 : 0;
+}
+
+// Mounts on the low-level API and serves requests until unmounted.
+//
+// RETURNS
+// Zero after a clean unmount, nonzero if the mount couldn't be set up.
+static int cor_ll_main(struct fuse_args* args, struct cor_state* state)
+{
+	struct fuse_chan* ch;
+	struct fuse_session* se;
+	char* mountpoint = NULL;
+	int multithreaded;
+	int foreground;
+	int err = -1;
+
+	if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) < 0)
+		return 1;
+
+	ch = fuse_mount(mountpoint, args);
+	if(ch != NULL)
+	{
+		se = fuse_lowlevel_new(args, &cor_ll_ops, sizeof(cor_ll_ops), state);
+		if(se != NULL)
+		{
+			if(fuse_set_signal_handlers(se) == 0)
+			{
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = cor_serve(se, multithreaded ? state->workers : 1);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+
+	return err ? 1 : 0;
+}
+
 int main(int argc, char* argv[])
 {
   // Init empty arguments list.
   struct cor_state* state;
+  struct stat st;
   struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  int i;
+
+  cor_log_init(getenv("CORSAIR_LOG"), cor_env_count("CORSAIR_LOG_LEVEL", LOG_INFO));
 
   // Make sure executing user isn't being an idiot.
   if((getuid() == 0) || (geteuid() == 0))
   {
-	  fprintf(stderr, "Mounting a CorsairFS volume as root "
-			  	  	  "poses a massive security vulnerability.\n");
+	  COR_LOG(LOG_ERR, "Mounting a CorsairFS volume as root poses a massive security vulnerability.");
 	  return 1;
   }
 
@@ -607,15 +2589,64 @@ int main(int argc, char* argv[])
     return 1;
   }
 
-  state = malloc(sizeof(struct cor_state));
+  state = calloc(1, sizeof(struct cor_state));
   state->root = realpath(argv[1], NULL);
   state->torrent = realpath(argv[2], NULL);
+  state->cache = cor_cache_dir();
+  state->prefetch_head = cor_env_count("CORSAIR_PREFETCH_HEAD", COR_PREFETCH_HEAD);
+  state->prefetch_tail = cor_env_count("CORSAIR_PREFETCH_TAIL", COR_PREFETCH_TAIL);
+  state->workers = cor_env_count("CORSAIR_THREADS", COR_WORKERS);
+  state->status_interval = cor_env_count("CORSAIR_STATUS_MS", COR_STATUS_INTERVAL);
+  state->pieces = cor_cache_create((size_t)cor_env_count("CORSAIR_PIECE_CACHE_MB", COR_PIECE_CACHE_MB) * 1024 * 1024);
+
+  // Resolve torrent metadata before mounting so that a bad .torrent is
+  // reported here rather than from inside the mount. A directory is
+  // imported as a library, decoding its torrents in parallel.
+  if(state->torrent != NULL && stat(state->torrent, &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    state->num_torrents = cor_import_dir(state->torrent, state->cache, 0, &state->torrents);
+    if(state->num_torrents <= 0)
+    {
+      COR_LOG(LOG_ERR, "No usable torrents in %s.", argv[2]);
+      return 1;
+    }
+  }
+  else
+  {
+    bd_ctx* ctx = bd_ctx_create(BD_ZEROCOPY);
+    state->torrents = calloc(1, sizeof(struct cor_torrent));
+    if(state->torrent != NULL)
+      state->torrents[0].meta = cor_meta_open(ctx, state->torrent, state->cache);
+    bd_ctx_destroy(ctx);
+
+    if(state->torrents[0].meta == NULL)
+    {
+      COR_LOG(LOG_ERR, "Could not load torrent %s.", argv[2]);
+      return 1;
+    }
+    state->torrents[0].path = strdup(state->torrent);
+    state->torrents[0].params = cor_tor_parse(state->torrent);
+    state->torrents[0].handle = NULL;
+    state->num_torrents = 1;
+  }
+
+  for(i = 0; i < COR_WAIT_QUEUES; i++)
+  {
+    pthread_mutex_init(&state->waitq[i].lock, NULL);
+    pthread_cond_init(&state->waitq[i].cond, NULL);
+  }
 
   fuse_opt_add_arg(&args, argv[0]);
   fuse_opt_add_arg(&args, argv[1]);
 
+  cor_self = state;
+
   int x;
-  x = fuse_main(args.argc, args.argv, &cor_ops, state);
+  if(cor_env_count("CORSAIR_LOWLEVEL", COR_LOWLEVEL))
+    x = cor_ll_main(&args, state);
+  else
+    x = cor_path_main(&args, state);
+  fuse_opt_free_args(&args);
 
   printf("%d", x);
 
@@ -0,0 +1,428 @@
+#ifndef CORSAIR_H_
+#define CORSAIR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include "bdecode.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* * * * * * * * * * * * * * * *
+ * COMPILED TORRENT METADATA  *
+ * * * * * * * * * * * * * * * */
+
+// A torrent's metadata flattened into a single position-independent
+// image: a header, the file table, the packed piece hashes and the path
+// strings. The image is written to the cache directory under a key
+// derived from the .torrent's path and mmapped straight back on later
+// mounts, so a remount doesn't decode the .torrent to build the
+// namespace. The |source_*| fields identify the file it was compiled
+// from; the image is stale once they no longer match.
+//
+// This does not make a remount cheap. The session still needs
+// libtorrent's own parse of every .torrent (see cor_tor_parse()), which
+// reads, decodes and hashes the whole file again, and that parse is
+// now most of the cost of a warm mount.
+//
+// The image is in host byte order; it is a local cache, not an exchange
+// format.
+#define COR_META_MAGIC "CORMETA"
+#define COR_META_VERSION 2
+
+struct cor_meta_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_files;
+	uint64_t total_size;
+	uint64_t image_size;
+	uint32_t piece_length;
+	uint32_t num_pieces;
+	unsigned char infohash[20];
+	uint32_t name_off;
+
+	uint64_t source_dev;
+	uint64_t source_ino;
+	uint64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+
+	uint64_t files_off;
+	uint64_t hashes_off;
+	uint64_t strings_off;
+};
+
+// One file of the torrent. |offset| is where the file starts within the
+// torrent's concatenated data; |path_off| indexes the null-terminated
+// path, relative to the save path, in the string table.
+struct cor_meta_file
+{
+	uint64_t offset;
+	uint64_t length;
+	uint32_t path_off;
+	uint32_t path_len;
+};
+
+struct cor_meta
+{
+	struct cor_meta_header* hdr;
+	struct cor_meta_file* files;
+	unsigned char* hashes;
+	char* strings;
+
+	void* image;
+	int mapped;
+};
+
+struct cor_meta* cor_meta_compile(bd_dict* root, const unsigned char infohash[20]);
+struct cor_meta* cor_meta_load(const char* cache_dir, const unsigned char key[20], const struct stat* source);
+int cor_meta_save(struct cor_meta* meta, const char* cache_dir, const unsigned char key[20]);
+struct cor_meta* cor_meta_open(bd_ctx* ctx, const char* torrent, const char* cache_dir);
+void cor_meta_free(struct cor_meta* meta);
+
+/* * * * * * * * * * * * * * * *
+ *        TORRENT IMPORT        *
+ * * * * * * * * * * * * * * * */
+
+// A torrent served by the mount. |params| is what cor_tor_parse() made
+// of it at import, until it is added to the session; from then on it is
+// NULL and |handle| is the session's torrent, for the cor_tor_*
+// extensions below, or NULL if the session refused it. |have| has a bit
+// set for each piece known to be downloaded and verified, or is NULL
+// until the torrent is added. |progress| follows it file by file, or is
+// NULL along with it.
+//
+// |wanted| counts, for each piece, the readahead windows, prefetches and
+// waiting reads that asked for it, under |want_lock|. A piece is only
+// handed back to the normal download order once nothing counts it; if
+// it is NULL, pieces are never handed back.
+struct cor_torrent
+{
+	char* path;
+	struct cor_meta* meta;
+	void* params;
+	void* handle;
+	uint64_t* have;
+	struct cor_file_progress* progress;
+	uint32_t* wanted;
+	pthread_mutex_t want_lock;
+};
+
+int cor_import_dir(const char* dir, const char* cache_dir, int threads, struct cor_torrent** torrents);
+
+/* * * * * * * * * * * * * * * *
+ *            LOGGING           *
+ * * * * * * * * * * * * * * * */
+
+// Levels are syslog's, LOG_EMERG through LOG_DEBUG. A line less severe
+// than the threshold costs a compare and nothing else.
+#define COR_LOG(level, ...) \
+	do { if((level) <= cor_log_threshold) cor_log_write((level), __VA_ARGS__); } while(0)
+
+extern int cor_log_threshold;
+
+void cor_log_init(const char* sink, int threshold);
+int cor_log_start();
+void cor_log_stop();
+void cor_log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* * * * * * * * * * * * * * * *
+ *          STATISTICS          *
+ * * * * * * * * * * * * * * * */
+
+// What is timed: each filesystem op, whichever API it came in through,
+// and the two things a read spends its time on besides itself, waiting
+// for pieces and reading the backing files.
+enum cor_op
+{
+	COR_OP_GETATTR,
+	COR_OP_READLINK,
+	COR_OP_MKNOD,
+	COR_OP_MKDIR,
+	COR_OP_UNLINK,
+	COR_OP_RMDIR,
+	COR_OP_SYMLINK,
+	COR_OP_RENAME,
+	COR_OP_LINK,
+	COR_OP_CHMOD,
+	COR_OP_TRUNCATE,
+	COR_OP_UTIME,
+	COR_OP_OPEN,
+	COR_OP_READ,
+	COR_OP_WRITE,
+	COR_OP_STATFS,
+	COR_OP_FLUSH,
+	COR_OP_RELEASE,
+	COR_OP_FSYNC,
+	COR_OP_SETXATTR,
+	COR_OP_GETXATTR,
+	COR_OP_LISTXATTR,
+	COR_OP_REMOVEXATTR,
+	COR_OP_OPENDIR,
+	COR_OP_READDIR,
+	COR_OP_RELEASEDIR,
+	COR_OP_FSYNCDIR,
+	COR_OP_ACCESS,
+	COR_OP_CREATE,
+	COR_OP_FTRUNCATE,
+	COR_OP_FGETATTR,
+	COR_OP_LOOKUP,
+	COR_OP_FORGET,
+	COR_OP_PIECE_WAIT,
+	COR_OP_DISK,
+	COR_OP_COUNT
+};
+
+uint64_t cor_stat_clock();
+void cor_stat_record(int op, uint64_t start, int failed);
+char* cor_stat_render(size_t* len);
+
+/* * * * * * * * * * * * * * * *
+ *       STATUS SNAPSHOTS       *
+ * * * * * * * * * * * * * * * */
+
+// The session's status and that of its torrents, sampled in the
+// background so that reading it never waits on the session.
+struct cor_status;
+
+struct cor_status* cor_status_create(void* session, struct cor_torrent* torrents, int num_torrents, int interval);
+int cor_status_start(struct cor_status* st);
+void cor_status_destroy(struct cor_status* st);
+char* cor_status_session(struct cor_status* st, size_t* len);
+char* cor_status_torrents(struct cor_status* st, size_t* len);
+
+/* * * * * * * * * * * * * * * *
+ *         PIECE BITMAP         *
+ * * * * * * * * * * * * * * * */
+
+// Bitmaps shared between threads without locks. Bits are only ever set,
+// and every access is a single atomic operation on a 64-bit word.
+uint64_t* cor_bits_create(uint32_t num_bits);
+int cor_bits_set(uint64_t* bits, uint32_t i);
+int cor_bits_test(const uint64_t* bits, uint32_t i);
+uint32_t cor_bits_count(const uint64_t* bits, uint32_t first, uint32_t last);
+int cor_bits_all(const uint64_t* bits, uint32_t first, uint32_t last);
+uint32_t cor_bits_find(const uint64_t* bits, uint32_t first, uint32_t last, int set);
+
+/* * * * * * * * * * * * * * * *
+ *         FILE PROGRESS        *
+ * * * * * * * * * * * * * * * */
+
+// How much of one file of a torrent is verified, in pieces overlapping
+// it and in bytes. Counted up as pieces come in rather than worked out
+// from the bitmap when asked.
+//
+// |map| is the file's present ranges as last rendered, and |map_have|
+// what |have| was then; it is only rendered again once |have| moves on.
+struct cor_file_progress
+{
+	uint32_t have;
+	uint64_t done;
+
+	pthread_mutex_t lock;
+	uint32_t map_have;
+	char* map;
+	size_t map_len;
+};
+
+// Extended attributes every torrent file has, under this prefix.
+#define COR_XATTR_PREFIX "user.corsair."
+
+struct cor_file_progress* cor_progress_create(struct cor_torrent* t);
+void cor_progress_free(struct cor_torrent* t);
+void cor_progress_piece(struct cor_torrent* t, uint32_t piece);
+int cor_progress_getxattr(struct cor_torrent* t, struct cor_meta_file* f, const char* name, char* value, size_t size);
+int cor_progress_listxattr(char* list, size_t size);
+
+/* * * * * * * * * * * * * * * *
+ *           NAMESPACE          *
+ * * * * * * * * * * * * * * * */
+
+// The control directory at the root of the mount, and the files in it.
+// These report on the daemon itself and are rendered when opened.
+#define COR_CTL_NAME ".corsair"
+
+enum cor_ctl
+{
+	COR_CTL_NONE,
+	COR_CTL_DIR,
+	COR_CTL_STATS,
+	COR_CTL_SESSION,
+	COR_CTL_TORRENTS,
+	COR_CTL_COUNT
+};
+
+// One file or directory of the mount, synthesized from the torrents'
+// file tables. |name| points into the owning metadata's string table
+// and is NOT null-terminated. Directories have a NULL |file| and keep
+// their |children| sorted by name; |num_dirs| of those are directories.
+// Nodes of the control directory have |ctl| set instead.
+struct cor_node
+{
+	const char* name;
+	uint32_t namelen;
+	uint32_t num_children;
+	uint32_t num_dirs;
+	struct cor_node* parent;
+	struct cor_node** children;
+	struct cor_torrent* torrent;
+	struct cor_meta_file* file;
+	int ctl;
+	uint64_t ino;
+
+	// References the kernel holds through the low-level API: added to by
+	// every entry handed out, dropped by forget.
+	uint64_t nlookup;
+};
+
+// The whole tree. |nodes[0]| is the root, and a node's inode number is
+// its index plus one.
+struct cor_ns
+{
+	struct cor_node* nodes;
+	size_t num_nodes;
+	struct cor_node** links;
+};
+
+#define COR_NODE_DIR(n) ((n)->file == NULL && (n)->ctl <= COR_CTL_DIR)
+
+struct cor_ns* cor_ns_build(struct cor_torrent* torrents, int num_torrents);
+void cor_ns_free(struct cor_ns* ns);
+struct cor_node* cor_ns_child(struct cor_node* dir, const char* name, size_t len);
+struct cor_node* cor_ns_lookup(struct cor_ns* ns, const char* path);
+struct cor_node* cor_ns_node(struct cor_ns* ns, uint64_t ino);
+
+/* * * * * * * * * * * * * * * *
+ *          PIECE CACHE         *
+ * * * * * * * * * * * * * * * */
+
+// Bounded LRU cache of verified pieces, sharded by piece. Pieces are
+// identified by the torrent's index in the mount and their number.
+//
+// Entries are never invalidated. Only verified pieces are cached, the
+// session never rewrites a piece once it has passed its hash check, and
+// torrent files can't be written or truncated through the mount.
+//
+// Pieces are cached by the read that first misses on them, not when
+// they finish downloading. Most pieces of a torrent are never read
+// through the mount, and loading each one as it arrived would put a
+// disk read on the alert pump and evict pieces that are being read.
+struct cor_cache;
+
+struct cor_cache* cor_cache_create(size_t budget);
+void cor_cache_destroy(struct cor_cache* cache);
+long cor_cache_read(struct cor_cache* cache, uint32_t torrent, uint32_t piece, size_t offset, char* dst, size_t len);
+int cor_cache_insert(struct cor_cache* cache, uint32_t torrent, uint32_t piece, const char* data, size_t len);
+int cor_cache_fits(struct cor_cache* cache, size_t len);
+void cor_cache_stats(struct cor_cache* cache, uint64_t* hits, uint64_t* misses, size_t* used);
+
+/* * * * * * * * * * * * * * * *
+ *       OPEN FILE HANDLES      *
+ * * * * * * * * * * * * * * * */
+
+// Per-open state, kept in fi->fh. Everything a read needs to know about
+// the file is resolved once at open; |torrent| and |file| are NULL for
+// files that don't belong to a torrent. Control files are rendered into
+// |text| at open instead, so every read of one handle sees the same
+// contents.
+struct cor_handle
+{
+	// Backing file, or -1 until it is first needed if the torrent hadn't
+	// created it yet when the handle was opened.
+	int fd;
+	struct cor_node* node;
+	struct cor_torrent* torrent;
+	struct cor_meta_file* file;
+
+	// Where the file starts within the torrent's data, and the pieces it
+	// spans.
+	uint64_t base;
+	int first_piece;
+	int last_piece;
+
+	// Pieces already known to be verified, packed as first << 32 | last
+	// so that concurrent reads always see a consistent range. Pieces are
+	// never lost once verified, so reads inside it skip the piece checks.
+	uint64_t ready;
+
+	// Access pattern and statistics, under |lock|. |next_offset| is where
+	// a read continuing the previous one would start and |streak| how
+	// many reads in a row have done so.
+	pthread_mutex_t lock;
+	off_t next_offset;
+	int streak;
+	uint64_t reads;
+	uint64_t bytes_read;
+
+	// Readahead, also under |lock|. While the handle reads sequentially
+	// the |window| pieces past the read position are kept requested, up
+	// to |ahead|, the last piece asked for so far. |rate| is the smoothed
+	// consumption rate in bytes per second, last sampled at |stamp|.
+	// [claim_first, claim_last] are the pieces the window counts in the
+	// torrent's |wanted|; none if claim_first > claim_last.
+	int window;
+	int ahead;
+	double rate;
+	double stamp;
+	int claim_first;
+	int claim_last;
+
+	// Pieces at the start and end of the file counted by cor_prefetch()
+	// until the handle is closed: up to |prefetch_head| and from
+	// |prefetch_tail| on.
+	int prefetch_head;
+	int prefetch_tail;
+
+	// When the handle was opened, for time-to-first-byte.
+	double opened;
+
+	char* text;
+	size_t text_len;
+};
+
+#define COR_HANDLE(fi) ((struct cor_handle*)(uintptr_t)(fi)->fh)
+#define COR_READY_NONE (((uint64_t)1 << 32) | 0)
+
+/* * * * * * * * * * * * * * * *
+ *    SESSION EXTENSIONS (C++)  *
+ * * * * * * * * * * * * * * * */
+
+struct torrent_status;
+
+void* cor_tor_parse(const char* path);
+void cor_tor_discard(void* params);
+void* cor_tor_add(void* ses, void* params, const char* save_path);
+void cor_tor_release(void* tor);
+int cor_tor_have_piece(void* tor, int piece);
+int cor_tor_have_pieces(void* tor, uint64_t* bits, int num_pieces);
+int cor_tor_status(void* tor, struct torrent_status* out);
+int cor_tor_want_pieces(void* tor, int first, int last, int deadline, int step);
+int cor_tor_unwant_pieces(void* tor, int first, int last);
+
+// What cor_tor_pump_alerts() passes on: a piece of the torrent passed
+// its hash check, a piece failed it and has to be downloaded again, or
+// something went wrong with the torrent, described by |message|.
+enum cor_alert_type
+{
+	COR_ALERT_PIECE,
+	COR_ALERT_HASH_FAILED,
+	COR_ALERT_ERROR
+};
+typedef void (*cor_alert_fn)(void* arg, int type, const unsigned char infohash[20], int piece, const char* message);
+
+int cor_tor_pump_alerts(void* ses, int timeout, cor_alert_fn fn, void* arg);
+void cor_tor_wake(void* ses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
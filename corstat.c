@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "corsair.h"
+
+// Latencies are kept in nanoseconds, in buckets of logarithmic width:
+// each power of two is split into 2^COR_STAT_SUB_BITS equal parts, so a
+// bucket is never more than 12.5% wide. Values below 2^COR_STAT_SUB_BITS
+// get a bucket each, and anything from 2^COR_STAT_MAX_BITS ns (about 18
+// minutes) up lands in the last.
+#define COR_STAT_SUB_BITS 3
+#define COR_STAT_SUB (1 << COR_STAT_SUB_BITS)
+#define COR_STAT_MAX_BITS 40
+#define COR_STAT_BUCKETS ((COR_STAT_MAX_BITS - COR_STAT_SUB_BITS + 1) * COR_STAT_SUB)
+
+static char const* cor_stat_names[COR_OP_COUNT] =
+{
+	"getattr",
+	"readlink",
+	"mknod",
+	"mkdir",
+	"unlink",
+	"rmdir",
+	"symlink",
+	"rename",
+	"link",
+	"chmod",
+	"truncate",
+	"utime",
+	"open",
+	"read",
+	"write",
+	"statfs",
+	"flush",
+	"release",
+	"fsync",
+	"setxattr",
+	"getxattr",
+	"listxattr",
+	"removexattr",
+	"opendir",
+	"readdir",
+	"releasedir",
+	"fsyncdir",
+	"access",
+	"create",
+	"ftruncate",
+	"fgetattr",
+	"lookup",
+	"forget",
+	"piece_wait",
+	"disk",
+};
+
+struct cor_stat_hist
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[COR_STAT_BUCKETS];
+};
+
+// The counters of one thread. Only the owner writes them, so recording
+// is plain loads and stores; readers merge every thread's block.
+struct cor_stat_block
+{
+	struct cor_stat_block* next;
+	struct cor_stat_hist ops[COR_OP_COUNT];
+};
+
+static struct cor_stat_block* cor_stat_blocks;
+static __thread struct cor_stat_block* cor_stat_mine;
+
+static inline int cor_stat_bucket(uint64_t ns)
+{
+	int msb;
+
+	if(ns < COR_STAT_SUB)
+		return ns;
+	if(ns >= (uint64_t)1 << COR_STAT_MAX_BITS)
+		return COR_STAT_BUCKETS - 1;
+
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - COR_STAT_SUB_BITS + 1) * COR_STAT_SUB) + ((ns >> (msb - COR_STAT_SUB_BITS)) & (COR_STAT_SUB - 1));
+}
+
+// RETURNS
+// The smallest value that falls in bucket |i|.
+static uint64_t cor_stat_bucket_floor(int i)
+{
+	if(i < COR_STAT_SUB)
+		return i;
+	return (uint64_t)(COR_STAT_SUB + (i % COR_STAT_SUB)) << ((i / COR_STAT_SUB) - 1);
+}
+
+// Adds |n| to a counter only the calling thread writes. The atomics keep
+// readers on other threads from seeing torn values; there is no
+// read-modify-write to pay for.
+static inline void cor_stat_add(uint64_t* c, uint64_t n)
+{
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// RETURNS
+// A monotonic timestamp in nanoseconds, to pass to cor_stat_record().
+uint64_t cor_stat_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// Records one |op| that started at |start|, from cor_stat_clock(), and
+// ended now. |failed| is nonzero if it returned an error.
+void cor_stat_record(int op, uint64_t start, int failed)
+{
+	struct cor_stat_block* b = cor_stat_mine;
+	struct cor_stat_hist* hist;
+	uint64_t ns = cor_stat_clock() - start;
+
+	if(b == NULL)
+	{
+		b = calloc(1, sizeof(struct cor_stat_block));
+		if(b == NULL)
+			return;
+		b->next = __atomic_load_n(&cor_stat_blocks, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&cor_stat_blocks, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		cor_stat_mine = b;
+	}
+
+	hist = &b->ops[op];
+	cor_stat_add(&hist->count, 1);
+	if(failed)
+		cor_stat_add(&hist->errors, 1);
+	cor_stat_add(&hist->total, ns);
+	if(ns > __atomic_load_n(&hist->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+	cor_stat_add(&hist->buckets[cor_stat_bucket(ns)], 1);
+}
+
+// RETURNS
+// The smallest value at least |q| of the samples of |hist| are at or
+// under, to the width of a bucket.
+static uint64_t cor_stat_quantile(struct cor_stat_hist* hist, double q)
+{
+	uint64_t want = (uint64_t)((hist->count * q) + 0.5);
+	uint64_t seen = 0;
+	uint64_t top;
+	int i;
+
+	if(want == 0)
+		want = 1;
+	for(i = 0; i < COR_STAT_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if(seen >= want)
+		{
+			top = (i + 1 < COR_STAT_BUCKETS) ? cor_stat_bucket_floor(i + 1) - 1 : hist->max;
+			return (top < hist->max) ? top : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+// Merges every thread's counters and renders them as text, one line per
+// op:
+//
+//   <op> count=<n> errors=<n> sum_ns=<n> max_ns=<n> p50_ns=<n> p90_ns=<n>
+//        p99_ns=<n> p999_ns=<n> buckets=<floor_ns>:<n>,...
+//
+// all on one line, with only the buckets that have samples listed.
+//
+// RETURNS
+// The text, |*len| bytes of it, to be freed, or NULL if memory ran out.
+char* cor_stat_render(size_t* len)
+{
+	struct cor_stat_hist* merged;
+	struct cor_stat_hist* from;
+	struct cor_stat_hist* hist;
+	struct cor_stat_block* b;
+	uint64_t max;
+	char* text = NULL;
+	FILE* f;
+	int sep;
+	int op;
+	int i;
+
+	merged = calloc(COR_OP_COUNT, sizeof(struct cor_stat_hist));
+	if(merged == NULL)
+		return NULL;
+
+	for(b = __atomic_load_n(&cor_stat_blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+	{
+		for(op = 0; op < COR_OP_COUNT; op++)
+		{
+			from = &b->ops[op];
+			hist = &merged[op];
+			hist->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+			hist->errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+			hist->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+			max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+			hist->max = (max > hist->max) ? max : hist->max;
+			for(i = 0; i < COR_STAT_BUCKETS; i++)
+				hist->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+		}
+	}
+
+	f = open_memstream(&text, len);
+	if(f == NULL)
+	{
+		free(merged);
+		return NULL;
+	}
+
+	for(op = 0; op < COR_OP_COUNT; op++)
+	{
+		hist = &merged[op];
+		fprintf(f, "%s count=%llu errors=%llu sum_ns=%llu max_ns=%llu", cor_stat_names[op],
+				(unsigned long long)hist->count, (unsigned long long)hist->errors,
+				(unsigned long long)hist->total, (unsigned long long)hist->max);
+		fprintf(f, " p50_ns=%llu p90_ns=%llu p99_ns=%llu p999_ns=%llu buckets=",
+				(unsigned long long)cor_stat_quantile(hist, 0.5), (unsigned long long)cor_stat_quantile(hist, 0.9),
+				(unsigned long long)cor_stat_quantile(hist, 0.99), (unsigned long long)cor_stat_quantile(hist, 0.999));
+
+		sep = 0;
+		for(i = 0; i < COR_STAT_BUCKETS; i++)
+		{
+			if(hist->buckets[i] == 0)
+				continue;
+			fprintf(f, "%s%llu:%llu", sep ? "," : "", (unsigned long long)cor_stat_bucket_floor(i),
+					(unsigned long long)hist->buckets[i]);
+			sep = 1;
+		}
+		fputc('\n', f);
+	}
+
+	free(merged);
+	if(fclose(f) != 0)
+	{
+		free(text);
+		return NULL;
+	}
+	return text;
+}
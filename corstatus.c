@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <libtorrent.h>
+
+#include "corsair.h"
+
+static char const* cor_status_states[] =
+{
+	"queued_for_checking",
+	"checking_files",
+	"downloading_metadata",
+	"downloading",
+	"finished",
+	"seeding",
+	"allocating",
+	"checking_resume_data",
+};
+
+// One sample of the session and every torrent. |valid| has an entry per
+// torrent, zero where the session had nothing to say about it.
+struct cor_status_snap
+{
+	struct timespec taken;
+	int ses_valid;
+	struct session_status ses;
+	struct torrent_status* tors;
+	char* valid;
+};
+
+// Sampled status of a session, double-buffered. The sampler fills the
+// snapshot that isn't |current| and then flips |current| over, so
+// readers never see a half-written one and never touch the session.
+//
+// Readers pin the snapshot they read with |readers|. The sampler only
+// ever writes a snapshot nobody has pinned; if a reader is still on the
+// old one, that sample is skipped.
+struct cor_status
+{
+	void* session;
+	struct cor_torrent* torrents;
+	int num_torrents;
+	int interval;
+
+	struct cor_status_snap snaps[2];
+	int current;
+	int readers[2];
+
+	pthread_t thread;
+	int running;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+// Creates the status cache of |session|, sampling it and each of
+// |torrents| every |interval| milliseconds once started.
+//
+// RETURNS
+// The cache, or NULL if memory ran out.
+struct cor_status* cor_status_create(void* session, struct cor_torrent* torrents, int num_torrents, int interval)
+{
+	struct cor_status* st;
+	int i;
+
+	st = calloc(1, sizeof(struct cor_status));
+	if(st == NULL)
+		return NULL;
+
+	st->session = session;
+	st->torrents = torrents;
+	st->num_torrents = num_torrents;
+	st->interval = (interval > 0) ? interval : 1;
+	st->current = -1;
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+
+	for(i = 0; i < 2; i++)
+	{
+		st->snaps[i].tors = calloc(num_torrents ? num_torrents : 1, sizeof(struct torrent_status));
+		st->snaps[i].valid = calloc(num_torrents ? num_torrents : 1, 1);
+		if(st->snaps[i].tors == NULL || st->snaps[i].valid == NULL)
+		{
+			cor_status_destroy(st);
+			return NULL;
+		}
+	}
+	return st;
+}
+
+// Takes a sample into the snapshot not being read, then publishes it.
+static void cor_status_sample(struct cor_status* st)
+{
+	struct cor_status_snap* snap;
+	int cur = __atomic_load_n(&st->current, __ATOMIC_SEQ_CST);
+	int next = (cur == 0) ? 1 : 0;
+	int i;
+
+	// A reader that pinned |next| before the last flip is still on it.
+	if(__atomic_load_n(&st->readers[next], __ATOMIC_SEQ_CST) != 0)
+		return;
+
+	snap = &st->snaps[next];
+	clock_gettime(CLOCK_REALTIME, &snap->taken);
+	snap->ses_valid = (session_get_status(st->session, &snap->ses, sizeof(struct session_status)) >= 0);
+	for(i = 0; i < st->num_torrents; i++)
+	{
+		snap->valid[i] = (st->torrents[i].handle != NULL
+				&& cor_tor_status(st->torrents[i].handle, &snap->tors[i]) >= 0);
+	}
+
+	__atomic_store_n(&st->current, next, __ATOMIC_SEQ_CST);
+}
+
+static void* cor_status_sampler(void* arg)
+{
+	struct cor_status* st = arg;
+	struct timespec until;
+
+	pthread_mutex_lock(&st->lock);
+	while(!st->stopping)
+	{
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += st->interval / 1000;
+		until.tv_nsec += (st->interval % 1000) * 1000000L;
+		if(until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		if(pthread_cond_timedwait(&st->cond, &st->lock, &until) != ETIMEDOUT)
+			continue;
+
+		pthread_mutex_unlock(&st->lock);
+		cor_status_sample(st);
+		pthread_mutex_lock(&st->lock);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+// Takes the first sample and starts sampling in the background.
+//
+// PRECONDITION
+// The torrents have been added to the session.
+//
+// RETURNS
+// Zero on success, -1 if the sampler couldn't be started, in which case
+// the first sample is all there will be.
+int cor_status_start(struct cor_status* st)
+{
+	cor_status_sample(st);
+	st->running = (pthread_create(&st->thread, NULL, cor_status_sampler, st) == 0);
+	return st->running ? 0 : -1;
+}
+
+// Stops the sampler and frees |st|.
+void cor_status_destroy(struct cor_status* st)
+{
+	int i;
+
+	if(st == NULL)
+		return;
+
+	if(st->running)
+	{
+		pthread_mutex_lock(&st->lock);
+		st->stopping = 1;
+		pthread_cond_signal(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		pthread_join(st->thread, NULL);
+	}
+
+	for(i = 0; i < 2; i++)
+	{
+		free(st->snaps[i].tors);
+		free(st->snaps[i].valid);
+	}
+	pthread_cond_destroy(&st->cond);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
+
+// RETURNS
+// The latest snapshot, pinned until cor_status_unpin(), or NULL if there
+// has been no sample yet.
+static struct cor_status_snap* cor_status_pin(struct cor_status* st, int* pinned)
+{
+	int cur;
+
+	for(;;)
+	{
+		cur = __atomic_load_n(&st->current, __ATOMIC_SEQ_CST);
+		if(cur < 0)
+			return NULL;
+
+		// Pinning and then finding it still current pairs with the
+		// sampler flipping and then looking for pins, so either it sees
+		// this pin or this sees the flip.
+		__atomic_fetch_add(&st->readers[cur], 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&st->current, __ATOMIC_SEQ_CST) == cur)
+			break;
+		__atomic_fetch_sub(&st->readers[cur], 1, __ATOMIC_SEQ_CST);
+		sched_yield();
+	}
+	*pinned = cur;
+	return &st->snaps[cur];
+}
+static void cor_status_unpin(struct cor_status* st, int pinned)
+{
+	__atomic_fetch_sub(&st->readers[pinned], 1, __ATOMIC_SEQ_CST);
+}
+
+// Finishes the stream |f| writes |*text| through.
+static char* cor_status_close(FILE* f, char** text)
+{
+	if(fclose(f) != 0)
+	{
+		free(*text);
+		return NULL;
+	}
+	return *text;
+}
+
+// Renders the latest sample of the session as "<key>=<value>" lines.
+// |sampled| is when it was taken, in seconds since the epoch; everything
+// else is as libtorrent reports it, rates in bytes per second.
+//
+// RETURNS
+// The text, |*len| bytes of it, to be freed, or NULL if memory ran out.
+char* cor_status_session(struct cor_status* st, size_t* len)
+{
+	struct cor_status_snap* snap;
+	struct session_status* s;
+	char* text = NULL;
+	FILE* f;
+	int pinned;
+
+	f = open_memstream(&text, len);
+	if(f == NULL)
+		return NULL;
+
+	snap = cor_status_pin(st, &pinned);
+	if(snap == NULL)
+		return cor_status_close(f, &text);
+
+	s = &snap->ses;
+	fprintf(f, "sampled=%lld.%03ld\n", (long long)snap->taken.tv_sec, snap->taken.tv_nsec / 1000000);
+	if(snap->ses_valid)
+	{
+		fprintf(f, "has_incoming_connections=%d\n", s->has_incoming_connections);
+		fprintf(f, "download_rate=%.0f\nupload_rate=%.0f\n", s->download_rate, s->upload_rate);
+		fprintf(f, "payload_download_rate=%.0f\npayload_upload_rate=%.0f\n", s->payload_download_rate, s->payload_upload_rate);
+		fprintf(f, "total_download=%lld\ntotal_upload=%lld\n", s->total_download, s->total_upload);
+		fprintf(f, "total_payload_download=%lld\ntotal_payload_upload=%lld\n", s->total_payload_download, s->total_payload_upload);
+		fprintf(f, "total_redundant_bytes=%lld\ntotal_failed_bytes=%lld\n", s->total_redundant_bytes, s->total_failed_bytes);
+		fprintf(f, "num_peers=%d\nnum_unchoked=%d\nallowed_upload_slots=%d\n", s->num_peers, s->num_unchoked, s->allowed_upload_slots);
+		fprintf(f, "up_bandwidth_queue=%d\ndown_bandwidth_queue=%d\n", s->up_bandwidth_queue, s->down_bandwidth_queue);
+		fprintf(f, "dht_nodes=%d\ndht_torrents=%d\ndht_global_nodes=%lld\n", s->dht_nodes, s->dht_torrents, s->dht_global_nodes);
+	}
+	cor_status_unpin(st, pinned);
+
+	return cor_status_close(f, &text);
+}
+
+// Renders the latest sample of every torrent, one line each, starting
+// with its infohash in hex and followed by "<key>=<value>" pairs. Torrents
+// the session had no status for are listed with only |sampled|.
+//
+// RETURNS
+// The text, |*len| bytes of it, to be freed, or NULL if memory ran out.
+char* cor_status_torrents(struct cor_status* st, size_t* len)
+{
+	struct cor_status_snap* snap;
+	struct torrent_status* s;
+	const unsigned char* ih;
+	char* text = NULL;
+	FILE* f;
+	int pinned;
+	int i;
+	int j;
+
+	f = open_memstream(&text, len);
+	if(f == NULL)
+		return NULL;
+
+	snap = cor_status_pin(st, &pinned);
+	if(snap == NULL)
+		return cor_status_close(f, &text);
+
+	for(i = 0; i < st->num_torrents; i++)
+	{
+		ih = st->torrents[i].meta->hdr->infohash;
+		for(j = 0; j < 20; j++)
+			fprintf(f, "%02x", ih[j]);
+		fprintf(f, " sampled=%lld.%03ld", (long long)snap->taken.tv_sec, snap->taken.tv_nsec / 1000000);
+		if(!snap->valid[i])
+		{
+			fputc('\n', f);
+			continue;
+		}
+
+		s = &snap->tors[i];
+		fprintf(f, " state=%s paused=%d progress=%f",
+				((unsigned)s->state < sizeof(cor_status_states) / sizeof(cor_status_states[0])) ? cor_status_states[s->state] : "unknown",
+				s->paused, s->progress);
+		fprintf(f, " total_done=%lld total_wanted_done=%lld total_wanted=%lld",
+				s->total_done, s->total_wanted_done, s->total_wanted);
+		fprintf(f, " total_download=%lld total_upload=%lld total_failed_bytes=%lld total_redundant_bytes=%lld",
+				s->total_download, s->total_upload, s->total_failed_bytes, s->total_redundant_bytes);
+		fprintf(f, " download_rate=%.0f upload_rate=%.0f download_payload_rate=%.0f upload_payload_rate=%.0f",
+				s->download_rate, s->upload_rate, s->download_payload_rate, s->upload_payload_rate);
+		fprintf(f, " num_peers=%d num_seeds=%d num_complete=%d num_incomplete=%d num_connections=%d",
+				s->num_peers, s->num_seeds, s->num_complete, s->num_incomplete, s->num_connections);
+		fprintf(f, " distributed_copies=%f num_pieces=%d error=%d\n",
+				s->distributed_copies, s->num_pieces, s->error[0] != '\0');
+	}
+	cor_status_unpin(st, pinned);
+
+	return cor_status_close(f, &text);
+}
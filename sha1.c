@@ -0,0 +1,135 @@
+#include <string.h>
+
+#include "sha1.h"
+
+// Plain FIPS 180-1 SHA-1. Used for infohashes and piece verification,
+// neither of which needs a collision resistant hash from us; they need
+// the one the rest of the swarm uses.
+
+#define ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void sha1_transform(uint32_t state[5], const unsigned char block[64])
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, f, k, t;
+	int i;
+
+	for(i = 0; i < 16; i++)
+	{
+		w[i] = ((uint32_t)block[(i * 4)] << 24) | ((uint32_t)block[(i * 4) + 1] << 16)
+			| ((uint32_t)block[(i * 4) + 2] << 8) | (uint32_t)block[(i * 4) + 3];
+	}
+	for(i = 16; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+
+	for(i = 0; i < 80; i++)
+	{
+		if(i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		}
+		else if(i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if(i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void sha1_init(sha1_ctx* ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->count = 0;
+}
+void sha1_update(sha1_ctx* ctx, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	size_t used = ctx->count % 64;
+	size_t n;
+
+	ctx->count += len;
+	if(used)
+	{
+		n = 64 - used;
+		if(len < n)
+		{
+			memcpy(&ctx->block[used], p, len);
+			return;
+		}
+		memcpy(&ctx->block[used], p, n);
+		sha1_transform(ctx->state, ctx->block);
+		p += n;
+		len -= n;
+	}
+
+	// Hash whole blocks straight from the caller's buffer.
+	while(len >= 64)
+	{
+		sha1_transform(ctx->state, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy(ctx->block, p, len);
+}
+void sha1_final(sha1_ctx* ctx, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+	uint64_t bits = ctx->count * 8;
+	size_t used = ctx->count % 64;
+	int i;
+
+	ctx->block[used++] = 0x80;
+	if(used > 56)
+	{
+		memset(&ctx->block[used], 0, 64 - used);
+		sha1_transform(ctx->state, ctx->block);
+		used = 0;
+	}
+	memset(&ctx->block[used], 0, 56 - used);
+	for(i = 0; i < 8; i++)
+		ctx->block[56 + i] = (unsigned char)(bits >> (56 - (i * 8)));
+	sha1_transform(ctx->state, ctx->block);
+
+	for(i = 0; i < SHA1_DIGEST_SIZE; i++)
+		digest[i] = (unsigned char)(ctx->state[i / 4] >> (24 - ((i % 4) * 8)));
+}
+void sha1(const void* data, size_t len, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+	sha1_ctx ctx;
+	sha1_init(&ctx);
+	sha1_update(&ctx, data, len);
+	sha1_final(&ctx, digest);
+}
@@ -0,0 +1,21 @@
+#ifndef SHA1_H_
+#define SHA1_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+typedef struct sha1_ctx
+{
+  uint32_t state[5];
+  uint64_t count;
+  unsigned char block[64];
+} sha1_ctx;
+
+void sha1_init(sha1_ctx* ctx);
+void sha1_update(sha1_ctx* ctx, const void* data, size_t len);
+void sha1_final(sha1_ctx* ctx, unsigned char digest[SHA1_DIGEST_SIZE]);
+void sha1(const void* data, size_t len, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,292 @@
+// Bencode decode benchmark.
+//
+// Decodes every .torrent in the given directories, plus a set of
+// generated synthetic torrents, with each decoder configuration and
+// reports throughput, allocations per torrent and peak RSS.
+//
+// Build with `make bench` from Default/. Allocations are counted by
+// wrapping malloc/calloc/realloc at link time, so the numbers cover the
+// decoder only.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "bdecode.h"
+
+static unsigned long allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+void* __wrap_calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __real_calloc(n, size);
+}
+void* __wrap_realloc(void* p, size_t size)
+{
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+typedef struct bench_input
+{
+	char name[64];
+	unsigned char* buf;
+	size_t size;
+	bd_source* src;
+} bench_input;
+
+// Decoder configurations under test.
+enum
+{
+	MODE_HEAP,
+	MODE_ZEROCOPY,
+	MODE_ARENA,
+	MODE_TAPE,
+	MODE_INFOHASH,
+	MODE_COUNT
+};
+
+static const char* mode_names[] =
+{
+	"decode",
+	"zerocopy",
+	"arena",
+	"tape",
+	"infohash",
+};
+
+// Appends |len| bytes to a growing buffer.
+static void put(unsigned char** buf, size_t* used, size_t* alloc, const void* data, size_t len)
+{
+	while(*used + len > *alloc)
+	{
+		*alloc = *alloc ? *alloc * 2 : 4096;
+		*buf = realloc(*buf, *alloc);
+	}
+	memcpy(*buf + *used, data, len);
+	*used += len;
+}
+static void put_str(unsigned char** buf, size_t* used, size_t* alloc, const char* s)
+{
+	char hdr[32];
+	int n = snprintf(hdr, sizeof(hdr), "%zu:", strlen(s));
+	put(buf, used, alloc, hdr, n);
+	put(buf, used, alloc, s, strlen(s));
+}
+
+// Builds a canonical multi-file torrent with |files| files spread over
+// nested directories and |pieces| piece hashes.
+static void synth(bench_input* in, int files, long pieces)
+{
+	unsigned char* buf = NULL;
+	size_t used = 0;
+	size_t alloc = 0;
+	char tmp[128];
+	long i;
+	unsigned char* hashes;
+
+	put(&buf, &used, &alloc, "d", 1);
+	put_str(&buf, &used, &alloc, "announce");
+	put_str(&buf, &used, &alloc, "http://tracker.example.com/announce");
+	put_str(&buf, &used, &alloc, "info");
+	put(&buf, &used, &alloc, "d", 1);
+	put_str(&buf, &used, &alloc, "files");
+	put(&buf, &used, &alloc, "l", 1);
+	for(i = 0; i < files; i++)
+	{
+		put(&buf, &used, &alloc, "d", 1);
+		put_str(&buf, &used, &alloc, "length");
+		snprintf(tmp, sizeof(tmp), "i%lde", (i * 7919) % 1000000007);
+		put(&buf, &used, &alloc, tmp, strlen(tmp));
+		put_str(&buf, &used, &alloc, "path");
+		put(&buf, &used, &alloc, "l", 1);
+		snprintf(tmp, sizeof(tmp), "dir%03ld", i / 1000);
+		put_str(&buf, &used, &alloc, tmp);
+		snprintf(tmp, sizeof(tmp), "sub%02ld", (i / 100) % 10);
+		put_str(&buf, &used, &alloc, tmp);
+		snprintf(tmp, sizeof(tmp), "file%06ld.bin", i);
+		put_str(&buf, &used, &alloc, tmp);
+		put(&buf, &used, &alloc, "ee", 2);
+	}
+	put(&buf, &used, &alloc, "e", 1);
+	put_str(&buf, &used, &alloc, "name");
+	put_str(&buf, &used, &alloc, "synthetic");
+	put_str(&buf, &used, &alloc, "piece length");
+	put(&buf, &used, &alloc, "i262144e", 8);
+	put_str(&buf, &used, &alloc, "pieces");
+	snprintf(tmp, sizeof(tmp), "%ld:", pieces * 20);
+	put(&buf, &used, &alloc, tmp, strlen(tmp));
+	hashes = malloc(pieces * 20);
+	for(i = 0; i < pieces * 20; i++)
+		hashes[i] = (unsigned char)(i * 131);
+	put(&buf, &used, &alloc, hashes, pieces * 20);
+	free(hashes);
+	put(&buf, &used, &alloc, "ee", 2);
+
+	snprintf(in->name, sizeof(in->name), "synthetic-%df-%ldp", files, pieces);
+	in->buf = buf;
+	in->size = used;
+	in->src = NULL;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// Runs one decode of |in| in the given mode.
+static int run(bd_ctx* ctx, bench_input* in, int mode)
+{
+	bd_dict* d = NULL;
+	unsigned char hash[20];
+
+	switch(mode)
+	{
+		case MODE_HEAP:
+			d = decode(in->buf, in->size);
+			bd_dict_destroy(d);
+			break;
+		case MODE_ZEROCOPY:
+			d = decode_flags(in->buf, in->size, BD_ZEROCOPY);
+			bd_dict_destroy(d);
+			break;
+		case MODE_ARENA:
+			d = decode_ctx(ctx, in->buf, in->size);
+			bd_ctx_reset(ctx);
+			break;
+		case MODE_TAPE:
+			d = decode_tape(ctx, in->buf, in->size);
+			bd_ctx_reset(ctx);
+			break;
+		case MODE_INFOHASH:
+			return bd_infohash_scan(ctx, in->buf, in->size, hash) == 0;
+	}
+	return d != NULL;
+}
+
+static void bench(bench_input* in, double min_time)
+{
+	int mode;
+	long iters;
+	double start;
+	double elapsed;
+	unsigned long a;
+	bd_ctx* ctx;
+
+	for(mode = 0; mode < MODE_COUNT; mode++)
+	{
+		ctx = bd_ctx_create(BD_ZEROCOPY);
+
+		// One cold run to count allocations, including context warm-up.
+		a = allocs;
+		if(!run(ctx, in, mode))
+		{
+			printf("%-28s %-10s FAILED\n", in->name, mode_names[mode]);
+			bd_ctx_destroy(ctx);
+			continue;
+		}
+		a = allocs - a;
+
+		iters = 0;
+		start = now();
+		do
+		{
+			run(ctx, in, mode);
+			iters++;
+			elapsed = now() - start;
+		} while(elapsed < min_time);
+
+		printf("%-28s %-10s %10.1f MB/s %10.1f us %10lu allocs\n", in->name, mode_names[mode],
+				(in->size * (double)iters) / elapsed / 1e6, (elapsed / iters) * 1e6, a);
+		bd_ctx_destroy(ctx);
+	}
+}
+
+static int load_dir(const char* path, bench_input** inputs, int* count)
+{
+	DIR* dp;
+	struct dirent* de;
+	char fpath[4096];
+	size_t len;
+	bench_input* in;
+
+	dp = opendir(path);
+	if(dp == NULL)
+		return -1;
+
+	while((de = readdir(dp)) != NULL)
+	{
+		len = strlen(de->d_name);
+		if(len < 9 || strcmp(de->d_name + len - 8, ".torrent") != 0)
+			continue;
+
+		snprintf(fpath, sizeof(fpath), "%s/%s", path, de->d_name);
+		*inputs = realloc(*inputs, sizeof(bench_input) * (*count + 1));
+		in = &(*inputs)[*count];
+		in->src = bd_source_map(fpath);
+		if(in->src == NULL)
+			continue;
+		snprintf(in->name, sizeof(in->name), "%.27s", de->d_name);
+		in->buf = in->src->buf;
+		in->size = in->src->size;
+		(*count)++;
+	}
+	closedir(dp);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	bench_input* inputs = NULL;
+	int count = 0;
+	int i;
+	double min_time = 0.5;
+	struct rusage ru;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			min_time = atof(argv[++i]);
+		else if(load_dir(argv[i], &inputs, &count) < 0)
+			fprintf(stderr, "Could not read torrent directory %s.\n", argv[i]);
+	}
+
+	inputs = realloc(inputs, sizeof(bench_input) * (count + 4));
+	synth(&inputs[count++], 10, 100);
+	synth(&inputs[count++], 1000, 10000);
+	synth(&inputs[count++], 100000, 100000);
+	synth(&inputs[count++], 1000, 1000000);
+
+	for(i = 0; i < count; i++)
+	{
+		printf("%-28s %zu bytes\n", inputs[i].name, inputs[i].size);
+		bench(&inputs[i], min_time);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("peak RSS %ld KiB\n", ru.ru_maxrss);
+
+	for(i = 0; i < count; i++)
+	{
+		if(inputs[i].src)
+			bd_source_unmap(inputs[i].src);
+		else
+			free(inputs[i].buf);
+	}
+	free(inputs);
+	return 0;
+}
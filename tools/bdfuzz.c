@@ -0,0 +1,237 @@
+// Differential fuzz target for the bencode decoders.
+//
+// Every input is run through the recursive decoder, both in an arena
+// and on the heap as decode() does, the tape decoder, a BD_LAZY decode
+// and the streaming parser. They must all accept or all reject it. When
+// they accept it, every tree must be equal to the arena one, the lazy one
+// once each deferred value has been looked up, and the in-place infohash
+// must match the one computed from the tree. Any disagreement aborts.
+//
+// Built with libFuzzer (`make fuzz`, needs clang) this is a normal fuzz
+// target; seed it with torrents/. Built without it (`make fuzz-replay`)
+// it replays the files named on the command line instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bdecode.h"
+
+static int entry_equal(bd_entry* a, bd_entry* b);
+
+static int list_equal(bd_list* a, bd_list* b)
+{
+	int i;
+	if(a->used != b->used || a->start != b->start || a->end != b->end)
+		return 0;
+	for(i = 0; i < a->used; i++)
+	{
+		if(!entry_equal(&a->entries[i], &b->entries[i]))
+			return 0;
+	}
+	return 1;
+}
+static int dict_equal(bd_dict* a, bd_dict* b)
+{
+	int i;
+	if(a->used != b->used || a->sorted != b->sorted || a->start != b->start || a->end != b->end)
+		return 0;
+	for(i = 0; i < a->used; i++)
+	{
+		if(a->entries[i].keylen != b->entries[i].keylen)
+			return 0;
+		if(memcmp(a->entries[i].key, b->entries[i].key, a->entries[i].keylen) != 0)
+			return 0;
+		if(!entry_equal(&a->entries[i].value, &b->entries[i].value))
+			return 0;
+	}
+	return 1;
+}
+static int entry_equal(bd_entry* a, bd_entry* b)
+{
+	if(a->type != b->type)
+		return 0;
+	switch(a->type)
+	{
+		case NUMBER:
+			return a->data == b->data;
+		case STRING:
+			return a->len == b->len && memcmp(a->str, b->str, a->len) == 0;
+		case LIST:
+			return list_equal(a->list, b->list);
+		case DICTIONARY:
+			return dict_equal(a->dict, b->dict);
+	}
+	return 0;
+}
+
+// Looks up every deferred value of the lazily decoded |dict|, and of the
+// dictionaries below it, so that it can be compared with an eager tree.
+// Lookups go through bd_dict_find() whenever the key can be spelled as a
+// C string and is not shadowed by an equal key; anything else is
+// materialized directly.
+static void materialize_list(bd_list* list);
+static void materialize_dict(bd_dict* dict)
+{
+	char key[256];
+	bd_kvp* e;
+	int i;
+
+	for(i = 0; i < dict->used; i++)
+	{
+		e = &dict->entries[i];
+		if((e->value.flags & BD_DEFERRED) && e->keylen < sizeof(key))
+		{
+			memcpy(key, e->key, e->keylen);
+			key[e->keylen] = '\0';
+			if(strlen(key) == e->keylen && bd_dict_find(dict, key) == NULL)
+				abort();
+		}
+		if((e->value.flags & BD_DEFERRED) && bd_tape_materialize(dict->ctx, &e->value) < 0)
+			abort();
+
+		if(e->value.type == DICTIONARY)
+			materialize_dict(e->value.dict);
+		else if(e->value.type == LIST)
+			materialize_list(e->value.list);
+	}
+}
+static void materialize_list(bd_list* list)
+{
+	int i;
+
+	for(i = 0; i < list->used; i++)
+	{
+		if(list->entries[i].type == DICTIONARY)
+			materialize_dict(list->entries[i].dict);
+		else if(list->entries[i].type == LIST)
+			materialize_list(list->entries[i].list);
+	}
+}
+
+static int fuzz_count(void* user)
+{
+	(*(long*)user)++;
+	return 0;
+}
+static int fuzz_key(void* user, const char* key, size_t len)
+{
+	return fuzz_count(user);
+}
+static int fuzz_number(void* user, long long num)
+{
+	return fuzz_count(user);
+}
+static int fuzz_string(void* user, const char* str, size_t len, size_t remaining)
+{
+	return fuzz_count(user);
+}
+
+static const bd_stream_ops fuzz_ops =
+{
+	fuzz_count,
+	fuzz_count,
+	fuzz_key,
+	fuzz_number,
+	fuzz_string,
+	fuzz_count,
+};
+
+int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+	static bd_ctx* rctx;
+	static bd_ctx* tctx;
+	static bd_ctx* lctx;
+	unsigned char* buf;
+	bd_dict* rec;
+	bd_dict* heap;
+	bd_dict* tape;
+	bd_dict* lazy;
+	bd_stream s;
+	long events = 0;
+	int index = 0;
+	int stat = BD_STREAM_MORE;
+	size_t i;
+	unsigned char h1[20];
+	unsigned char h2[20];
+
+	if(rctx == NULL)
+	{
+		rctx = bd_ctx_create(BD_ZEROCOPY);
+		tctx = bd_ctx_create(BD_ZEROCOPY);
+		lctx = bd_ctx_create(BD_ZEROCOPY | BD_LAZY);
+	}
+	bd_ctx_reset(rctx);
+	bd_ctx_reset(tctx);
+	bd_ctx_reset(lctx);
+
+	// Exact-size copy so that ASan catches any read past the end.
+	buf = malloc(size ? size : 1);
+	memcpy(buf, data, size);
+
+	if(size == 0 || buf[0] != 'd')
+	{
+		// The streaming parser must survive garbage too.
+		bd_stream_init(&s, &fuzz_ops, &events);
+		bd_stream_feed(&s, buf, size);
+		bd_stream_free(&s);
+		free(buf);
+		return 0;
+	}
+
+	rec = decode_dictionary(rctx, buf, &index, size);
+	heap = decode(buf, size);
+	tape = decode_tape(tctx, buf, size);
+	lazy = decode_ctx(lctx, buf, size);
+	if((heap != NULL) != (rec != NULL) || (tape != NULL) != (rec != NULL) || (lazy != NULL) != (rec != NULL))
+		abort();
+
+	if(rec != NULL)
+	{
+		if(!dict_equal(rec, heap) || !dict_equal(rec, tape))
+			abort();
+		materialize_dict(lazy);
+		if(!dict_equal(rec, lazy))
+			abort();
+
+		bd_stream_init(&s, &fuzz_ops, &events);
+		for(i = 0; i < size && stat == BD_STREAM_MORE; i++)
+			stat = bd_stream_feed(&s, &buf[i], 1);
+		bd_stream_free(&s);
+		if(stat != BD_STREAM_DONE)
+			abort();
+
+		if(bd_infohash(rec, buf, size, h1) == 0)
+		{
+			if(bd_infohash_scan(tctx, buf, size, h2) != 0 || memcmp(h1, h2, 20) != 0)
+				abort();
+		}
+	}
+	if(heap != NULL)
+		bd_dict_destroy(heap);
+
+	free(buf);
+	return 0;
+}
+
+#ifdef BD_FUZZ_REPLAY
+int main(int argc, char* argv[])
+{
+	int i;
+	bd_source* src;
+
+	for(i = 1; i < argc; i++)
+	{
+		src = bd_source_map(argv[i]);
+		if(src == NULL)
+		{
+			fprintf(stderr, "Could not map %s.\n", argv[i]);
+			continue;
+		}
+		LLVMFuzzerTestOneInput(src->buf, src->size);
+		bd_source_unmap(src);
+		printf("%s: ok\n", argv[i]);
+	}
+	return 0;
+}
+#endif
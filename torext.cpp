@@ -0,0 +1,322 @@
+// Piece-level torrent controls missing from libtorrent's C bindings.
+//
+// The bindings hand out the session as an opaque pointer to a
+// libtorrent::session and torrents as indices into a table private to
+// the bindings. Torrents added here never enter that table, so they are
+// only ever reached through the handles below.
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <libtorrent/add_torrent_params.hpp>
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/session.hpp>
+#include <libtorrent/torrent_handle.hpp>
+#include <libtorrent/torrent_info.hpp>
+#include <libtorrent.h>
+
+#include "corsair.h"
+
+// Parses the .torrent at |path| into the parameters for adding it to a
+// session. Unlike the rest, this needs no session, so any number of
+// threads can parse at once.
+//
+// RETURNS
+// Opaque parameters to hand to cor_tor_add() or cor_tor_discard(), or
+// NULL if |path| isn't a torrent libtorrent accepts.
+void* cor_tor_parse(const char* path)
+{
+	libtorrent::add_torrent_params* p = NULL;
+	libtorrent::error_code ec;
+
+	try
+	{
+		p = new libtorrent::add_torrent_params;
+		p->ti = new libtorrent::torrent_info(path, ec);
+	}
+	catch(std::exception&)
+	{
+		delete p;
+		return NULL;
+	}
+	if(ec)
+	{
+		delete p;
+		return NULL;
+	}
+	return p;
+}
+void cor_tor_discard(void* params)
+{
+	delete static_cast<libtorrent::add_torrent_params*>(params);
+}
+
+// Adds the torrent parsed into |params| to the session |ses|, saving its
+// files under |save_path|. |params| is consumed either way.
+//
+// RETURNS
+// An opaque handle to pass to the other cor_tor_* functions, released
+// with cor_tor_release(), or NULL if |params| is NULL or the session
+// refused the torrent.
+void* cor_tor_add(void* ses, void* params, const char* save_path)
+{
+	libtorrent::session* s = static_cast<libtorrent::session*>(ses);
+	libtorrent::add_torrent_params* p = static_cast<libtorrent::add_torrent_params*>(params);
+	libtorrent::torrent_handle h;
+	libtorrent::error_code ec;
+
+	if(p == NULL)
+		return NULL;
+
+	try
+	{
+		p->save_path = save_path;
+		h = s->add_torrent(*p, ec);
+	}
+	catch(std::exception&)
+	{
+		h = libtorrent::torrent_handle();
+	}
+	delete p;
+	if(ec || !h.is_valid())
+		return NULL;
+	return new libtorrent::torrent_handle(h);
+}
+
+void cor_tor_release(void* tor)
+{
+	delete static_cast<libtorrent::torrent_handle*>(tor);
+}
+
+// RETURNS
+// 1 if |piece| has been downloaded and passed its hash check, 0 if not
+// and -1 if the torrent is gone.
+int cor_tor_have_piece(void* tor, int piece)
+{
+	libtorrent::torrent_handle* h = static_cast<libtorrent::torrent_handle*>(tor);
+
+	try
+	{
+		return h->have_piece(piece) ? 1 : 0;
+	}
+	catch(std::exception&)
+	{
+		return -1;
+	}
+}
+
+// Sets the bit in |bits| of each of the first |num_pieces| pieces that
+// |tor| has downloaded and verified.
+//
+// RETURNS
+// Zero on success, -1 if the torrent is gone.
+int cor_tor_have_pieces(void* tor, uint64_t* bits, int num_pieces)
+{
+	libtorrent::torrent_handle* h = static_cast<libtorrent::torrent_handle*>(tor);
+	int i;
+
+	try
+	{
+		libtorrent::torrent_status st = h->status();
+		num_pieces = std::min(num_pieces, st.pieces.size());
+		for(i = 0; i < num_pieces; i++)
+		{
+			if(st.pieces[i])
+				cor_bits_set(bits, i);
+		}
+	}
+	catch(std::exception&)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Fills |out| as the bindings' torrent_get_status() would for |tor|.
+//
+// RETURNS
+// Zero on success, -1 if the torrent is gone.
+int cor_tor_status(void* tor, struct torrent_status* out)
+{
+	libtorrent::torrent_handle* h = static_cast<libtorrent::torrent_handle*>(tor);
+
+	try
+	{
+		libtorrent::torrent_status st = h->status();
+
+		memset(out, 0, sizeof(struct torrent_status));
+		out->state = (enum state_t)st.state;
+		out->paused = st.paused;
+		out->progress = st.progress;
+		strncpy(out->error, st.error.c_str(), sizeof(out->error) - 1);
+		out->next_announce = st.next_announce.total_seconds();
+		out->announce_interval = st.announce_interval.total_seconds();
+		strncpy(out->current_tracker, st.current_tracker.c_str(), sizeof(out->current_tracker) - 1);
+		out->total_download = st.total_download;
+		out->total_upload = st.total_upload;
+		out->total_payload_download = st.total_payload_download;
+		out->total_payload_upload = st.total_payload_upload;
+		out->total_failed_bytes = st.total_failed_bytes;
+		out->total_redundant_bytes = st.total_redundant_bytes;
+		out->download_rate = st.download_rate;
+		out->upload_rate = st.upload_rate;
+		out->download_payload_rate = st.download_payload_rate;
+		out->upload_payload_rate = st.upload_payload_rate;
+		out->num_seeds = st.num_seeds;
+		out->num_peers = st.num_peers;
+		out->num_complete = st.num_complete;
+		out->num_incomplete = st.num_incomplete;
+		out->list_seeds = st.list_seeds;
+		out->list_peers = st.list_peers;
+		out->connect_candidates = st.connect_candidates;
+		out->num_pieces = st.num_pieces;
+		out->total_done = st.total_done;
+		out->total_wanted_done = st.total_wanted_done;
+		out->total_wanted = st.total_wanted;
+		out->distributed_copies = st.distributed_copies;
+		out->block_size = st.block_size;
+		out->num_uploads = st.num_uploads;
+		out->num_connections = st.num_connections;
+		out->uploads_limit = st.uploads_limit;
+		out->connections_limit = st.connections_limit;
+		out->up_bandwidth_queue = st.up_bandwidth_queue;
+		out->down_bandwidth_queue = st.down_bandwidth_queue;
+		out->all_time_upload = st.all_time_upload;
+		out->all_time_download = st.all_time_download;
+		out->active_time = st.active_time;
+		out->seeding_time = st.seeding_time;
+		out->seed_rank = st.seed_rank;
+		out->last_scrape = st.last_scrape;
+		out->has_incoming = st.has_incoming;
+		out->sparse_regions = st.sparse_regions;
+		out->seed_mode = st.seed_mode;
+	}
+	catch(std::exception&)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Moves the pieces [first, last] to the front of the download queue: top
+// priority, and a deadline of |deadline| milliseconds for |first| that
+// grows by |step| for each following piece so they arrive in order.
+//
+// RETURNS
+// Zero on success, -1 if the torrent is gone.
+int cor_tor_want_pieces(void* tor, int first, int last, int deadline, int step)
+{
+	libtorrent::torrent_handle* h = static_cast<libtorrent::torrent_handle*>(tor);
+	int i;
+
+	try
+	{
+		for(i = first; i <= last; i++)
+		{
+			if(h->have_piece(i))
+				continue;
+			h->piece_priority(i, 7);
+			h->set_piece_deadline(i, deadline + ((i - first) * step));
+		}
+	}
+	catch(std::exception&)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Undoes cor_tor_want_pieces() for the pieces in [first, last] that
+// haven't arrived, returning them to normal priority and the ordinary
+// rarest-first order.
+//
+// RETURNS
+// Zero on success, -1 if the torrent is gone.
+int cor_tor_unwant_pieces(void* tor, int first, int last)
+{
+	libtorrent::torrent_handle* h = static_cast<libtorrent::torrent_handle*>(tor);
+	int i;
+
+	try
+	{
+		for(i = first; i <= last; i++)
+		{
+			if(h->have_piece(i))
+				continue;
+			h->reset_piece_deadline(i);
+			h->piece_priority(i, 1);
+		}
+	}
+	catch(std::exception&)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Waits up to |timeout| milliseconds for alerts from the session |ses|,
+// then drains them, passing each one about a torrent's pieces or errors
+// to |fn| along with |arg|. Anything else is dropped, which takes care
+// of the rest of cat_status: the mask has to include it for
+// hash_failed_alert to be posted at all.
+//
+// RETURNS
+// The number of alerts passed on.
+int cor_tor_pump_alerts(void* ses, int timeout, cor_alert_fn fn, void* arg)
+{
+	libtorrent::session* s = static_cast<libtorrent::session*>(ses);
+	libtorrent::piece_finished_alert const* pf;
+	libtorrent::hash_failed_alert const* hf;
+	libtorrent::torrent_alert const* ta;
+	unsigned char infohash[20];
+	int count = 0;
+
+	if(s->wait_for_alert(libtorrent::milliseconds(timeout)) == NULL)
+		return 0;
+
+	for(std::auto_ptr<libtorrent::alert> a = s->pop_alert(); a.get() != NULL; a = s->pop_alert())
+	{
+		ta = dynamic_cast<libtorrent::torrent_alert const*>(a.get());
+		if(ta == NULL)
+			continue;
+
+		try
+		{
+			libtorrent::sha1_hash ih = ta->handle.info_hash();
+			std::copy(ih.begin(), ih.end(), infohash);
+		}
+		catch(std::exception&)
+		{
+			continue;
+		}
+
+		pf = libtorrent::alert_cast<libtorrent::piece_finished_alert>(a.get());
+		hf = libtorrent::alert_cast<libtorrent::hash_failed_alert>(a.get());
+		if(pf != NULL)
+			fn(arg, COR_ALERT_PIECE, infohash, pf->piece_index, NULL);
+		else if(hf != NULL)
+			fn(arg, COR_ALERT_HASH_FAILED, infohash, hf->piece_index, NULL);
+		else if(a->category() & libtorrent::alert::error_notification)
+			fn(arg, COR_ALERT_ERROR, infohash, -1, a->message().c_str());
+		else
+			continue;
+		count++;
+	}
+	return count;
+}
+
+// Has the session |ses| post an alert, to wake a thread blocked in
+// cor_tor_pump_alerts().
+void cor_tor_wake(void* ses)
+{
+	libtorrent::session* s = static_cast<libtorrent::session*>(ses);
+
+	try
+	{
+		s->post_torrent_updates();
+	}
+	catch(std::exception&)
+	{
+	}
+}